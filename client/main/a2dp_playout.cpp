@@ -0,0 +1,300 @@
+#include "a2dp_playout.h"
+#include "stream_bridge.h"
+
+#include <impl/log.h>
+
+#include <atomic>
+#include <cstring>
+#include <algorithm>
+
+static const char *TAG = "A2DP_PLAYOUT";
+
+#define A2DP_PLAYOUT_DEFAULT_SBC_FRAMES 128 // pcm frames per sbc frame until the first packet is decoded
+#define A2DP_PLAYOUT_PLC_FRAMES 128 // one sbc frame at 16 blocks x 8 subbands
+#define A2DP_PLAYOUT_PLC_MAX_MS 60 // longer gaps are not concealed, just skipped
+#define A2DP_PLAYOUT_MAX_UNDERRUNS 4 // consecutive underrun concealments before prefilling again
+#define A2DP_PLAYOUT_DRIFT_INTERVAL 1024 // frames between two single-frame slips
+
+enum slot_state_t : uint8_t {
+    SLOT_EMPTY = 0, // owned by push
+    SLOT_FILLED // owned by next/release
+};
+
+typedef struct {
+    std::atomic<uint8_t> state;
+    a2dp_playout::packet_t packet;
+} slot_t;
+
+enum playout_state_t {
+    PLAYOUT_PREFILL,
+    PLAYOUT_PLAYING
+};
+
+static slot_t slots[A2DP_PLAYOUT_SLOTS];
+
+// shared between the btstack run loop and the audio task
+static std::atomic<int> cfg_sample_rate{44100};
+static std::atomic<int> cfg_channels{2};
+static std::atomic<int> cfg_target_ms{60};
+static std::atomic<bool> restart_pending{true};
+static std::atomic<bool> synced;
+static std::atomic<uint16_t> played_seq; // last seq played or concealed, older arrivals are late
+static std::atomic<int> buffered; // depth at the last scan
+
+static std::atomic<uint32_t> st_received, st_late, st_lost, st_concealed, st_underruns, st_drift_adjusts;
+
+// audio task only
+static playout_state_t state = PLAYOUT_PREFILL;
+static uint16_t next_seq;
+static uint32_t expected_ts;
+static int sbc_frame_frames = A2DP_PLAYOUT_DEFAULT_SBC_FRAMES;
+static int last_packet_frames;
+static int underrun_run;
+static int depth_avg;
+static int drift; // >0 drops frames, <0 repeats frames
+static int frames_since_adjust;
+
+// decoded packet in flight
+static int16_t pcm_block[A2DP_PLAYOUT_PCM_FRAMES * 2];
+static int pcm_frames;
+static int pcm_channels = 2;
+
+static int16_t plc_buf[A2DP_PLAYOUT_PLC_FRAMES * 2];
+static int plc_frames;
+static int plc_channels = 2;
+static int32_t plc_gain; // Q15
+
+static int16_t seq_diff(uint16_t a, uint16_t b) {
+    return static_cast<int16_t>(a - b);
+}
+
+static int ms_to_frames(int ms) {
+    return ms * cfg_sample_rate / 1000;
+}
+
+static int packet_frames(const a2dp_playout::packet_t *packet) {
+    return packet->num_frames * sbc_frame_frames;
+}
+
+static void flush() {
+    for (auto &slot: slots) slot.state.store(SLOT_EMPTY, std::memory_order_release);
+    state = PLAYOUT_PREFILL;
+    synced = false;
+    underrun_run = 0;
+    drift = 0;
+    plc_frames = 0;
+    plc_channels = cfg_channels;
+}
+
+// Counts buffered packets, their frames and the seqs they cover, finds the oldest and the window up to the end of the
+// newest. The buffer is small enough to just scan it
+static int scan(uint16_t *oldest, int *depth, int *seqs, int *window) {
+    int count = 0;
+    uint16_t end = 0;
+    *depth = 0;
+    *seqs = 0;
+    for (auto &slot: slots) {
+        if (slot.state.load(std::memory_order_acquire) != SLOT_FILLED) continue;
+        uint16_t seq = slot.packet.seq;
+        if (state == PLAYOUT_PLAYING && seq_diff(seq, next_seq) < 0) { // slipped past the late check in push
+            st_late++;
+            slot.state.store(SLOT_EMPTY, std::memory_order_release);
+            continue;
+        }
+        if (!count || seq_diff(seq, *oldest) < 0) *oldest = seq;
+        auto seq_end = static_cast<uint16_t>(seq + slot.packet.seq_span);
+        if (!count || seq_diff(seq_end, end) > 0) end = seq_end;
+        *depth += packet_frames(&slot.packet);
+        *seqs += slot.packet.seq_span;
+        count++;
+    }
+    *window = count ? seq_diff(end, *oldest) : 0;
+    return count;
+}
+
+// Repeats the tail of the last decoded block, halving its gain on every repetition
+static void conceal(int frames) {
+    int16_t block[A2DP_PLAYOUT_PLC_FRAMES * 2];
+    int block_frames = plc_frames ? plc_frames : A2DP_PLAYOUT_PLC_FRAMES;
+    int frame_bytes = plc_channels * 2;
+
+    frames = std::min(frames, ms_to_frames(A2DP_PLAYOUT_PLC_MAX_MS));
+    st_concealed += frames;
+    while (frames > 0) {
+        int n = std::min(frames, block_frames);
+        if (plc_frames && plc_gain) {
+            for (int i = 0; i < n * plc_channels; ++i) block[i] = static_cast<int16_t>(plc_buf[i] * plc_gain >> 15);
+            plc_gain >>= 1;
+        } else {
+            memset(block, 0, n * frame_bytes);
+        }
+        stream_bridge::write(block, n * frame_bytes);
+        frames -= n;
+    }
+}
+
+void a2dp_playout::configure(int sample_rates, int channels, int target_ms) {
+    cfg_sample_rate = sample_rates;
+    cfg_channels = channels;
+    cfg_target_ms = target_ms;
+    restart();
+}
+
+void a2dp_playout::restart() {
+    synced = false;
+    restart_pending = true;
+}
+
+bool a2dp_playout::push(uint16_t seq, uint16_t seq_span, uint32_t timestamp, uint8_t num_frames,
+                        const uint8_t *data, int len) {
+    if (len > A2DP_PLAYOUT_PACKET_MAX || !num_frames || num_frames > A2DP_PLAYOUT_SBC_FRAMES_MAX) {
+        loge(TAG, "invalid packet: %d bytes, %d frames", len, num_frames);
+        return false;
+    }
+    st_received++;
+    if (synced.load(std::memory_order_acquire) && seq_diff(seq, played_seq.load(std::memory_order_acquire)) <= 0) {
+        st_late++;
+        return false;
+    }
+    slot_t *slot = &slots[seq % A2DP_PLAYOUT_SLOTS];
+    if (slot->state.load(std::memory_order_acquire) != SLOT_EMPTY) { // buffer full or duplicate
+        st_late++;
+        return false;
+    }
+    slot->packet.seq = seq;
+    slot->packet.seq_span = seq_span;
+    slot->packet.timestamp = timestamp;
+    slot->packet.num_frames = num_frames;
+    slot->packet.len = len;
+    memcpy(slot->packet.data, data, len);
+    slot->state.store(SLOT_FILLED, std::memory_order_release);
+    return true;
+}
+
+const a2dp_playout::packet_t *a2dp_playout::next() {
+    if (restart_pending.exchange(false)) flush();
+
+    uint16_t oldest = 0;
+    int depth, seqs, window;
+    int count = scan(&oldest, &depth, &seqs, &window);
+    buffered = depth;
+    int frames = last_packet_frames ? last_packet_frames : sbc_frame_frames;
+
+    // slots go by seq, so they hold frames per seq times the slot count: little with one sbc frame per packet or a
+    // frame fragmented over several. The target stays a packet below that, so push has a slot to fill meanwhile
+    int target = ms_to_frames(cfg_target_ms);
+    if (count) {
+        int capacity = depth * A2DP_PLAYOUT_SLOTS / seqs;
+        target = std::min(target, capacity - depth / count);
+    }
+
+    if (state == PLAYOUT_PREFILL) {
+        // a full window of seqs takes no more packets whatever the gaps in it, waiting longer would stall
+        if (!count || (depth < target && window < A2DP_PLAYOUT_SLOTS)) return nullptr;
+        next_seq = oldest;
+        expected_ts = slots[oldest % A2DP_PLAYOUT_SLOTS].packet.timestamp;
+        played_seq.store(static_cast<uint16_t>(oldest - 1), std::memory_order_release);
+        synced.store(true, std::memory_order_release);
+        depth_avg = depth;
+        state = PLAYOUT_PLAYING;
+        logi(TAG, "playout started at seq %u, %d packets buffered", oldest, count);
+    }
+
+    slot_t *slot = &slots[next_seq % A2DP_PLAYOUT_SLOTS];
+    bool ready = slot->state.load(std::memory_order_acquire) == SLOT_FILLED && slot->packet.seq == next_seq;
+    if (ready) frames = packet_frames(&slot->packet);
+
+    // only decode once the sink has room for the whole packet, the rest waits here
+    int packet_bytes = frames * plc_channels * 2;
+    if (stream_bridge::bytes_can_write() < packet_bytes) return nullptr;
+
+    if (ready) {
+        depth_avg += (depth - depth_avg) / 16;
+        int hysteresis = target / 4;
+        drift = depth_avg > target + hysteresis ? 1 : depth_avg < target - hysteresis ? -1 : 0;
+        underrun_run = 0;
+        pcm_frames = 0;
+        return &slot->packet;
+    }
+
+    bool sink_low = stream_bridge::bytes_queued() < packet_bytes;
+    if (!sink_low) return nullptr; // give reordered packets until the last moment
+
+    if (count) { // next_seq is lost, conceal up to the oldest buffered packet
+        const packet_t *resume = &slots[oldest % A2DP_PLAYOUT_SLOTS].packet;
+        int missing = seq_diff(oldest, next_seq);
+        auto gap = static_cast<int32_t>(resume->timestamp - expected_ts);
+        st_lost += missing;
+        conceal(gap > 0 && gap <= ms_to_frames(A2DP_PLAYOUT_PLC_MAX_MS) ? gap : missing * frames);
+        next_seq = oldest;
+        expected_ts = resume->timestamp;
+        played_seq.store(static_cast<uint16_t>(oldest - 1), std::memory_order_release);
+        return next();
+    }
+
+    st_underruns++;
+    if (++underrun_run > A2DP_PLAYOUT_MAX_UNDERRUNS) {
+        logi(TAG, "stream stalled at seq %u, prefilling", next_seq);
+        flush();
+        return nullptr;
+    }
+    conceal(frames);
+    return nullptr;
+}
+
+void a2dp_playout::release(const packet_t *packet) {
+    slot_t *slot = &slots[packet->seq % A2DP_PLAYOUT_SLOTS];
+    uint16_t last_seq = packet->seq + packet->seq_span - 1;
+    expected_ts = packet->timestamp + pcm_frames;
+    next_seq = last_seq + 1;
+    if (pcm_frames) {
+        last_packet_frames = pcm_frames;
+        sbc_frame_frames = pcm_frames / packet->num_frames;
+    }
+    played_seq.store(last_seq, std::memory_order_release);
+    slot->state.store(SLOT_EMPTY, std::memory_order_release);
+    if (!pcm_frames) return;
+
+    // clock drift: slip or repeat a single frame now and then to hold the buffer at its target
+    int frames = pcm_frames;
+    frames_since_adjust += pcm_frames;
+    if (drift && frames_since_adjust >= A2DP_PLAYOUT_DRIFT_INTERVAL && frames > 1) {
+        if (drift > 0) {
+            frames--;
+        } else if (frames < A2DP_PLAYOUT_PCM_FRAMES) {
+            memcpy(pcm_block + frames * pcm_channels, pcm_block + (frames - 1) * pcm_channels, pcm_channels * 2);
+            frames++;
+        }
+        frames_since_adjust = 0;
+        st_drift_adjusts++;
+    }
+    stream_bridge::write(pcm_block, frames * pcm_channels * 2);
+
+    plc_channels = pcm_channels;
+    plc_frames = std::min(frames, A2DP_PLAYOUT_PLC_FRAMES);
+    memcpy(plc_buf, pcm_block + (frames - plc_frames) * pcm_channels, plc_frames * plc_channels * 2);
+    plc_gain = 0x7FFF;
+}
+
+void a2dp_playout::write_pcm(const int16_t *data, int num_audio_frames, int num_channels) {
+    if (pcm_frames && num_channels != pcm_channels) return;
+    pcm_channels = num_channels;
+    int n = std::min(num_audio_frames, A2DP_PLAYOUT_PCM_FRAMES - pcm_frames);
+    memcpy(pcm_block + pcm_frames * num_channels, data, n * num_channels * 2);
+    pcm_frames += n;
+}
+
+int a2dp_playout::buffered_frames() {
+    return buffered;
+}
+
+a2dp_playout::stats_t a2dp_playout::stats() {
+    return {
+            .received = st_received,
+            .late = st_late,
+            .lost = st_lost,
+            .concealed_frames = st_concealed,
+            .underruns = st_underruns,
+            .drift_adjusts = st_drift_adjusts,
+    };
+}
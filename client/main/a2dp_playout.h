@@ -0,0 +1,55 @@
+#ifndef A2DP_PLAYOUT_H
+#define A2DP_PLAYOUT_H
+
+#include <cstdint>
+
+#define A2DP_PLAYOUT_SLOTS 16 // power of two, so seq % slots survives the 16-bit wrap
+#define A2DP_PLAYOUT_PACKET_MAX 1024
+#define A2DP_PLAYOUT_SBC_FRAMES_MAX 15 // 4-bit num_frames in the sbc payload header
+#define A2DP_PLAYOUT_PCM_FRAMES (A2DP_PLAYOUT_SBC_FRAMES_MAX * 128) // one packet at 16 blocks x 8 subbands
+
+namespace a2dp_playout {
+    typedef struct {
+        uint16_t seq;
+        uint16_t seq_span; // rtp packets a fragmented sbc frame was reassembled from, 1 otherwise
+        uint32_t timestamp;
+        uint8_t num_frames;
+        uint16_t len;
+        uint8_t data[A2DP_PLAYOUT_PACKET_MAX];
+    } packet_t;
+
+    typedef struct {
+        uint32_t received;
+        uint32_t late; // arrived after its slot was played or concealed, or buffer full
+        uint32_t lost;
+        uint32_t concealed_frames;
+        uint32_t underruns;
+        uint32_t drift_adjusts;
+    } stats_t;
+
+    // Target is the depth kept in the jitter buffer on top of the stream_bridge dma
+    void configure(int sample_rates, int channels, int target_ms);
+
+    // Drops buffered packets and prefills again, called on stream start
+    void restart();
+
+    // Producer side (btstack run loop), returns false if the packet was dropped
+    bool push(uint16_t seq, uint16_t seq_span, uint32_t timestamp, uint8_t num_frames, const uint8_t *data, int len);
+
+    // Consumer side (audio task): next packet to decode once the sink has room, nullptr to wait.
+    // Losses and underruns are concealed here
+    const packet_t *next();
+
+    // Writes the decoded packet to the sink in one go, with drift correction applied
+    void release(const packet_t *packet);
+
+    // Decoder output, collected into one contiguous block per packet
+    void write_pcm(const int16_t *data, int num_audio_frames, int num_channels);
+
+    // Frames waiting in the jitter buffer, safe to call from any thread
+    int buffered_frames();
+
+    stats_t stats();
+}
+
+#endif //A2DP_PLAYOUT_H
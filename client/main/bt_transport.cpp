@@ -1,5 +1,6 @@
 #include "bt_transport.h"
 #include "sco_util.h"
+#include "a2dp_playout.h"
 #include "stream_bridge.h"
 #include "common_util.h"
 
@@ -9,6 +10,10 @@
 #include <btstack_port_esp32.h>
 #include <btstack_stdio_esp32.h>
 
+#include <atomic>
+#include <algorithm>
+#include <cinttypes>
+
 #include "sdkconfig.h"
 #if !CONFIG_BT_ENABLED
 #error "Bluetooth disabled - please set CONFIG_BT_ENABLED via menuconfig -> Component Config -> Bluetooth -> [x] Bluetooth"
@@ -37,7 +42,7 @@ static const uint8_t hf_codecs[] = {
 #endif
 };
 
-static const uint8_t a2dp_codec_capabilities[] = {
+static const uint8_t a2dp_sbc_capabilities[] = {
         0xFF, // (AVDTP_SBC_16000 << 4) | AVDTP_SBC_STEREO,
         0xFF, // (AVDTP_SBC_BLOCK_LENGTH_16 << 4) | (AVDTP_SBC_SUBBANDS_8 << 2) | AVDTP_SBC_ALLOCATION_METHOD_LOUDNESS,
         2, 53 // bitpool range
@@ -58,8 +63,14 @@ static const uint16_t hf_supported_features =
 static const uint8_t rfcomm_channel_nr = 1;
 static const char hf_service_name[] = "HFP HF";
 
-#define A2DP_NUM_CHANNELS 2
-#define A2DP_BYTES_PER_SAMPLE 2
+#define A2DP_PLAYOUT_TARGET_MS 60 // jitter buffer depth on top of the sink dma
+#define A2DP_PLAYOUT_TICK_MS 5 // audio task wakeup when no packets arrive, drives concealment
+#define A2DP_CODEC_CONFIGURATION_MAX 16 // largest media codec information element we accept
+#define A2DP_DELAY_REPORT_PERIOD_MS 250
+#define A2DP_DELAY_REPORT_STEP_MS 5 // smaller pipeline changes are not reported
+
+#define BT_STACK_CORE 0
+#define A2DP_AUDIO_CORE 1
 
 static const char *TAG = "BT_TRANSPORT";
 
@@ -80,6 +91,23 @@ typedef struct {
     sbc_codec_conf_t sbc_configuration;
 } a2dp_sink_a2dp_connection_t;
 
+// generic a2dp codec struct, see a2dp_codecs for the registration order
+typedef struct {
+    const char *name;
+    avdtp_media_codec_type_t type;
+
+    const uint8_t *capabilities;
+    uint16_t capabilities_size;
+
+    // btstack run loop: parses the codec payload header and feeds a2dp_playout, true if a packet was queued
+    bool (*receive)(uint8_t *packet, uint16_t size, int pos, const avdtp_media_packet_header_t *media_header);
+
+    // audio task
+    void (*init)();
+
+    void (*decode)(const uint8_t *data, uint16_t size);
+} a2dp_codec_t;
+
 typedef struct {
     bd_addr_t addr;
     uint16_t avrcp_cid;
@@ -99,7 +127,30 @@ static uint8_t sdp_hfp_service_buffer[150];
 ESP_EVENT_DEFINE_BASE(BT_TRANSPORT);
 
 static const btstack_sbc_decoder_t *sbc_decoder_instance;
-btstack_sbc_decoder_bluedroid_t sbc_decoder_context;
+static btstack_sbc_decoder_bluedroid_t sbc_decoder_context;
+
+// media packets go through a2dp_playout, the semaphore only wakes the audio task
+static semaphore_t a2dp_media_sem;
+static std::atomic<bool> a2dp_decoder_reset;
+static std::atomic<const a2dp_codec_t *> a2dp_codec_current;
+
+// decode cost per codec frame, written by the audio task
+static std::atomic<uint32_t> a2dp_decode_us_avg;
+static std::atomic<uint32_t> a2dp_decode_us_max;
+static std::atomic<uint32_t> a2dp_decode_frames; // codec frames in the last packet
+
+static btstack_timer_source_t a2dp_delay_report_timer;
+static uint16_t a2dp_delay_reported; // 1/10 ms, as avdtp wants it
+
+// sbc frame split over several media packets, btstack run loop only
+static struct {
+    bool active;
+    uint16_t first_seq;
+    uint16_t next_seq;
+    uint32_t timestamp;
+    int len;
+    uint8_t data[A2DP_PLAYOUT_PACKET_MAX];
+} a2dp_fragment;
 
 static uint16_t hf_indicators[1] = {0x01};
 static uint8_t hf_negotiated_codec = HFP_CODEC_CVSD;
@@ -111,9 +162,24 @@ static avrcp_battery_status_t battery_status = AVRCP_BATTERY_STATUS_WARNING;
 
 static void bt_stack_thread(void *);
 
+static void a2dp_codecs_register();
+
+static const a2dp_codec_t *a2dp_codec_by_seid(uint8_t seid);
+
+static uint16_t a2dp_pipeline_delay();
+
+static uint16_t a2dp_target_delay();
+
+static void a2dp_delay_report_send(uint16_t delay);
+
+static void a2dp_delay_report_handler(btstack_timer_source_t *ts);
+
 void bt_stack_event_handler(void* event_handler_arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
 
 static thread_t run_thread;
+static thread_t audio_thread;
+
+static void a2dp_audio_task(void *);
 
 // Bt event callbacks
 
@@ -139,11 +205,39 @@ static int read_media_data_header(uint8_t *packet, int size, int *offset, avdtp_
 
 static int read_sbc_header(uint8_t *packet, int size, int *offset, avdtp_sbc_codec_header_t *sbc_header);
 
+// A2DP codecs
+
+static bool sbc_receive(uint8_t *packet, uint16_t size, int pos, const avdtp_media_packet_header_t *media_header);
+
+static void sbc_init();
+
+static void sbc_decode(const uint8_t *data, uint16_t size);
+
+static const a2dp_codec_t a2dp_codec_sbc = {
+        .name = "SBC",
+        .type = AVDTP_CODEC_SBC,
+        .capabilities = a2dp_sbc_capabilities,
+        .capabilities_size = sizeof(a2dp_sbc_capabilities),
+        .receive = sbc_receive,
+        .init = sbc_init,
+        .decode = sbc_decode,
+};
+
+// Endpoints are registered in order of preference, sources pick the best one they share with us.
+// AAC / vendor (LDAC-style) entries go above sbc once their decoder is available
+static const a2dp_codec_t *const a2dp_codecs[] = {
+        &a2dp_codec_sbc,
+};
+
+#define A2DP_CODEC_COUNT (int) (sizeof(a2dp_codecs) / sizeof(a2dp_codecs[0]))
+
+static uint8_t a2dp_codec_configuration[A2DP_CODEC_COUNT][A2DP_CODEC_CONFIGURATION_MAX];
+static uint8_t a2dp_codec_seid[A2DP_CODEC_COUNT];
+
 // Defs
 
 void bt_stack_thread(void *) {
     static btstack_packet_callback_registration_t hci_event_callback_registration;
-    static uint8_t sbc_codec_configuration_dummy[4]; // or is it dummy
 
     btstack_stdio_init();
     btstack_init();
@@ -171,14 +265,7 @@ void bt_stack_thread(void *) {
     // Configure A2DP Sink
     a2dp_sink_register_packet_handler(&a2dp_sink_cb);
     a2dp_sink_register_media_handler(&l2cap_media_cb);
-    avdtp_stream_endpoint_t *local_stream_endpoint =
-            a2dp_sink_create_stream_endpoint(AVDTP_AUDIO, AVDTP_CODEC_SBC,
-                                             a2dp_codec_capabilities, sizeof(a2dp_codec_capabilities),
-                                             sbc_codec_configuration_dummy,
-                                             sizeof(sbc_codec_configuration_dummy));
-    btstack_assert(local_stream_endpoint != nullptr);
-    // - Store stream enpoint's SEP ID, as it is used by A2DP API to identify the stream endpoint
-//    stream_endpoint->a2dp_local_seid = avdtp_local_seid(local_stream_endpoint);
+    a2dp_codecs_register();
 
     // Configure AVRCP Controller + Target
     avrcp_register_packet_handler(&avrcp_cb);
@@ -287,10 +374,50 @@ void bt_stack_event_handler(void* event_handler_arg, esp_event_base_t event_base
 void bt_transport::init() { // TODO: write bt_transport::deinit
     event_bridge::set_listener(BT_TRANSPORT, bt_stack_event_handler);
 
-    thread_init(&run_thread, bt_stack_thread, "bt_transport_task", 15, 8192);
+    bin_sem_init(&a2dp_media_sem);
+    thread_init(&audio_thread, a2dp_audio_task, "a2dp_audio_task", 14, 8192, A2DP_AUDIO_CORE);
+    thread_launch(&audio_thread);
+
+    thread_init(&run_thread, bt_stack_thread, "bt_transport_task", 15, 8192, BT_STACK_CORE);
     thread_launch(&run_thread);
 }
 
+static void log_playout_stats() {
+    a2dp_playout::stats_t st = a2dp_playout::stats();
+    logi(TAG, "A2DP playout: received %" PRIu32 ", late %" PRIu32 ", lost %" PRIu32 ", concealed %" PRIu32
+              " frames, underruns %" PRIu32 ", drift adjusts %" PRIu32,
+         st.received, st.late, st.lost, st.concealed_frames, st.underruns, st.drift_adjusts);
+    const a2dp_codec_t *codec = a2dp_codec_current;
+    if (codec)
+        logi(TAG, "A2DP %s decode: %" PRIu32 " us/frame avg, %" PRIu32 " us/frame max", codec->name,
+             a2dp_decode_us_avg.load(), a2dp_decode_us_max.load());
+}
+
+void a2dp_audio_task(void *) {
+    logi(TAG, "a2dp_audio_task is started");
+    while (true) {
+        bin_sem_take(&a2dp_media_sem, A2DP_PLAYOUT_TICK_MS);
+        const a2dp_codec_t *codec = a2dp_codec_current;
+        if (!codec) continue;
+        if (a2dp_decoder_reset.exchange(false)) {
+            codec->init();
+            a2dp_decode_us_avg = 0;
+            a2dp_decode_us_max = 0;
+        }
+
+        while (const a2dp_playout::packet_t *packet = a2dp_playout::next()) {
+            uint32_t start = stream_bridge::clock_us();
+            codec->decode(packet->data, packet->len);
+            uint32_t cost = (stream_bridge::clock_us() - start) / packet->num_frames;
+            uint32_t avg = a2dp_decode_us_avg;
+            a2dp_decode_us_avg = avg ? (avg * 15 + cost) / 16 : cost;
+            a2dp_decode_us_max = std::max(a2dp_decode_us_max.load(), cost);
+            a2dp_decode_frames = packet->num_frames;
+            a2dp_playout::release(packet);
+        }
+    }
+}
+
 void hci_cb(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size) {
     bd_addr_t event_addr;
 
@@ -334,10 +461,16 @@ void a2dp_sink_cb(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16
 
     switch (packet[2]) {
         case A2DP_SUBEVENT_SIGNALING_MEDIA_CODEC_OTHER_CONFIGURATION:
-            logi(TAG, "A2DP received non SBC codec - not implemented");
+            // only sbc configures the sink and the playout, media of anything else is dropped instead of played
+            // through a sink set up for another stream
+            loge(TAG, "A2DP codec 0x%02x rejected, no sink and playout configuration for it",
+                 a2dp_subevent_signaling_media_codec_other_configuration_get_media_codec_type(packet));
+            a2dp_codec_current = nullptr;
             break;
         case A2DP_SUBEVENT_SIGNALING_MEDIA_CODEC_SBC_CONFIGURATION: {
             logi(TAG, "A2DP received SBC codec configuration");
+            a2dp_codec_current = a2dp_codec_by_seid(
+                    a2dp_subevent_signaling_media_codec_sbc_configuration_get_local_seid(packet));
             a2dp_conn_info.sbc_configuration.reconfigure = a2dp_subevent_signaling_media_codec_sbc_configuration_get_reconfigure(
                     packet);
             a2dp_conn_info.sbc_configuration.num_channels = a2dp_subevent_signaling_media_codec_sbc_configuration_get_num_channels(
@@ -366,7 +499,10 @@ void a2dp_sink_cb(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16
             }
             stream_bridge::configure_sink(a2dp_conn_info.sbc_configuration.sampling_frequency,
                                           a2dp_conn_info.sbc_configuration.num_channels,
-                                          a2dp_conn_info.sbc_configuration.block_length);
+                                          a2dp_conn_info.sbc_configuration.block_length,
+                                          STREAM_LATENCY_MUSIC_MS);
+            a2dp_playout::configure(a2dp_conn_info.sbc_configuration.sampling_frequency,
+                                    a2dp_conn_info.sbc_configuration.num_channels, A2DP_PLAYOUT_TARGET_MS);
             break;
         }
 
@@ -382,6 +518,8 @@ void a2dp_sink_cb(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16
             a2dp_conn_info.a2dp_local_seid = a2dp_subevent_stream_established_get_local_seid(packet);
 
             logi(TAG, "A2DP streaming connection is established");
+            // nothing is buffered yet, the pipeline will settle on the prefill, the timer refines it from there
+            a2dp_delay_report_send(a2dp_target_delay());
             event_bridge::post(APPLICATION, event_bridge::VOL_DATA_RQ, BT_TRANSPORT);
             break;
         case A2DP_SUBEVENT_STREAM_STARTED: {
@@ -390,21 +528,35 @@ void a2dp_sink_cb(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16
                 logi(TAG, "A2DP stream reconfigure");
             }
 
-            sbc_decoder_instance = btstack_sbc_decoder_bluedroid_init_instance(&sbc_decoder_context);
-            sbc_decoder_instance->configure(&sbc_decoder_context, SBC_MODE_STANDARD, a2dp_pcm_data_cb, nullptr);
+            // decoder is reconfigured by the audio task, before it plays the new stream
+            a2dp_playout::restart();
+            a2dp_decoder_reset = true;
+            bin_sem_give(&a2dp_media_sem);
+
+            btstack_run_loop_remove_timer(&a2dp_delay_report_timer);
+            btstack_run_loop_set_timer_handler(&a2dp_delay_report_timer, a2dp_delay_report_handler);
+            btstack_run_loop_set_timer(&a2dp_delay_report_timer, A2DP_DELAY_REPORT_PERIOD_MS);
+            btstack_run_loop_add_timer(&a2dp_delay_report_timer);
             break;
         }
         case A2DP_SUBEVENT_STREAM_SUSPENDED:
             logi(TAG, "A2DP stream paused");
+            log_playout_stats();
+            a2dp_playout::restart();
+            btstack_run_loop_remove_timer(&a2dp_delay_report_timer);
             break;
 
         case A2DP_SUBEVENT_STREAM_RELEASED:
             logi(TAG, "A2DP stream released");
+            log_playout_stats();
+            a2dp_playout::restart();
+            btstack_run_loop_remove_timer(&a2dp_delay_report_timer);
             break;
 
         case A2DP_SUBEVENT_SIGNALING_CONNECTION_RELEASED:
             logi(TAG, "A2DP signaling connection released");
             a2dp_conn_info.a2dp_cid = 0;
+            btstack_run_loop_remove_timer(&a2dp_delay_report_timer);
             break;
 
         default:
@@ -418,13 +570,117 @@ void l2cap_media_cb(uint8_t seid, uint8_t *packet, uint16_t size) {
     avdtp_media_packet_header_t media_header;
     if (!read_media_data_header(packet, size, &pos, &media_header)) return;
 
+    const a2dp_codec_t *codec = a2dp_codec_current;
+    if (!codec) return;
+    if (codec->receive(packet, size, pos, &media_header)) bin_sem_give(&a2dp_media_sem);
+}
+
+// A2DP codecs
+
+bool sbc_receive(uint8_t *packet, uint16_t size, int pos, const avdtp_media_packet_header_t *media_header) {
     avdtp_sbc_codec_header_t sbc_header;
-    if (!read_sbc_header(packet, size, &pos, &sbc_header)) return;
+    if (!read_sbc_header(packet, size, &pos, &sbc_header)) return false;
 
     int packet_length = size - pos;
-    uint8_t *packet_begin = packet + pos;
+    uint16_t seq = media_header->sequence_number;
+    if (!sbc_header.fragmentation)
+        return a2dp_playout::push(seq, 1, media_header->timestamp, sbc_header.num_frames, packet + pos, packet_length);
+
+    // num_frames counts the fragments left, the reassembled packet is a single sbc frame
+    if (sbc_header.starting_packet) {
+        a2dp_fragment.active = true;
+        a2dp_fragment.first_seq = seq;
+        a2dp_fragment.timestamp = media_header->timestamp;
+        a2dp_fragment.len = 0;
+    } else if (!a2dp_fragment.active || seq != a2dp_fragment.next_seq) {
+        a2dp_fragment.active = false; // a fragment is missing, the playout conceals the whole frame
+        return false;
+    }
+    if (a2dp_fragment.len + packet_length > A2DP_PLAYOUT_PACKET_MAX) {
+        loge(TAG, "A2DP fragmented frame too large");
+        a2dp_fragment.active = false;
+        return false;
+    }
+    memcpy(a2dp_fragment.data + a2dp_fragment.len, packet + pos, packet_length);
+    a2dp_fragment.len += packet_length;
+    a2dp_fragment.next_seq = seq + 1;
+    if (!sbc_header.last_packet) return false;
+
+    a2dp_fragment.active = false;
+    return a2dp_playout::push(a2dp_fragment.first_seq, seq - a2dp_fragment.first_seq + 1,
+                              a2dp_fragment.timestamp, 1, a2dp_fragment.data, a2dp_fragment.len);
+}
+
+void sbc_init() {
+    sbc_decoder_instance = btstack_sbc_decoder_bluedroid_init_instance(&sbc_decoder_context);
+    sbc_decoder_instance->configure(&sbc_decoder_context, SBC_MODE_STANDARD, a2dp_pcm_data_cb, nullptr);
+}
+
+void sbc_decode(const uint8_t *data, uint16_t size) {
+    sbc_decoder_instance->decode_signed_16(&sbc_decoder_context, 0, const_cast<uint8_t *>(data), size);
+}
+
+void a2dp_codecs_register() {
+    for (int i = 0; i < A2DP_CODEC_COUNT; ++i) {
+        const a2dp_codec_t *codec = a2dp_codecs[i];
+        avdtp_stream_endpoint_t *endpoint =
+                a2dp_sink_create_stream_endpoint(AVDTP_AUDIO, codec->type, codec->capabilities,
+                                                 codec->capabilities_size, a2dp_codec_configuration[i],
+                                                 sizeof(a2dp_codec_configuration[i]));
+        btstack_assert(endpoint != nullptr);
+        a2dp_codec_seid[i] = avdtp_local_seid(endpoint);
+        avdtp_sink_register_delay_reporting_category(a2dp_codec_seid[i]);
+        logi(TAG, "A2DP %s endpoint, seid %d", codec->name, a2dp_codec_seid[i]);
+    }
+}
+
+const a2dp_codec_t *a2dp_codec_by_seid(uint8_t seid) {
+    for (int i = 0; i < A2DP_CODEC_COUNT; ++i)
+        if (a2dp_codec_seid[i] == seid) return a2dp_codecs[i];
+    return nullptr;
+}
+
+// Delay reporting
+
+// Jitter buffer + sink dma + one packet of decoding, in 1/10 ms
+uint16_t a2dp_pipeline_delay() {
+    int rate = a2dp_conn_info.sbc_configuration.sampling_frequency;
+    int frame_bytes = a2dp_conn_info.sbc_configuration.num_channels * 2;
+    if (!rate || !frame_bytes) return 0;
+
+    int64_t frames = a2dp_playout::buffered_frames() + stream_bridge::bytes_queued() / frame_bytes;
+    int64_t us = frames * 1000000 / rate + a2dp_decode_us_avg * a2dp_decode_frames;
+    return static_cast<uint16_t>(std::min<int64_t>(us / 100, UINT16_MAX));
+}
+
+// Prefill of the jitter buffer + the whole sink dma, in 1/10 ms
+uint16_t a2dp_target_delay() {
+    int rate = a2dp_conn_info.sbc_configuration.sampling_frequency;
+    int frame_bytes = a2dp_conn_info.sbc_configuration.num_channels * 2;
+    if (!rate || !frame_bytes) return 0;
+
+    int64_t dma_frames = (stream_bridge::bytes_queued() + stream_bridge::bytes_can_write()) / frame_bytes;
+    int64_t us = A2DP_PLAYOUT_TARGET_MS * 1000 + dma_frames * 1000000 / rate;
+    return static_cast<uint16_t>(std::min<int64_t>(us / 100, UINT16_MAX));
+}
+
+void a2dp_delay_report_send(uint16_t delay) {
+    if (!a2dp_conn_info.a2dp_cid) return;
+
+    uint8_t status = a2dp_sink_send_delay_report(a2dp_conn_info.a2dp_cid, a2dp_conn_info.a2dp_local_seid, delay);
+    if (status != ERROR_CODE_SUCCESS) {
+        loge(TAG, "A2DP delay report failed, status 0x%02x", status);
+        return;
+    }
+    a2dp_delay_reported = delay;
+    logi(TAG, "A2DP delay reported: %u.%u ms", delay / 10, delay % 10);
+}
 
-    sbc_decoder_instance->decode_signed_16(&sbc_decoder_context, 0, packet_begin, packet_length);
+void a2dp_delay_report_handler(btstack_timer_source_t *ts) {
+    uint16_t delay = a2dp_pipeline_delay();
+    if (abs(delay - a2dp_delay_reported) >= A2DP_DELAY_REPORT_STEP_MS * 10) a2dp_delay_report_send(delay);
+    btstack_run_loop_set_timer(ts, A2DP_DELAY_REPORT_PERIOD_MS);
+    btstack_run_loop_add_timer(ts);
 }
 
 void avrcp_cb(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size) {
@@ -649,7 +905,8 @@ void hfp_hf_cb(uint8_t packet_type, uint16_t channel, uint8_t *event, uint16_t e
                             sco_util::close();
                             stream_bridge::configure_sink(a2dp_conn_info.sbc_configuration.sampling_frequency,
                                                           a2dp_conn_info.sbc_configuration.num_channels,
-                                                          a2dp_conn_info.sbc_configuration.block_length);
+                                                          a2dp_conn_info.sbc_configuration.block_length,
+                                                          STREAM_LATENCY_MUSIC_MS);
                             event_bridge::post(APPLICATION, event_bridge::VOL_DATA_RQ, BT_TRANSPORT);
                             break;
                         }
@@ -703,7 +960,7 @@ void hfp_hf_cb(uint8_t packet_type, uint16_t channel, uint8_t *event, uint16_t e
 }
 
 void a2dp_pcm_data_cb(int16_t *data, int num_audio_frames, int num_channels, int sample_rate, void *context) {
-    stream_bridge::write(reinterpret_cast<char *>(data), num_audio_frames * A2DP_NUM_CHANNELS * A2DP_BYTES_PER_SAMPLE);
+    a2dp_playout::write_pcm(data, num_audio_frames, num_channels);
 }
 
 int read_media_data_header(uint8_t *packet, int size, int *offset, avdtp_media_packet_header_t *media_header) {
@@ -739,7 +996,7 @@ int read_media_data_header(uint8_t *packet, int size, int *offset, avdtp_media_p
 }
 
 int read_sbc_header(uint8_t *packet, int size, int *offset, avdtp_sbc_codec_header_t *sbc_header) {
-    int sbc_header_len = 12; // without crc
+    int sbc_header_len = 1;
     int pos = *offset;
 
     if (size - pos < sbc_header_len) {
@@ -1,27 +1,38 @@
 #include "event_bridge.h"
+#include "common_util.h"
 
-static esp_event_loop_handle_t evt_loop = nullptr;
+#include <event_bus.h>
+#include <impl/log.h>
 
-esp_err_t event_bridge::init() {
-    if (evt_loop) {
-        return ESP_ERR_INVALID_STATE;
-    }
+#include <cinttypes>
+
+// handlers keep the esp_event signature, the bus passes the same arguments
+static_assert(sizeof(event_bridge::data_t) <= EVENT_BUS_DATA_SIZE, "event data does not fit an event");
+
+static const char *TAG = "EVT_BRIDGE";
 
-    esp_event_loop_args_t loop_args = {
-            .queue_size = 16,
-            .task_name = "evt_bridge",
-            .task_priority = 15,
-            .task_stack_size = 4096,
-            .task_core_id = 0
-    };
+#define EVENT_BRIDGE_POST_WAIT_MS 100 // post from a task, then the event is dropped
 
-    esp_err_t err;
+static const char *lane_names[] = {"evt_ctl", "evt_svc"};
+static int lanes[event_bridge::LANE_COUNT];
 
-    err = esp_event_loop_create(&loop_args, &evt_loop);
-    if (err != ESP_OK) {
-        return err;
+// transport start and stop block for seconds, so the transports get a lane of their own and the application's
+// volume and control go through meanwhile. All of a transport's events share its lane, its handler never runs on two
+// threads at once
+static event_bridge::lane_t lane_of(esp_event_base_t event_base) {
+    return event_base == APPLICATION ? event_bridge::LANE_CONTROL : event_bridge::LANE_SERVICE;
+}
+
+esp_err_t event_bridge::init() {
+    if (event_bus::init() != 0) {
+        return ESP_ERR_INVALID_STATE;
     }
 
+    lanes[LANE_CONTROL] = event_bus::add_lane(lane_names[LANE_CONTROL], 16, 15, 4096, 0);
+    lanes[LANE_SERVICE] = event_bus::add_lane(lane_names[LANE_SERVICE], 16, 10, 4096, 0);
+    if (lanes[LANE_CONTROL] < 0 || lanes[LANE_SERVICE] < 0) {
+        return ESP_ERR_NO_MEM;
+    }
     return ESP_OK;
 }
 
@@ -33,32 +44,39 @@ event_bridge::set_listener(esp_event_base_t event_base, esp_event_handler_t even
 esp_err_t
 event_bridge::set_listener_specific(esp_event_base_t event_base, int32_t event_id, esp_event_handler_t event_handler,
                                     void *event_handler_arg) {
-    if (!evt_loop) return ESP_ERR_INVALID_STATE;
-    return esp_event_handler_register_with(evt_loop, event_base, event_id, event_handler, event_handler_arg);
+    if (event_bus::set_listener(event_base, event_id, event_handler, event_handler_arg) != 0) return ESP_ERR_NO_MEM;
+    return ESP_OK;
 }
 
 esp_err_t event_bridge::post(esp_event_base_t event_base, int32_t event_id, esp_event_base_t event_from_base,
                              data_t *event_data) {
-    if (!evt_loop) return ESP_ERR_INVALID_STATE;
-    if (event_data) {
-        event_data->from = event_from_base;
-        return esp_event_post_to(evt_loop, event_base, event_id, event_data, sizeof (data_t), portMAX_DELAY);
+    data_t dat = event_data ? *event_data : data_t{};
+    dat.from = event_from_base;
+    // a full lane is waited on for a while, a lost SVC_START or SVC_PAUSE would leave the transports out of step
+    if (event_bus::post(lanes[lane_of(event_base)], event_base, event_id, &dat, sizeof(data_t),
+                        EVENT_BRIDGE_POST_WAIT_MS) != 0) {
+        loge(TAG, "event %" PRIi32 " for %s dropped, lane full", event_id, event_base);
+        return ESP_ERR_NO_MEM;
     }
-    data_t dat = { // esp_event_post copies internally into heap
-            .from = event_from_base
-    };
-    return esp_event_post_to(evt_loop, event_base, event_id, &dat, sizeof (data_t), portMAX_DELAY);
+    return ESP_OK;
 }
 
 esp_err_t event_bridge::post_isr(esp_event_base_t event_base, int32_t event_id, esp_event_base_t event_from_base,
                              data_t *event_data) {
-    if (!evt_loop) return ESP_ERR_INVALID_STATE;
-    if (event_data) {
-        event_data->from = event_from_base;
-        return esp_event_isr_post_to(evt_loop, event_base, event_id, event_data, sizeof (data_t), nullptr);
+    data_t dat = event_data ? *event_data : data_t{};
+    dat.from = event_from_base;
+    if (event_bus::post_isr(lanes[lane_of(event_base)], event_base, event_id, &dat, sizeof(data_t)) != 0) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void event_bridge::log_stats() {
+    for (int i = 0; i < LANE_COUNT; ++i) {
+        event_bus::stats_t st = event_bus::stats(lanes[i]);
+        logi(TAG, "%s: %" PRIu32 " events, %" PRIu32 " dropped, depth %" PRIu32 ", wait avg %" PRIu32 " max %" PRIu32
+                  " us, run max %" PRIu32 " us", lane_names[i],
+             st.dispatched, st.dropped, st.depth_max, st.wait_avg_us, st.wait_max_us, st.run_max_us);
+        event_bus::reset_stats(lanes[i]);
     }
-    data_t dat = { // esp_event_post copies internally into heap
-            .from = event_from_base
-    };
-    return esp_event_isr_post_to(evt_loop, event_base, event_id, &dat, sizeof (data_t), nullptr);
-}
\ No newline at end of file
+}
@@ -18,6 +18,14 @@ namespace event_bridge {
         CTL_GO_SLEEP
     };
 
+    // Events of one lane are handled in order, the lanes run side by side
+    enum lane_t {
+        LANE_CONTROL = 0, // everything for APPLICATION, kept short
+        LANE_SERVICE, // everything for the transports, SVC_START and SVC_PAUSE included
+
+        LANE_COUNT
+    };
+
     union data_t {
         struct {
             esp_event_base_t from;
@@ -40,6 +48,9 @@ namespace event_bridge {
     esp_err_t post_isr(esp_event_base_t event_base, int32_t event_id, esp_event_base_t event_from_base,
                    data_t* event_data = nullptr);
 
+    // Logs the latency of every lane since the last call
+    void log_stats();
+
 }
 
 #endif //EVENT_BRIDGE_H
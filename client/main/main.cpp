@@ -25,6 +25,8 @@
 
 static const char *TAG = "MAIN";
 
+#define EVENT_STATS_MS 30000
+
 static const esp_event_base_t trts[] = {
         NET_TRANSPORT,
         BT_TRANSPORT
@@ -90,7 +92,12 @@ extern "C" [[noreturn]] int app_main(void) {
     event_bridge::set_listener(APPLICATION, main_event_cb);
     event_bridge::post(trts[cur_trt], event_bridge::SVC_START, APPLICATION);
 
+    time_t stats_time = thread_millis();
     while (true) {
         thread_sleep(500);
+        if (thread_millis() - stats_time >= EVENT_STATS_MS) {
+            event_bridge::log_stats();
+            stats_time = thread_millis();
+        }
     }
 }
\ No newline at end of file
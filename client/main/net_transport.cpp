@@ -15,9 +15,42 @@ static const char *TAG = "NET_TRANSPORT";
 const char *HOST_ADDR = "10.242.1.61";
 const uint16_t PORT = 48080;
 
+// small dma buffers, trades underrun safety for ~20 ms of output latency
+#define NET_LOW_LATENCY 1
+
+#if NET_LOW_LATENCY
+#define NET_STREAM_LATENCY STREAM_LATENCY_LOW_MS
+#else
+#define NET_STREAM_LATENCY STREAM_LATENCY_MUSIC_MS
+#endif
+
+// modem sleep between dtim beacons, the mic goes up in one burst per wake. Saves battery for up to a beacon
+// interval of extra mic latency, which the server output has to buffer
+#define NET_POWER_SAVE 0
+
+#if NET_POWER_SAVE
+#define NET_WIFI_PS wifi_util::PS_DTIM
+#define NET_MIC_BURST_MS() wifi_util::wake_interval_ms()
+#else
+#define NET_WIFI_PS wifi_util::PS_NONE
+#define NET_MIC_BURST_MS() 0 // even when the driver keeps modem sleep, bursts would only add their latency
+#endif
+
+#define NET_STREAM_RATE 44100 // what the server sends
+
+// i2s clock while on net, writes are converted when it differs from the stream instead of reclocking i2s
+#define NET_SINK_RATE NET_STREAM_RATE
+#define NET_SINK_CHANNELS 2
+#define NET_SINK_BITS 16
+
+#define NET_KEEPALIVE_MS 500 // only when no data went out for that long
+
+// frame duration asked of the server, shorter frames cut latency for more packets. 0 keeps DATA_WIDTH frames
+#define NET_FRAME_US 0
+
 enum client_state_t {
     CL_UNINIT = 0,
-    CL_NOCONN,
+    CL_DISCONNECTING, // audio stopped, waiting on the server's ack before the radio goes down
     CL_REQUESTING,
     CL_CONNECTED
 };
@@ -28,13 +61,15 @@ static void receive_cb(const uint8_t *, size_t, void *);
 
 static size_t send_cb(uint8_t *data, size_t len, void *);
 
-[[noreturn]] static void req_sender(void *);
+static void request_done(net_controller::cmd_t, bool acked, void *);
+
+static void disconnect_done(net_controller::cmd_t, bool acked, void *);
 
 static void event_cb(void *event_handler_arg, esp_event_base_t event_base, int32_t event_id, void *event_data);
 
 
-static thread_t req_sender_thread;
 static std::atomic<client_state_t> net_state(CL_UNINIT);
+static bool start_pending = false; // SVC_START while disconnecting, event loop only
 static endpoint_t cur_endpoint;
 
 ESP_EVENT_DEFINE_BASE(NET_TRANSPORT);
@@ -46,16 +81,17 @@ int remote_cmd_cb(net_controller::cmd_t cmd, void *) {
         logi(TAG, "Got disconnected");
         sender::stop();
 
-        if (net_state != CL_NOCONN) {
-            net_state = CL_REQUESTING;
-            net_controller::set_cmd(net_controller::ST_FULL, false);
+        client_state_t connected = CL_CONNECTED;
+        if (net_state.compare_exchange_strong(connected, CL_REQUESTING)) {
+            net_controller::send_command(net_controller::ST_FULL, request_done);
         }
         return 0;
     }
-    if (net_state != CL_CONNECTED) {
+    client_state_t requesting = CL_REQUESTING;
+    if (net_state.compare_exchange_strong(requesting, CL_CONNECTED)) {
         logi(TAG, "Connected successfully");
-        // on connect
-        net_state = CL_CONNECTED;
+    } else if (requesting != CL_CONNECTED) {
+        return 0; // late answer while shutting down
     }
 
     switch (cmd) {
@@ -78,21 +114,60 @@ int remote_cmd_cb(net_controller::cmd_t cmd, void *) {
 }
 
 void receive_cb(const uint8_t *data, size_t len, void *) {
+    // the next transport may own the sink already
+    if (net_state == CL_DISCONNECTING) return;
+    // what is left when the next datagram arrives, the level the sender has to keep above empty
+    int queued = stream_bridge::bytes_queued();
+    receiver::report_buffer(queued * 1000 / (NET_SINK_RATE * NET_SINK_CHANNELS * NET_SINK_BITS / 8));
     stream_bridge::write(data, len);
 }
 
 size_t send_cb(uint8_t *data, size_t len, void *) {
-    if (!stream_bridge::bytes_ready_to_read()) return 0;
-    return stream_bridge::read(data, len);
+    size_t ready = stream_bridge::bytes_ready_to_read();
+    if (!ready) return 0;
+    return stream_bridge::read(data, ready < len ? ready : len);
 }
 
-[[noreturn]] static void req_sender(void *) { // implement keep alive (just ping (or data_transfer if needed)) in net_controller itself
-    while (true) {
-        sender::send_md();
-        thread_sleep(500);
-    }
+// keeps asking until the server answers
+void request_done(net_controller::cmd_t, bool acked, void *) {
+    if (!acked && net_state == CL_REQUESTING) net_controller::send_command(net_controller::ST_FULL, request_done);
 }
 
+void disconnect_done(net_controller::cmd_t, bool acked, void *) {
+    if (!acked) logi(TAG, "Server did not ack the disconnect");
+    event_bridge::post(NET_TRANSPORT, event_bridge::SVC_PAUSE, NET_TRANSPORT);
+}
+
+// Everything the next transport shares, done before it gets its SVC_START
+static void audio_stop() {
+    sender::stop();
+    sender::set_keepalive(0);
+    stream_bridge::set_voice_processing(0);
+}
+
+static void net_start() {
+    wifi_util::connect(NET_WIFI_PS);
+    sender::set_burst(NET_MIC_BURST_MS());
+    stream_bridge::configure_sink(NET_SINK_RATE, NET_SINK_CHANNELS, NET_SINK_BITS, NET_STREAM_LATENCY);
+    stream_bridge::set_sink_input_rate(NET_STREAM_RATE);
+    stream_bridge::configure_source(44100, 1, 16, NET_STREAM_LATENCY);
+    stream_bridge::set_voice_processing(VOICE_PROC_AEC | VOICE_PROC_NS);
+    endpoint_set_port(&cur_endpoint, PORT);
+    endpoint_set_addr_v4(&cur_endpoint, HOST_ADDR);
+    receiver::start();
+    sender::set_endpoint(&cur_endpoint);
+    net_state = CL_REQUESTING;
+
+    sender::set_keepalive(NET_KEEPALIVE_MS);
+    net_controller::send_command(net_controller::ST_FULL, request_done);
+}
+
+static void net_stop() {
+    // first, reset runs the dropped completions and request_done must not queue another ST_FULL from them
+    net_state = CL_UNINIT;
+    net_controller::reset();
+    wifi_util::shutdown();
+}
 
 void event_cb(void *event_handler_arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
     auto dat = reinterpret_cast<event_bridge::data_t *>(event_data);
@@ -103,30 +178,37 @@ void event_cb(void *event_handler_arg, esp_event_base_t event_base, int32_t even
             break;
         case event_bridge::SVC_START:
             logi(TAG, "Starting up net_transport");
+            if (net_state == CL_DISCONNECTING) {
+                start_pending = true; // picked up when the disconnect is through
+                break;
+            }
             if (net_state != CL_UNINIT) break;
-            wifi_util::connect();
-            stream_bridge::configure_sink(44100, 2, 16);
-            stream_bridge::configure_source(44100, 1, 16);
-            endpoint_set_port(&cur_endpoint, PORT);
-            endpoint_set_addr_v4(&cur_endpoint, HOST_ADDR);
-            receiver::start();
-            sender::set_endpoint(&cur_endpoint);
-            net_state = CL_REQUESTING;
-
-            net_controller::set_cmd(net_controller::ST_FULL, false);
-            thread_launch(&req_sender_thread);
+            net_start();
             break;
         case event_bridge::SVC_PAUSE:
+            if (net_state == CL_DISCONNECTING) {
+                // ours once the server acked or gave up, anyone else's only cancels a start asked for meanwhile
+                if (dat->from != NET_TRANSPORT) {
+                    start_pending = false;
+                    break;
+                }
+                net_stop();
+                if (start_pending) {
+                    start_pending = false;
+                    logi(TAG, "Starting up net_transport");
+                    net_start();
+                }
+                break;
+            }
             logi(TAG, "Shutting down net_transport");
             if (net_state == CL_UNINIT) break;
+            audio_stop();
             if (net_state == CL_CONNECTED) {
-                net_state = CL_NOCONN;
-                net_controller::set_cmd(net_controller::ST_DISCONNECT, true);
+                // the radio goes down on a second SVC_PAUSE once the server acked or gave up, the loop stays free
+                net_state = CL_DISCONNECTING;
+                if (net_controller::send_command(net_controller::ST_DISCONNECT, disconnect_done, ACK_TIMEOUT)) break;
             }
-            thread_terminate(&req_sender_thread);
-            net_controller::reset();
-            wifi_util::shutdown();
-            net_state = CL_UNINIT;
+            net_stop();
             break;
         case event_bridge::VOL_DATA_RQ:
             break;
@@ -137,6 +219,7 @@ void event_cb(void *event_handler_arg, esp_event_base_t event_base, int32_t even
 
 void net_transport::init() {
     net_controller::init();
+    net_controller::set_frame_us(NET_FRAME_US);
 
     wifi_util::init();
 
@@ -144,9 +227,11 @@ void net_transport::init() {
     net_controller::set_remote_ack_cb(remote_cmd_cb);
 
     receiver::set_cb(receive_cb);
+    receiver::set_channels(2);
     sender::set_cb(send_cb);
-
-    thread_init(&req_sender_thread, req_sender, "net_request_sender", 0);
+    sender::set_format(44100, 1);
+    sender::set_vad(true); // the mic goes out 16 bit mono, silence as comfort noise
+    sender::set_rate_control(true);
 
     event_bridge::set_listener(NET_TRANSPORT, event_cb);
 }
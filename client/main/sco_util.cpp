@@ -1,11 +1,13 @@
 #include "sco_util.h"
-#include "stream_bridge.h"
 
+#include <sco_engine.h>
 #include <hfp_codec.h>
 #include <btstack_cvsd_plc.h>
 #include <btstack.h>
 #include <impl/log.h>
 
+#include <algorithm>
+
 #ifdef ENABLE_HFP_SUPER_WIDE_BAND_SPEECH
 #include "btstack_lc3.h"
 #include "btstack_lc3_google.h"
@@ -13,170 +15,91 @@
 
 static const char *TAG = "SCO_UTIL";
 
-#define NUM_CHANNELS            1
 #define SAMPLE_RATE_8KHZ        8000
 #define SAMPLE_RATE_16KHZ       16000
 #define SAMPLE_RATE_32KHZ       32000
 #define BYTES_PER_FRAME         2
 
-#if defined(ENABLE_HFP_SUPER_WIDE_BAND_SPEECH)
-#define PREBUFFER_BYTES_MAX PREBUFFER_BYTES_32KHZ
-#define SAMPLES_PER_FRAME_MAX 240
-#elif defined(ENABLE_HFP_WIDE_BAND_SPEECH)
-#define PREBUFFER_BYTES_MAX PREBUFFER_BYTES_16KHZ
-#define SAMPLES_PER_FRAME_MAX 120
-#else
-#define PREBUFFER_BYTES_MAX PREBUFFER_BYTES_8KHZ
-#define SAMPLES_PER_FRAME_MAX 60
-#endif
-
-// audio pre-buffer - also defines latency
-#define SCO_PREBUFFER_MS      50
-#define PREBUFFER_BYTES_8KHZ  (SCO_PREBUFFER_MS *  SAMPLE_RATE_8KHZ/1000 * BYTES_PER_FRAME)
-#define PREBUFFER_BYTES_16KHZ (SCO_PREBUFFER_MS * SAMPLE_RATE_16KHZ/1000 * BYTES_PER_FRAME)
-#define PREBUFFER_BYTES_32KHZ (SCO_PREBUFFER_MS * SAMPLE_RATE_32KHZ/1000 * BYTES_PER_FRAME)
+#define SCO_ENGINE_CORE 1
 
-// generic codec struct
+// btstack codec state, handed to the engine as codec_ctx
 typedef struct {
-    void (*init)();
-
-    void (*receive)(const uint8_t *packet, uint16_t size);
-
-    void (*fill_payload)(uint8_t *payload_buffer, uint16_t sco_payload_length);
-
-    void (*close)();
-
-    uint16_t sample_rate;
-} codec_support_t;
-
-static btstack_cvsd_plc_state_t cvsd_plc_state;
+    btstack_cvsd_plc_state_t cvsd_plc_state;
 
 #ifdef ENABLE_HFP_WIDE_BAND_SPEECH
-static const btstack_sbc_decoder_t *sbc_decoder_instance;
-extern btstack_sbc_decoder_bluedroid_t sbc_decoder_context;
-static const btstack_sbc_encoder_t *sbc_encoder_instance;
-static btstack_sbc_encoder_bluedroid_t sbc_encoder_context;
+    const btstack_sbc_decoder_t *sbc_decoder_instance;
+    btstack_sbc_decoder_bluedroid_t sbc_decoder_context;
+    const btstack_sbc_encoder_t *sbc_encoder_instance;
+    btstack_sbc_encoder_bluedroid_t sbc_encoder_context;
 #endif
 
 #if defined(ENABLE_HFP_WIDE_BAND_SPEECH) || defined(ENABLE_HFP_SUPER_WIDE_BAND_SPEECH)
-static hfp_codec_t hfp_codec;
+    hfp_codec_t hfp_codec;
 #endif
 
 #ifdef ENABLE_HFP_SUPER_WIDE_BAND_SPEECH
-static const btstack_lc3_decoder_t * lc3_decoder;
-static btstack_lc3_decoder_google_t lc3_decoder_context;
-static btstack_lc3_encoder_google_t lc3_encoder_context;
-static hfp_h2_sync_t    hfp_h2_sync;
+    const btstack_lc3_decoder_t *lc3_decoder;
+    btstack_lc3_decoder_google_t lc3_decoder_context;
+    btstack_lc3_encoder_google_t lc3_encoder_context;
+    hfp_h2_sync_t hfp_h2_sync;
 #endif
+} codec_state_t;
 
-// current configuration
-static const codec_support_t *codec_current = nullptr;
+static sco_engine_t engine;
+static codec_state_t codec_state;
 
-static int audio_input_paused = 0;
-static uint16_t audio_prebuffer_bytes;
+static codec_state_t *state_of(sco_engine_t *e) {
+    return static_cast<codec_state_t *>(e->codec_ctx);
+}
 
-// CVSD - 8 kHz
+// CVSD - 8 kHz, linear pcm over hci with btstack plc on top
 
-static void cvsd_init() {
+static void cvsd_init(sco_engine_t *e) {
     logi(TAG, "init CVSD");
-    btstack_cvsd_plc_init(&cvsd_plc_state);
+    btstack_cvsd_plc_init(&state_of(e)->cvsd_plc_state);
 }
 
-static void cvsd_receive(const uint8_t *packet, uint16_t size) {
-
-    int16_t audio_frame_out[128];    //
-
-    if (size > sizeof(audio_frame_out)) {
-        logi(TAG, "cvsd_receive: SCO packet larger than local output buffer - dropping data.");
-        return;
-    }
-
-    const int audio_bytes_read = size - 3;
-    const int num_samples = audio_bytes_read / BYTES_PER_FRAME;
+static void cvsd_decode(sco_engine_t *e, const uint8_t *payload, uint16_t size, bool bad) {
+    const int num_samples = std::min(size / BYTES_PER_FRAME, SCO_FRAME_SAMPLES_MAX);
 
     // convert into host endian
-    int16_t audio_frame_in[128];
-    int i;
-    for (i = 0; i < num_samples; i++) {
-        audio_frame_in[i] = little_endian_read_16(packet, 3 + i * 2);
-    }
-
-    // treat packet as bad frame if controller does not report 'all good'
-    bool bad_frame = (packet[1] & 0x30) != 0;
-
-    btstack_cvsd_plc_process_data(&cvsd_plc_state, bad_frame, audio_frame_in, num_samples, audio_frame_out);
-
-    stream_bridge::write(reinterpret_cast<char *>(audio_frame_out), audio_bytes_read);
-}
-
-static void cvsd_fill_payload(uint8_t *payload_buffer, uint16_t sco_payload_length) {
-    uint16_t bytes_to_copy = sco_payload_length;
-
-    // get data from ringbuffer
-    uint16_t pos = 0;
-    if (!audio_input_paused) {
-        uint16_t samples_to_copy = sco_payload_length / 2;
-        uint32_t bytes_read = 0;
-        bytes_read = stream_bridge::read(reinterpret_cast<char *>(payload_buffer), bytes_to_copy);
-        // flip 16 on big endian systems
-        // @note We don't use (uint16_t *) casts since all sample addresses are odd which causes crahses on some systems
-        if (btstack_is_big_endian()) {
-            uint16_t i;
-            for (i = 0; i < samples_to_copy / 2; i += 2) {
-                uint8_t tmp = payload_buffer[i * 2];
-                payload_buffer[i * 2] = payload_buffer[i * 2 + 1];
-                payload_buffer[i * 2 + 1] = tmp;
-            }
-        }
-        bytes_to_copy -= bytes_read;
-        pos += bytes_read;
+    for (int i = 0; i < num_samples; i++) {
+        e->dec_frame[i] = static_cast<int16_t>(little_endian_read_16(payload, i * 2));
     }
 
-    // fill with 0 if not enough
-    if (bytes_to_copy) {
-        memset(payload_buffer + pos, 0, bytes_to_copy);
-        audio_input_paused = 1;
-    }
+    // plc writes into the pool frame
+    int16_t *audio_frame_out = sco_engine_output_reserve(e, num_samples);
+    btstack_cvsd_plc_process_data(&state_of(e)->cvsd_plc_state, bad, e->dec_frame, num_samples, audio_frame_out);
+    sco_engine_output_commit(e, num_samples);
 }
 
-static void cvsd_close(void) {
+static void cvsd_close(sco_engine_t *e) {
     logi(TAG, "used CVSD with PLC, number of proccesed frames: \n - %d good frames, \n - %d bad framesn",
-         cvsd_plc_state.good_frames_nr, cvsd_plc_state.bad_frames_nr);
+         state_of(e)->cvsd_plc_state.good_frames_nr, state_of(e)->cvsd_plc_state.bad_frames_nr);
 }
 
-static const codec_support_t codec_cvsd = {
-        .init         = &cvsd_init,
-        .receive      = &cvsd_receive,
-        .fill_payload = &cvsd_fill_payload,
-        .close        = &cvsd_close,
-        .sample_rate = SAMPLE_RATE_8KHZ
+static const sco_codec_t codec_cvsd = {
+        .name = "CVSD",
+        .sample_rate = SAMPLE_RATE_8KHZ,
+        .samples_per_frame = 60,
+        .init = &cvsd_init,
+        .decode = &cvsd_decode,
+        .encode = sco_codec_pcm16.encode,
+        .close = &cvsd_close,
 };
 
 
 // encode using hfp_codec
 #if defined(ENABLE_HFP_WIDE_BAND_SPEECH) || defined(ENABLE_HFP_SUPER_WIDE_BAND_SPEECH)
 
-static void codec_fill_payload(uint8_t *payload_buffer, uint16_t sco_payload_length) {
+static void codec_encode(sco_engine_t *e, const int16_t *frame) {
+    hfp_codec_t *hfp_codec = &state_of(e)->hfp_codec;
+    if (!hfp_codec_can_encode_audio_frame_now(hfp_codec)) return;
+    hfp_codec_encode_audio_frame(hfp_codec, const_cast<int16_t *>(frame));
 
-    if (!audio_input_paused) {
-        int num_samples = hfp_codec_num_audio_samples_per_frame(&hfp_codec);
-        btstack_assert(num_samples <= SAMPLES_PER_FRAME_MAX);
-        uint16_t samples_available = stream_bridge::bytes_ready_to_read() / BYTES_PER_FRAME;
-        if (hfp_codec_can_encode_audio_frame_now(&hfp_codec) && samples_available >= num_samples) {
-            int16_t sample_buffer[SAMPLES_PER_FRAME_MAX];
-
-            stream_bridge::read(reinterpret_cast<char *>(sample_buffer), num_samples * BYTES_PER_FRAME);
-            hfp_codec_encode_audio_frame(&hfp_codec, sample_buffer);
-        }
-    }
-    // get data from encoder, fill with 0 if not enough
-    if (audio_input_paused || hfp_codec_num_bytes_available(&hfp_codec) < sco_payload_length) {
-        // just send '0's
-        memset(payload_buffer, 0, sco_payload_length);
-        audio_input_paused = 1;
-    } else {
-        hfp_codec_read_from_stream(&hfp_codec, payload_buffer, sco_payload_length);
-    }
+    uint16_t bytes = std::min<uint16_t>(hfp_codec_num_bytes_available(hfp_codec), sizeof(e->enc_frame));
+    hfp_codec_read_from_stream(hfp_codec, e->enc_frame, bytes);
+    sco_engine_queue(e, e->enc_frame, bytes);
 }
 
 #endif
@@ -186,36 +109,40 @@ static void codec_fill_payload(uint8_t *payload_buffer, uint16_t sco_payload_len
 #ifdef ENABLE_HFP_WIDE_BAND_SPEECH
 
 static void handle_pcm_data(int16_t *data, int num_samples, int num_channels, int sample_rate, void *context) {
-    int bytes = num_samples * num_channels * BYTES_PER_FRAME;
-    stream_bridge::write(reinterpret_cast<char *>(data), bytes);
+    sco_engine_output(static_cast<sco_engine_t *>(context), data, num_samples * num_channels);
 }
 
-static void msbc_init() {
+static void msbc_init(sco_engine_t *e) {
     logi(TAG, "init mSBC");
-    sbc_decoder_instance = btstack_sbc_decoder_bluedroid_init_instance(&sbc_decoder_context);
-    sbc_decoder_instance->configure(&sbc_decoder_context, SBC_MODE_mSBC, &handle_pcm_data, nullptr);
+    codec_state_t *st = state_of(e);
+    st->sbc_decoder_instance = btstack_sbc_decoder_bluedroid_init_instance(&st->sbc_decoder_context);
+    st->sbc_decoder_instance->configure(&st->sbc_decoder_context, SBC_MODE_mSBC, &handle_pcm_data, e);
 
-    sbc_encoder_instance = btstack_sbc_encoder_bluedroid_init_instance(&sbc_encoder_context);
-    hfp_codec_init_msbc_with_codec(&hfp_codec, sbc_encoder_instance, &sbc_encoder_context);
+    st->sbc_encoder_instance = btstack_sbc_encoder_bluedroid_init_instance(&st->sbc_encoder_context);
+    hfp_codec_init_msbc_with_codec(&st->hfp_codec, st->sbc_encoder_instance, &st->sbc_encoder_context);
 }
 
-static void msbc_receive(const uint8_t *packet, uint16_t size) {
-    uint8_t status = (packet[1] >> 4) & 3;
-    sbc_decoder_instance->decode_signed_16(&sbc_decoder_context, status, packet + 3, size - 3);
+static void msbc_decode(sco_engine_t *e, const uint8_t *payload, uint16_t size, bool bad) {
+    codec_state_t *st = state_of(e);
+    st->sbc_decoder_instance->decode_signed_16(&st->sbc_decoder_context, bad ? 1 : 0, payload, size);
 }
 
-static void msbc_close() {
+static void msbc_close(sco_engine_t *e) {
+    codec_state_t *st = state_of(e);
     logi(TAG,
          "used mSBC with PLC, number of processed frames: \n - %d good frames, \n - %d zero frames, \n - %d bad framesn",
-         sbc_decoder_context.good_frames_nr, sbc_decoder_context.zero_frames_nr, sbc_decoder_context.bad_frames_nr);
+         st->sbc_decoder_context.good_frames_nr, st->sbc_decoder_context.zero_frames_nr,
+         st->sbc_decoder_context.bad_frames_nr);
 }
 
-static const codec_support_t codec_msbc = {
-        .init         = &msbc_init,
-        .receive      = &msbc_receive,
-        .fill_payload = &codec_fill_payload,
-        .close        = &msbc_close,
-        .sample_rate = SAMPLE_RATE_16KHZ
+static const sco_codec_t codec_msbc = {
+        .name = "mSBC",
+        .sample_rate = SAMPLE_RATE_16KHZ,
+        .samples_per_frame = 120,
+        .init = &msbc_init,
+        .decode = &msbc_decode,
+        .encode = &codec_encode,
+        .close = &msbc_close,
 };
 
 #endif /* ENABLE_HFP_WIDE_BAND_SPEECH */
@@ -224,7 +151,9 @@ static const codec_support_t codec_msbc = {
 #define LC3_SWB_SAMPLES_PER_FRAME 240
 #define LC3_SWB_OCTETS_PER_FRAME   58
 
+// h2 sync has no context argument, the engine is a singleton here anyway
 static bool lc3swb_frame_callback(bool bad_frame, const uint8_t * frame_data, uint16_t frame_len) {
+    codec_state_t *st = state_of(&engine);
 
     // skip H2 header for good frames
     if (!bad_frame){
@@ -234,52 +163,52 @@ static bool lc3swb_frame_callback(bool bad_frame, const uint8_t * frame_data, ui
 
     uint8_t tmp_BEC_detect = 0;
     uint8_t BFI = bad_frame ? 1 : 0;
-    int16_t samples[LC3_SWB_SAMPLES_PER_FRAME];
-    (void) lc3_decoder->decode_signed_16(&lc3_decoder_context, frame_data, BFI,
-                                         samples, 1, &tmp_BEC_detect);
+    int16_t *samples = sco_engine_output_reserve(&engine, LC3_SWB_SAMPLES_PER_FRAME);
+    (void) st->lc3_decoder->decode_signed_16(&st->lc3_decoder_context, frame_data, BFI,
+                                             samples, 1, &tmp_BEC_detect);
 
     // samples in callback in host endianess, ready for playback
-    int bytes = LC3_SWB_SAMPLES_PER_FRAME * BYTES_PER_FRAME;
-    stream_bridge::write(reinterpret_cast<char *>(samples), bytes);
+    sco_engine_output_commit(&engine, LC3_SWB_SAMPLES_PER_FRAME);
 
     // frame is good, if it isn't a bad frame and we didn't detect other errors
     return !bad_frame && (tmp_BEC_detect == 0);
 }
 
-static void lc3swb_init(){
+static void lc3swb_init(sco_engine_t *e) {
     logi(TAG, "init LC3-SWB");
+    codec_state_t *st = state_of(e);
 
-    hfp_codec.lc3_encoder_context = &lc3_encoder_context;
-    const btstack_lc3_encoder_t * lc3_encoder = btstack_lc3_encoder_google_init_instance( &lc3_encoder_context);
-    hfp_codec_init_lc3_swb(&hfp_codec, lc3_encoder, &lc3_encoder_context);
+    st->hfp_codec.lc3_encoder_context = &st->lc3_encoder_context;
+    const btstack_lc3_encoder_t * lc3_encoder = btstack_lc3_encoder_google_init_instance(&st->lc3_encoder_context);
+    hfp_codec_init_lc3_swb(&st->hfp_codec, lc3_encoder, &st->lc3_encoder_context);
 
     // init lc3 decoder
-    lc3_decoder = btstack_lc3_decoder_google_init_instance(&lc3_decoder_context);
-    lc3_decoder->configure(&lc3_decoder_context, SAMPLE_RATE_32KHZ, BTSTACK_LC3_FRAME_DURATION_7500US, LC3_SWB_OCTETS_PER_FRAME);
+    st->lc3_decoder = btstack_lc3_decoder_google_init_instance(&st->lc3_decoder_context);
+    st->lc3_decoder->configure(&st->lc3_decoder_context, SAMPLE_RATE_32KHZ, BTSTACK_LC3_FRAME_DURATION_7500US,
+                               LC3_SWB_OCTETS_PER_FRAME);
 
     // init HPF H2 framing
-    hfp_h2_sync_init(&hfp_h2_sync, &lc3swb_frame_callback);
+    hfp_h2_sync_init(&st->hfp_h2_sync, &lc3swb_frame_callback);
 }
 
-static void lc3swb_receive(const uint8_t * packet, uint16_t size) {
-    uint8_t packet_status = (packet[1] >> 4) & 3;
-    bool bad_frame = packet_status != 0;
-    hfp_h2_sync_process(&hfp_h2_sync, bad_frame, &packet[3], size-3);
+static void lc3swb_decode(sco_engine_t *e, const uint8_t *payload, uint16_t size, bool bad) {
+    hfp_h2_sync_process(&state_of(e)->hfp_h2_sync, bad, payload, size);
 }
 
-static void lc3swb_close() {}
-
-static const codec_support_t codec_lc3swb = {
-        .init         = &lc3swb_init,
-        .receive      = &lc3swb_receive,
-        .fill_payload = &codec_fill_payload,
-        .close        = &lc3swb_close,
-        .sample_rate = SAMPLE_RATE_32KHZ
+static const sco_codec_t codec_lc3swb = {
+        .name = "LC3-SWB",
+        .sample_rate = SAMPLE_RATE_32KHZ,
+        .samples_per_frame = LC3_SWB_SAMPLES_PER_FRAME,
+        .init = &lc3swb_init,
+        .decode = &lc3swb_decode,
+        .encode = &codec_encode,
+        .close = nullptr,
 };
 #endif
 
 
 void sco_util::set_codec(uint8_t codec) {
+    const sco_codec_t *codec_current;
     switch (codec) {
         case HFP_CODEC_CVSD:
             codec_current = &codec_cvsd;
@@ -290,23 +219,16 @@ void sco_util::set_codec(uint8_t codec) {
             break;
 #endif
 #ifdef ENABLE_HFP_SUPER_WIDE_BAND_SPEECH
-            case HFP_CODEC_LC3_SWB:
-                codec_current = &codec_lc3swb;
-                break;
+        case HFP_CODEC_LC3_SWB:
+            codec_current = &codec_lc3swb;
+            break;
 #endif
         default:
             btstack_assert(false);
-            break;
+            return;
     }
 
-    stream_bridge::configure_source(codec_current->sample_rate, NUM_CHANNELS, BYTES_PER_FRAME * 8);
-    stream_bridge::configure_sink(codec_current->sample_rate, NUM_CHANNELS, BYTES_PER_FRAME * 8);
-
-    codec_current->init();
-
-    audio_input_paused = 1;
-
-    audio_prebuffer_bytes = SCO_PREBUFFER_MS * (codec_current->sample_rate / 1000) * BYTES_PER_FRAME;
+    sco_engine_start(&engine, codec_current, &codec_state);
     logi(TAG, "set_codec done");
 }
 
@@ -319,16 +241,8 @@ void sco_util::send(hci_con_handle_t sco_handle) {
     hci_reserve_packet_buffer();
     uint8_t *sco_packet = hci_get_outgoing_packet_buffer();
 
-    // resume if pre-buffer is filled
-    if (audio_input_paused) {
-        if (stream_bridge::bytes_ready_to_read() >= audio_prebuffer_bytes) {
-            // resume sending
-            audio_input_paused = 0;
-        }
-    }
-
-    // fill payload by codec
-    codec_current->fill_payload(&sco_packet[3], sco_payload_length);
+    // fill payload from the encoded stream, zeros while prebuffering
+    sco_engine_fill_payload(&engine, &sco_packet[3], sco_payload_length);
 
     // set handle + flags
     little_endian_store_16(sco_packet, 0, sco_handle);
@@ -342,7 +256,7 @@ void sco_util::send(hci_con_handle_t sco_handle) {
 }
 
 void sco_util::receive(uint8_t *packet, uint16_t size) {
-    codec_current->receive(packet, size);
+    sco_engine_receive(&engine, packet, size);
 }
 
 void sco_util::init() {
@@ -353,9 +267,10 @@ void sco_util::init() {
 
     // Set SCO for CVSD (mSBC or other codecs automatically use 8-bit transparent mode)
     hci_set_sco_voice_setting(0x60);    // linear, unsigned, 16-bit, CVSD
+
+    sco_engine_init(&engine, SCO_ENGINE_CORE);
 }
 
 void sco_util::close() {
-    codec_current->close();
-    codec_current = nullptr;
+    sco_engine_stop(&engine);
 }
@@ -12,11 +12,16 @@
 #define NETIF_TXT_DESC "HEADPHONES_NETIF_STA"
 #define CONN_MAX_RETRY 6
 
+#define WIFI_BEACON_MS 102 // 100 TU, what nearly every ap uses
+#define WIFI_DTIM_PERIOD 1 // of the ap, not reported by the driver
+#define WIFI_LISTEN_INTERVAL 3 // beacons slept through in PS_LISTEN
+
 static const char *TAG = "WIFI_UTIL";
 
 static esp_netif_t *sta_netif = nullptr;
 static SemaphoreHandle_t ip_addr_sem = nullptr;
 static int retry_counter = 0;
+static wifi_util::power_save_t power_save = wifi_util::PS_NONE;
 
 static void wifi_disconnect_cb(void *arg, esp_event_base_t event_base,
                                int32_t event_id, void *event_data) {
@@ -99,13 +104,25 @@ void wifi_util::shutdown() {
     ESP_ERROR_CHECK(esp_unregister_shutdown_handler(&shutdown));
 }
 
-esp_err_t wifi_util::connect() {
+int wifi_util::wake_interval_ms() {
+    switch (power_save) {
+        case PS_DTIM:
+            return WIFI_BEACON_MS * WIFI_DTIM_PERIOD;
+        case PS_LISTEN:
+            return WIFI_BEACON_MS * WIFI_LISTEN_INTERVAL;
+        default:
+            return 0;
+    }
+}
+
+esp_err_t wifi_util::connect(power_save_t ps) {
     wifi_start();
     wifi_config_t wifi_config = {
             .sta = {
                     .ssid = WIFI_SSID,
                     .password = WIFI_PASSWORD,
                     .scan_method = WIFI_ALL_CHANNEL_SCAN,
+                    .listen_interval = WIFI_LISTEN_INTERVAL, // only used by PS_LISTEN
                     .sort_method = WIFI_CONNECT_AP_BY_SIGNAL,
                     .threshold = {
                             .rssi = -127,
@@ -128,7 +145,14 @@ esp_err_t wifi_util::connect() {
 
     logi(TAG, "Connecting to %s...", wifi_config.sta.ssid);
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
-    esp_err_t ret = esp_wifi_connect();
+
+    // the driver starts in PS_DTIM and keeps it when bluetooth is enabled, PS_NONE is refused then
+    static const wifi_ps_type_t ps_types[] = {WIFI_PS_NONE, WIFI_PS_MIN_MODEM, WIFI_PS_MAX_MODEM};
+    esp_err_t ret = esp_wifi_set_ps(ps_types[ps]);
+    if (ret != ESP_OK) loge(TAG, "power save mode %d refused: %x, the radio stays in modem sleep (PS_DTIM)", ps, ret);
+    power_save = ret == ESP_OK ? ps : PS_DTIM;
+
+    ret = esp_wifi_connect();
     if (ret != ESP_OK) {
         loge(TAG, "WiFi connect failed! ret:%x", ret);
         return ret;
@@ -5,11 +5,20 @@
 
 namespace wifi_util {
 
+    enum power_save_t {
+        PS_NONE = 0, // radio always on, lowest latency
+        PS_DTIM, // modem sleep, wakes for every dtim beacon
+        PS_LISTEN // modem sleep, wakes every WIFI_LISTEN_INTERVAL beacons
+    };
+
     void init();
 
     void shutdown();
 
-    esp_err_t connect();
+    esp_err_t connect(power_save_t ps = PS_NONE);
+
+    // How often the station wakes in the current power save mode, 0 when it does not sleep
+    int wake_interval_ms();
 
 }
 
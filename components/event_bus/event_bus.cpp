@@ -0,0 +1,270 @@
+#include <event_bus.h>
+
+#include <impl/log.h>
+
+#include <atomic>
+#include <cstring>
+
+#define POOL_NIL 0xFFFF
+#define WAIT_AVG_SHIFT 4 // smoothing of the wait, 1/16 of each new sample
+
+namespace event_bus {
+
+    static const char *TAG = "EVENT_BUS";
+
+    typedef struct event_t {
+        std::atomic<event_t *> next; // queue
+        std::atomic<uint16_t> free_next;
+        base_t base;
+        int32_t id;
+        time_t posted_us;
+        alignas(std::max_align_t) uint8_t data[EVENT_BUS_DATA_SIZE];
+    } event_t;
+
+    typedef struct {
+        base_t base;
+        int32_t id;
+        handler_t handler;
+        void *arg;
+    } listener_t;
+
+    typedef struct {
+        // free list of the lane's share of the pool, index in the low half and an aba tag in the high half: a native
+        // 32 bit cas on the esp32 too
+        std::atomic<uint32_t> free;
+
+        // intrusive mpsc queue (vyukov), producers swap themselves in at the head, the lane thread walks from the tail
+        event_t stub;
+        std::atomic<event_t *> head;
+        event_t *tail;
+
+        semaphore_t sem;
+        thread_t thread;
+
+        // posters waiting for the lane to free an event
+        semaphore_t room;
+        std::atomic<int> waiters;
+
+        std::atomic<uint32_t> posted, dropped, dispatched, depth, depth_max;
+        std::atomic<uint32_t> wait_avg_us, wait_max_us, run_max_us; // lane thread writes, reset_stats clears
+    } lane_t;
+
+    static event_t g_events[EVENT_BUS_POOL];
+    static int g_events_used;
+
+    static lane_t g_lanes[EVENT_BUS_LANES];
+    static std::atomic<int> g_lanes_num;
+
+    static listener_t g_listeners[EVENT_BUS_LISTENERS];
+    static std::atomic<int> g_listeners_num;
+    static mutex_t g_mutex; // lane and listener registration
+    static bool g_init = false;
+
+    static void raise(std::atomic<uint32_t> &max, uint32_t val) {
+        uint32_t cur = max.load(std::memory_order_relaxed);
+        while (val > cur && !max.compare_exchange_weak(cur, val, std::memory_order_relaxed));
+    }
+
+    static uint32_t head_next(uint32_t head, uint32_t index) {
+        return ((head >> 16) + 1) << 16 | index;
+    }
+
+    static event_t *event_alloc(lane_t *lane) {
+        uint32_t head = lane->free.load(std::memory_order_acquire);
+        event_t *e;
+        do {
+            uint16_t index = head & 0xFFFF;
+            if (index == POOL_NIL) return nullptr;
+            e = &g_events[index];
+        } while (!lane->free.compare_exchange_weak(head, head_next(head, e->free_next.load(std::memory_order_relaxed)),
+                                                   std::memory_order_acquire, std::memory_order_acquire));
+        return e;
+    }
+
+    static void event_free(lane_t *lane, event_t *e) {
+        auto index = static_cast<uint32_t>(e - g_events);
+        uint32_t head = lane->free.load(std::memory_order_relaxed);
+        do {
+            e->free_next.store(head & 0xFFFF, std::memory_order_relaxed);
+        } while (!lane->free.compare_exchange_weak(head, head_next(head, index), std::memory_order_release,
+                                                   std::memory_order_relaxed));
+    }
+
+    static void queue_push(lane_t *lane, event_t *e) {
+        e->next.store(nullptr, std::memory_order_relaxed);
+        event_t *prev = lane->head.exchange(e, std::memory_order_acq_rel);
+        prev->next.store(e, std::memory_order_release);
+    }
+
+    // Lane thread only. nullptr when empty, or when a producer is between its swap and its link: it gives the
+    // semaphore once linked, so the event is picked up on the next round
+    static event_t *queue_pop(lane_t *lane) {
+        event_t *tail = lane->tail;
+        event_t *next = tail->next.load(std::memory_order_acquire);
+        if (tail == &lane->stub) {
+            if (!next) return nullptr;
+            lane->tail = tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next) {
+            lane->tail = next;
+            return tail;
+        }
+        if (tail != lane->head.load(std::memory_order_acquire)) return nullptr;
+
+        // tail is the last one, the stub goes behind it so it can be taken
+        queue_push(lane, &lane->stub);
+        next = tail->next.load(std::memory_order_acquire);
+        if (!next) return nullptr;
+        lane->tail = next;
+        return tail;
+    }
+
+    static void dispatch(lane_t *lane, event_t *e) {
+        time_t start = thread_micros();
+        auto wait = static_cast<uint32_t>(start - e->posted_us);
+        uint32_t avg = lane->wait_avg_us.load(std::memory_order_relaxed);
+        lane->wait_avg_us.store(avg + (static_cast<int32_t>(wait - avg) >> WAIT_AVG_SHIFT), std::memory_order_relaxed);
+        raise(lane->wait_max_us, wait);
+
+        int num = g_listeners_num.load(std::memory_order_acquire);
+        for (int i = 0; i < num; ++i) {
+            const listener_t &l = g_listeners[i];
+            if (l.base != e->base || (l.id != EVENT_BUS_ANY_ID && l.id != e->id)) continue;
+            l.handler(l.arg, e->base, e->id, e->data);
+        }
+
+        raise(lane->run_max_us, static_cast<uint32_t>(thread_micros() - start));
+        lane->dispatched++;
+    }
+
+    [[noreturn]] static void task_dispatch(void *arg) {
+        auto lane = static_cast<lane_t *>(arg);
+        while (true) {
+            bin_sem_take(&lane->sem);
+            event_t *e;
+            while ((e = queue_pop(lane))) {
+                lane->depth--;
+                dispatch(lane, e);
+                event_free(lane, e);
+                if (lane->waiters.load()) bin_sem_give(&lane->room);
+            }
+        }
+    }
+
+    int init() {
+        if (g_init) return -1;
+
+        g_events_used = 0;
+        g_lanes_num = 0;
+        g_listeners_num = 0;
+        mutex_init(&g_mutex);
+        g_init = true;
+        return 0;
+    }
+
+    int add_lane(const char *name, int depth, uint32_t prio, uint32_t stack_size, int core) {
+        mutex_lock(&g_mutex);
+        int index = g_lanes_num.load(std::memory_order_relaxed);
+        if (index == EVENT_BUS_LANES || depth <= 0 || g_events_used + depth > EVENT_BUS_POOL) {
+            mutex_unlock(&g_mutex);
+            loge(TAG, "no room for lane %s", name);
+            return -1;
+        }
+
+        lane_t *lane = &g_lanes[index];
+        int first = g_events_used;
+        g_events_used += depth;
+        for (int i = first; i < g_events_used; ++i) {
+            g_events[i].free_next.store(i + 1 < g_events_used ? i + 1 : POOL_NIL, std::memory_order_relaxed);
+        }
+        lane->free.store(first, std::memory_order_relaxed);
+        lane->stub.next.store(nullptr, std::memory_order_relaxed);
+        lane->head.store(&lane->stub, std::memory_order_relaxed);
+        lane->tail = &lane->stub;
+        lane->depth = 0;
+        reset_stats(index);
+        bin_sem_init(&lane->sem);
+        bin_sem_init(&lane->room);
+        lane->waiters = 0;
+
+        thread_init(&lane->thread, {task_dispatch, lane}, name, prio, stack_size, core);
+        thread_launch(&lane->thread);
+        g_lanes_num.store(index + 1, std::memory_order_release);
+        mutex_unlock(&g_mutex);
+        return index;
+    }
+
+    int set_listener(base_t base, int32_t id, handler_t handler, void *arg) {
+        mutex_lock(&g_mutex);
+        int num = g_listeners_num.load(std::memory_order_relaxed);
+        if (num == EVENT_BUS_LISTENERS) {
+            mutex_unlock(&g_mutex);
+            loge(TAG, "no room for another listener");
+            return -1;
+        }
+        g_listeners[num] = {base, id, handler, arg};
+        g_listeners_num.store(num + 1, std::memory_order_release);
+        mutex_unlock(&g_mutex);
+        return 0;
+    }
+
+    // Registered as a waiter before trying again, so an event freed in between is either seen or wakes the poster
+    static event_t *event_alloc_wait(lane_t *lane, time_t wait_ms) {
+        time_t until = thread_millis() + wait_ms;
+        lane->waiters++;
+        event_t *e;
+        time_t left;
+        while (!(e = event_alloc(lane)) && (left = until - thread_millis()) > 0) bin_sem_take(&lane->room, left);
+        lane->waiters--;
+        return e;
+    }
+
+    static int post_event(int lane_index, base_t base, int32_t id, const void *data, size_t size, bool isr,
+                          time_t wait_ms) {
+        if (lane_index < 0 || lane_index >= g_lanes_num.load(std::memory_order_acquire)) return -1;
+        lane_t *lane = &g_lanes[lane_index];
+
+        event_t *e = nullptr;
+        if (size <= EVENT_BUS_DATA_SIZE) {
+            e = event_alloc(lane);
+            if (!e && wait_ms > 0 && !isr) e = event_alloc_wait(lane, wait_ms);
+        }
+        if (!e) {
+            lane->dropped++;
+            return -1;
+        }
+        e->base = base;
+        e->id = id;
+        e->posted_us = thread_micros();
+        if (size) memcpy(e->data, data, size);
+        raise(lane->depth_max, ++lane->depth);
+        queue_push(lane, e);
+        lane->posted++;
+
+        if (isr) bin_sem_give_isr(&lane->sem);
+        else bin_sem_give(&lane->sem);
+        return 0;
+    }
+
+    int post(int lane, base_t base, int32_t id, const void *data, size_t size, time_t wait_ms) {
+        return post_event(lane, base, id, data, size, false, wait_ms);
+    }
+
+    int post_isr(int lane, base_t base, int32_t id, const void *data, size_t size) {
+        return post_event(lane, base, id, data, size, true, 0);
+    }
+
+    stats_t stats(int lane_index) {
+        const lane_t &l = g_lanes[lane_index];
+        return {l.posted, l.dropped, l.dispatched, l.depth_max, l.wait_avg_us, l.wait_max_us, l.run_max_us};
+    }
+
+    void reset_stats(int lane_index) {
+        lane_t &l = g_lanes[lane_index];
+        l.posted = l.dropped = l.dispatched = 0;
+        l.depth_max = l.depth.load();
+        l.wait_avg_us = l.wait_max_us = l.run_max_us = 0;
+    }
+
+}
@@ -0,0 +1,141 @@
+#include <event_bus.h>
+
+#include <impl/concurrency.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#define BENCH_PRODUCERS 4
+#define BENCH_LANE_DEPTH 32
+#define BENCH_POST_WAIT_MS 100
+
+static const char *BENCH_BASE = "BENCH";
+
+typedef struct {
+    time_t posted_us;
+    uint32_t producer;
+    uint32_t seq;
+} bench_msg_t;
+static_assert(sizeof(bench_msg_t) <= EVENT_BUS_DATA_SIZE, "message does not fit an event");
+
+// written by the consumer only, read once it got everything
+static std::vector<uint32_t> latency;
+static uint32_t last_seq[BENCH_PRODUCERS];
+static int order_errors;
+static std::atomic<int> received{0};
+
+static void consume(const bench_msg_t &m) {
+    latency.push_back(static_cast<uint32_t>(thread_micros() - m.posted_us));
+    if (m.seq <= last_seq[m.producer]) order_errors++;
+    last_seq[m.producer] = m.seq;
+    received.fetch_add(1, std::memory_order_release);
+}
+
+static void bus_handler(void *, event_bus::base_t, int32_t, void *data) {
+    bench_msg_t m;
+    memcpy(&m, data, sizeof(m));
+    consume(m);
+}
+
+// esp_event does about this: a heap copy per event in a mutex guarded queue
+static struct {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<void *> queue;
+} baseline;
+
+static void report(const char *name, int total, double seconds) {
+    std::sort(latency.begin(), latency.end());
+    printf("%-10s %10.0f %6zu %8" PRIu32 " %8" PRIu32 " %8" PRIu32 " %6d\n", name, total / seconds, latency.size(),
+           latency[latency.size() / 2], latency[latency.size() * 99 / 100], latency.back(), order_errors);
+}
+
+static void reset() {
+    latency.clear();
+    memset(last_seq, 0, sizeof(last_seq));
+    order_errors = 0;
+    received = 0;
+}
+
+// Producers post bursts of eight with a short pause, a lane that fills makes them wait
+template<typename post_t>
+static double produce(int count, post_t post) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> producers;
+    for (uint32_t p = 0; p < BENCH_PRODUCERS; ++p) {
+        producers.emplace_back([=] {
+            for (uint32_t i = 1; i <= static_cast<uint32_t>(count); ++i) {
+                post(bench_msg_t{thread_micros(), p, i});
+                if (i % 8 == 0) std::this_thread::sleep_for(std::chrono::microseconds(20));
+            }
+        });
+    }
+    for (auto &t: producers) t.join();
+    while (received.load(std::memory_order_acquire) < BENCH_PRODUCERS * count) usleep(1000);
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// event_bus_bench [events per producer], throughput and post to handler latency against a mutex queue
+int main(int argc, char **argv) {
+    const int count = argc > 1 ? atoi(argv[1]) : 20000;
+    const int total = BENCH_PRODUCERS * count;
+    latency.reserve(total);
+
+    event_bus::init();
+    int lane = event_bus::add_lane("bench", BENCH_LANE_DEPTH);
+    event_bus::set_listener(BENCH_BASE, EVENT_BUS_ANY_ID, bus_handler);
+
+    printf("%-10s %10s %6s %8s %8s %8s %6s\n", "queue", "events/s", "n", "p50 us", "p99 us", "max us", "order");
+
+    std::atomic<int> lost{0};
+    double seconds = produce(count, [&](bench_msg_t m) {
+        if (event_bus::post(lane, BENCH_BASE, 0, &m, sizeof(m), BENCH_POST_WAIT_MS) != 0) {
+            lost++;
+            received++; // not coming
+        }
+    });
+    report("event_bus", total, seconds);
+    event_bus::stats_t st = event_bus::stats(lane);
+    printf("%-10s posted %" PRIu32 ", dropped %" PRIu32 ", depth max %" PRIu32 ", lost %d\n", "", st.posted,
+           st.dropped, st.depth_max, lost.load());
+
+    reset();
+    std::thread consumer([=] {
+        for (int i = 0; i < total; ++i) {
+            std::unique_lock<std::mutex> lock(baseline.mutex);
+            baseline.cv.wait(lock, [] { return !baseline.queue.empty(); });
+            void *p = baseline.queue.front();
+            baseline.queue.pop_front();
+            lock.unlock();
+            bench_msg_t m;
+            memcpy(&m, p, sizeof(m));
+            free(p);
+            consume(m);
+        }
+    });
+    seconds = produce(count, [](bench_msg_t m) {
+        void *p = malloc(sizeof(m));
+        memcpy(p, &m, sizeof(m));
+        {
+            std::lock_guard<std::mutex> lock(baseline.mutex);
+            baseline.queue.push_back(p);
+        }
+        baseline.cv.notify_one();
+    });
+    consumer.join();
+    report("mutex+heap", total, seconds);
+
+    fflush(stdout);
+    _exit(0); // the lane thread never returns
+}
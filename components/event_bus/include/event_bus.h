@@ -0,0 +1,57 @@
+#ifndef EVENT_BUS_H
+#define EVENT_BUS_H
+
+#include <impl/concurrency.h>
+
+#include <cstdint>
+#include <cstddef>
+
+#define EVENT_BUS_POOL 32 // events in flight at most, shared out between the lanes
+#define EVENT_BUS_DATA_SIZE 16 // copied along with an event
+#define EVENT_BUS_LANES 4
+#define EVENT_BUS_LISTENERS 16
+#define EVENT_BUS_ANY_ID (-1)
+
+// Event loop with a dispatch thread per lane. Events come from a static pool and wait in a lock-free mpsc queue, so
+// posting never allocates and works from interrupts. Only a full lane makes post wait, and only as long as asked.
+// Each lane runs its handlers in posting order, a slow handler holds up its own lane only
+namespace event_bus {
+
+    typedef const char *base_t; // compared by address, as esp_event_base_t
+    typedef void (*handler_t)(void *arg, base_t base, int32_t id, void *data);
+
+    typedef struct {
+        uint32_t posted;
+        uint32_t dropped; // lane full past the wait, or data too large
+        uint32_t dispatched;
+        uint32_t depth_max; // events waiting at once
+        uint32_t wait_avg_us; // post to dispatch, smoothed
+        uint32_t wait_max_us;
+        uint32_t run_max_us; // handlers of one event
+    } stats_t;
+
+    // Returns -1 when done already
+    int init();
+
+    // Starts a lane holding up to depth events. Returns the lane, -1 when there are no lanes or events left
+    int add_lane(const char *name, int depth, uint32_t prio = ESP_THREAD_PRIO,
+                 uint32_t stack_size = ESP_THREAD_STACK_DEPTH, int core = ESP_THREAD_NO_AFFINITY);
+
+    // For every event of base, or only id, on whichever lane it comes. Returns -1 when the table is full
+    int set_listener(base_t base, int32_t id, handler_t handler, void *arg = nullptr);
+
+    // Copies size bytes of data into the event. A full lane is waited on for up to wait_ms, 0 drops at once. A handler
+    // posting to its own lane only delays the drop that way. Returns -1 when the event is dropped
+    int post(int lane, base_t base, int32_t id, const void *data = nullptr, size_t size = 0, time_t wait_ms = 0);
+
+    // post from an interrupt, never waits
+    int post_isr(int lane, base_t base, int32_t id, const void *data = nullptr, size_t size = 0);
+
+    stats_t stats(int lane);
+
+    // Clears the maxima and counters of a lane
+    void reset_stats(int lane);
+
+}
+
+#endif //EVENT_BUS_H
@@ -6,16 +6,20 @@
 static const char* TAG = "CONC_FREERTOS";
 
 void
-thread_init(thread_t *handle, ctx_func_t<thread_func_t> func, const char *name, uint32_t prio, uint32_t stack_size) {
+thread_init(thread_t *handle, ctx_func_t<thread_func_t> func, const char *name, uint32_t prio, uint32_t stack_size,
+            int core) {
     handle->function = func;
     strcpy(handle->name, name);
     handle->prio = prio;
     handle->stack_size = stack_size;
+    handle->core = core;
 }
 
 void thread_launch(thread_t *handle) {
     if (!handle->handle) {
-        xTaskCreate(handle->function.function(), handle->name, handle->stack_size, handle->function.context(), handle->prio, &handle->handle);
+        xTaskCreatePinnedToCore(handle->function.function(), handle->name, handle->stack_size,
+                                handle->function.context(), handle->prio, &handle->handle,
+                                handle->core == ESP_THREAD_NO_AFFINITY ? tskNO_AFFINITY : handle->core);
         configASSERT(handle->handle);
     }
     vTaskResume(handle->handle);
@@ -41,6 +45,12 @@ time_t thread_millis() {
     return spec.tv_sec * 1000L + spec.tv_nsec / (time_t) 1e6L;
 }
 
+time_t thread_micros() {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return spec.tv_sec * 1000000L + spec.tv_nsec / (time_t) 1e3L;
+}
+
 void thread_sleep(time_t ms) {
     vTaskDelay(pdMS_TO_TICKS(ms));
 }
@@ -70,6 +80,12 @@ void bin_sem_give(semaphore_t *handle) {
     xSemaphoreGive(handle->handle);
 }
 
+void bin_sem_give_isr(semaphore_t *handle) {
+    BaseType_t woken = pdFALSE;
+    xSemaphoreGiveFromISR(handle->handle, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
 bool bin_sem_taken(semaphore_t *handle) {
     return !uxSemaphoreGetCount(handle->handle);
 }
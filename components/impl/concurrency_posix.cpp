@@ -4,7 +4,8 @@
 static const char* TAG = "CONC_PTHREAD";
 
 void
-thread_init(thread_t *handle, ctx_func_t<thread_func_t> func, const char *name, uint32_t prio, uint32_t stack_size) {
+thread_init(thread_t *handle, ctx_func_t<thread_func_t> func, const char *name, uint32_t prio, uint32_t stack_size,
+            int core) {
     handle->function = func;
 }
 
@@ -35,8 +36,14 @@ time_t thread_millis() {
     return spec.tv_sec * 1000L + spec.tv_nsec / 1e6L;
 }
 
+time_t thread_micros() {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return spec.tv_sec * 1000000L + spec.tv_nsec / 1e3L;
+}
+
 void thread_sleep(time_t ms) {
-    const timespec t = {static_cast<long>(ms / 1000), static_cast<long>((ms % 1000) * 1000)};
+    const timespec t = {static_cast<long>(ms / 1000), static_cast<long>((ms % 1000) * 1000000)};
     nanosleep(&t, nullptr);
 }
 
@@ -59,6 +66,10 @@ int bin_sem_take(semaphore_t *handle, time_t ms) {
     clock_gettime(CLOCK_REALTIME, &spec);
     spec.tv_sec += (ms - ms_nosec) / 1000L;
     spec.tv_nsec += static_cast<long>(ms_nosec * 1e6L);
+    if (spec.tv_nsec >= 1000000000L) {
+        spec.tv_sec++;
+        spec.tv_nsec -= 1000000000L;
+    }
     return sem_timedwait(&handle->handle, &spec); // ret -1 on fail
 }
 
@@ -68,6 +79,10 @@ void bin_sem_give(semaphore_t *handle) {
     sem_post(&handle->handle);
 }
 
+void bin_sem_give_isr(semaphore_t *handle) {
+    sem_post(&handle->handle); // async signal safe
+}
+
 bool bin_sem_taken(semaphore_t *handle) {
     int val;
     sem_getvalue(&handle->handle, &val);
@@ -12,6 +12,7 @@ typedef struct thread_t {
     ctx_func_t<thread_func_t> function;
     uint32_t prio;
     uint32_t stack_size;
+    int core;
     char name[64];
 } thread_t;
 
@@ -11,11 +11,11 @@ struct thread_t {
 };
 
 struct semaphore_t {
-    sem_t handle = nullptr;
+    sem_t handle{};
 };
 
 struct mutex_t {
-    pthread_mutex_t handle = 0;
+    pthread_mutex_t handle{};
 };
 
 
@@ -16,6 +16,8 @@
 
 #define ESP_THREAD_DEFAULT_NAME "concurrent_task"
 
+#define ESP_THREAD_NO_AFFINITY -1
+
 #ifdef ESP_PLATFORM
 #include <__impl/concurrency_freertos.h>
 #else
@@ -29,7 +31,8 @@ typedef struct mutex_t mutex_t;
 
 void thread_init(thread_t *handle, ctx_func_t<thread_func_t> func, const char *name = ESP_THREAD_DEFAULT_NAME,
                  uint32_t prio = ESP_THREAD_PRIO,
-                 uint32_t stack_size = ESP_THREAD_STACK_DEPTH);
+                 uint32_t stack_size = ESP_THREAD_STACK_DEPTH,
+                 int core = ESP_THREAD_NO_AFFINITY);
 
 void thread_launch(thread_t *handle);
 
@@ -41,6 +44,8 @@ void thread_suspend(thread_t *handle);
 
 time_t thread_millis();
 
+time_t thread_micros();
+
 void thread_sleep(time_t ms);
 
 
@@ -52,6 +57,9 @@ int bin_sem_take(semaphore_t *handle, time_t timeout_ms = 0);
 
 void bin_sem_give(semaphore_t *handle);
 
+// From an interrupt, a signal handler on posix. Never blocks
+void bin_sem_give_isr(semaphore_t *handle);
+
 bool bin_sem_taken(semaphore_t *handle);
 
 
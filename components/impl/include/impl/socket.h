@@ -18,6 +18,8 @@
 
 #else
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #endif
 
 typedef struct sockaddr_storage endpoint_t;
@@ -1,6 +1,9 @@
 #include <impl/socket.h>
 #include <impl/log.h>
 
+#include <cstring>
+#include <cerrno>
+
 #ifdef ESP_PLATFORM
 #include <esp_netif.h>
 
@@ -0,0 +1,144 @@
+#include <comfort_noise.h>
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+namespace comfort_noise {
+
+    static float frame_db(const int16_t *pcm, int n) {
+        float e = 0;
+        for (int i = 0; i < n; ++i) {
+            float s = pcm[i] * (1.0f / 32768);
+            e += s * s;
+        }
+        return 10 * log10f(e / static_cast<float>(n) + 1e-10f);
+    }
+
+    void encoder_reset(encoder_t *enc, int sample_rate) {
+        memset(enc, 0, sizeof(encoder_t));
+        enc->sample_rate = sample_rate;
+    }
+
+    bool is_speech(encoder_t *enc, const int16_t *pcm, int n) {
+        float db = frame_db(pcm, n);
+        if (!enc->primed) {
+            enc->floor_db = std::max(db, CN_VAD_FLOOR_MIN_DB);
+            enc->primed = true;
+        }
+
+        bool active = db > enc->floor_db + CN_VAD_MARGIN_DB;
+
+        // the floor drops quickly and rises slowly, so talking does not lift it
+        if (db < enc->floor_db) enc->floor_db += 0.5f * (db - enc->floor_db);
+        else if (!active) enc->floor_db += std::min(CN_VAD_FLOOR_RISE_DB * n / enc->sample_rate, db - enc->floor_db);
+        enc->floor_db = std::max(enc->floor_db, CN_VAD_FLOOR_MIN_DB);
+
+        if (active) enc->hangover = CN_VAD_HANGOVER_MS * enc->sample_rate / 1000;
+        else if (enc->hangover > 0) {
+            enc->hangover -= n;
+            active = true;
+        }
+        return active;
+    }
+
+    void add_silence(encoder_t *enc, const int16_t *pcm, int n) {
+        for (int lag = 0; lag <= CN_ORDER; ++lag) {
+            float acc = 0;
+            for (int i = lag; i < n; ++i) acc += pcm[i] * (1.0f / 32768) * (pcm[i - lag] * (1.0f / 32768));
+            enc->acf[lag] += acc;
+        }
+        enc->frames += n;
+    }
+
+    // levinson-durbin, prediction error x[n] + sum(a[i] * x[n - i])
+    static int reflection(const float *acf, float *k) {
+        float a[CN_ORDER + 1] = {1}, tmp[CN_ORDER + 1];
+        float err = acf[0] * 1.0001f; // slight white noise correction keeps it well conditioned
+        if (err <= 0) return 0;
+
+        for (int m = 1; m <= CN_ORDER; ++m) {
+            float acc = acf[m];
+            for (int i = 1; i < m; ++i) acc += a[i] * acf[m - i];
+            k[m - 1] = -acc / err;
+            if (std::fabs(k[m - 1]) >= 1) return m - 1;
+
+            memcpy(tmp, a, sizeof(a));
+            for (int i = 1; i < m; ++i) a[i] = tmp[i] + k[m - 1] * tmp[m - i];
+            a[m] = k[m - 1];
+            err *= 1 - k[m - 1] * k[m - 1];
+        }
+        return CN_ORDER;
+    }
+
+    size_t flush(encoder_t *enc, uint8_t *out) {
+        uint32_t frames = std::min<uint32_t>(enc->frames, UINT16_MAX);
+        float k[CN_ORDER] = {};
+        int order = 0;
+        int level = CN_LEVEL_MAX;
+
+        if (frames) {
+            float power = enc->acf[0] / static_cast<float>(frames);
+            level = std::clamp(static_cast<int>(std::lround(-10 * log10f(power + 1e-13f))), 0, CN_LEVEL_MAX);
+            order = reflection(enc->acf, k);
+        }
+
+        out[0] = frames;
+        out[1] = frames >> 8;
+        out[2] = level;
+        out[3] = CN_ORDER;
+        for (int i = 0; i < CN_ORDER; ++i) {
+            out[4 + i] = static_cast<uint8_t>(i < order ? std::clamp(static_cast<int>(std::lround(k[i] * 128)), -127, 127) : 0);
+        }
+
+        memset(enc->acf, 0, sizeof(enc->acf));
+        enc->frames = 0;
+        return CN_DESC_SIZE;
+    }
+
+    void decoder_reset(decoder_t *dec) {
+        memset(dec, 0, sizeof(decoder_t));
+        dec->seed = 0x1234567;
+    }
+
+    int decoder_start(decoder_t *dec, const uint8_t *data, size_t len) {
+        if (len < 4 || len < 4u + data[3]) return -1;
+
+        dec->frames = data[0] | data[1] << 8;
+        dec->order = std::min<int>(data[3], CN_ORDER);
+
+        // the residual of the envelope carries prod(1 - k^2) of the power
+        float residual = 1;
+        for (int i = 0; i < dec->order; ++i) {
+            dec->k[i] = static_cast<int8_t>(data[4 + i]) * (1.0f / 128);
+            residual *= 1 - dec->k[i] * dec->k[i];
+        }
+        float rms = data[2] >= CN_LEVEL_MAX ? 0 : 32768 * powf(10, -static_cast<float>(data[2]) / 20);
+
+        // uniform excitation in [-1, 1) has a variance of 1/3
+        dec->gain = rms * sqrtf(3 * residual);
+        return static_cast<int>(dec->frames);
+    }
+
+    int decoder_generate(decoder_t *dec, int16_t *out, int n) {
+        n = static_cast<int>(std::min<uint32_t>(n, dec->frames));
+        const int p = dec->order;
+
+        for (int i = 0; i < n; ++i) {
+            dec->seed = dec->seed * 1664525 + 1013904223;
+            float f = dec->gain * (static_cast<float>(static_cast<int32_t>(dec->seed)) * (1.0f / 2147483648.0f));
+
+            // all-pole lattice, b[m] holds the backward error of stage m from the previous sample
+            for (int m = p; m >= 1; --m) {
+                f -= dec->k[m - 1] * dec->b[m - 1];
+                if (m < p) dec->b[m] = dec->b[m - 1] + dec->k[m - 1] * f;
+            }
+            if (p) dec->b[0] = f;
+
+            out[i] = static_cast<int16_t>(std::clamp(std::lround(f), -32768L, 32767L));
+        }
+        dec->frames -= n;
+        return n;
+    }
+
+}
@@ -8,15 +8,28 @@
 #include <sender.h>
 #include <receiver.h>
 
-#define DATA_WIDTH 960
+#define DATA_WIDTH 960 // media payload of a datagram at most, longer frames are split. Also the default frame
+
+#define FRAME_US_MIN 2500 // negotiable frame durations
+#define FRAME_US_MAX 20000
 
 #define ACK_TIMEOUT 500
 
+#define CMD_WINDOW 8 // commands in flight, also the range of the selective ack
+#define CMD_RTO_MS 20 // first retransmission, doubles per try
+#define CMD_RTO_MAX_MS 160
+#define CMD_TIMEOUT_MS 1500 // send_command default, dropped and reported as not acked after
+
+#define DSCP_BEST_EFFORT 0
+#define DSCP_AF41 34 // interactive video, wmm AC_VI
+#define DSCP_EF 46 // voice, wmm AC_VO
+#define NET_DSCP DSCP_EF // set by init
+
 namespace net_controller {
 
     enum cmd_t {
         CMD_EMPTY = 0,
-        CMD_ACK,
+        CMD_ACK, // unused, acks travel in control_t::ack
         ST_DISCONNECT,
         ST_SPK_ONLY,
         ST_FULL,
@@ -31,28 +44,88 @@ namespace net_controller {
         CID_INIT = 0
     };
 
-    union packet_md_t {
-        uint16_t data;
-        struct {
-            uint8_t cmd; // command
-            uint8_t cid; // command id
-        };
+    // A datagram carries one or more messages, each a msg_hdr_t followed by len bytes. Media always goes alone,
+    // so the receiver takes it without walking the list. Unknown types are skipped
+    enum msg_type_t {
+        MSG_MEDIA = 1, // pcm
+        MSG_MEDIA_CN, // comfort noise descriptor, expanded back to pcm by the receiver
+        MSG_CONTROL, // control_t
+        MSG_KEEPALIVE,
+        MSG_STATS, // stats_t, receiver report on the media it gets
+        MSG_MEDIA_MONO, // pcm reduced by the rate controller, see media_codec.h
+        MSG_MEDIA_ULAW,
+        MSG_MEDIA_ULAW_HALF
+    };
+
+    struct msg_hdr_t {
+        uint8_t type;
+        uint8_t seq; // media: counts up per message for the loss in stats_t. 0 otherwise
+        uint16_t len; // host order, both ends are little endian
+    };
+
+    // What the receiver of a media stream saw since its last report
+    struct stats_t {
+        uint16_t received; // media messages
+        uint16_t lost; // missing from the seq
+        uint16_t jitter_us; // variation of the arrival gaps, smoothed. Saturates
+        int16_t buffer_ms; // lowest playout buffer level, 0 means it ran dry, -1 when not reported
+    };
+
+    enum control_flags_t {
+        CONTROL_ACK = 1 << 0 // ack and ack_bits are valid
+    };
+
+    struct control_t {
+        uint8_t cmd; // command
+        uint8_t cid; // command id
+        uint8_t flags;
+        uint8_t ack; // newest command id taken from the remote
+        uint8_t ack_bits; // bit i: ack - 1 - i was taken as well
+        uint8_t frame; // frame duration the sender would like in 0.1 ms, 0 for none
+        uint8_t reserved[2];
     };
 
     typedef int (*cmd_cb_t)(cmd_t, void *);
 
+    typedef void (*cmd_done_t)(cmd_t, bool acked, void *);
+
     void init();
 
     void reset();
 
+    // Queues a command, sends it and returns, up to CMD_WINDOW can be in flight. It is resent until acked or
+    // timeout_ms passes, then done runs with the outcome. done is called from a network thread and must not
+    // block on it (set_cmd with wait_ack). Returns false when the window is full
+    bool send_command(cmd_t c, ctx_func_t<cmd_done_t> done = ctx_func_t<cmd_done_t>(),
+                      time_t timeout_ms = CMD_TIMEOUT_MS);
+
+    // send_command that blocks until the ack when wait_ack is set, dropped after ACK_TIMEOUT then
     void set_cmd(cmd_t c, bool wait_ack);
 
     void set_remote_cmd_cb(ctx_func_t<cmd_cb_t> cb);
 
     void set_remote_ack_cb(ctx_func_t<cmd_cb_t> cb);
 
-    constexpr inline size_t packet_md_size() {
-        return sizeof(packet_md_t);
+    // Marks everything the socket sends, media and control alike, with dscp in the ip header and on linux the
+    // matching SO_PRIORITY, so wi-fi queues it in the wmm access category for that class. Returns -1 on error
+    int set_dscp(int dscp);
+
+    // Frame duration this end would like, clamped to FRAME_US_MIN..FRAME_US_MAX, 0 for no preference. It goes out
+    // with every control message and the session runs at the longer of both: packet rate is the harder limit
+    void set_frame_us(int us);
+
+    // Negotiated frame duration, 0 while neither end asked for one
+    int frame_us();
+
+    // Bytes of the negotiated frame for 16 bit pcm, in whole pairs of frames. DATA_WIDTH without a negotiated one
+    size_t frame_bytes(int sample_rate, int channels);
+
+    // SO_RCVBUF and SO_SNDBUF in bytes, 0 keeps the current size. lwIP only has SO_RCVBUF (LWIP_SO_RCVBUF).
+    // Returns -1 on error
+    int set_buffers(int rcv_bytes, int snd_bytes);
+
+    constexpr inline size_t msg_hdr_size() {
+        return sizeof(msg_hdr_t);
     }
 
 }
@@ -6,10 +6,23 @@
 
 #include <cstdint>
 
+#define RX_SPIN_US 2000 // RX_SPIN default, about how long after a datagram the next one of a burst arrives
+#define RX_BUSY_POLL_US 50 // RX_BUSY_POLL default
+
+#define RECEIVER_REPORT_MS 500 // stats on the incoming media go back this often while it flows
+#define RECEIVER_SEQ_JUMP 64 // seq moved further than this, the sender started over
+
 namespace receiver {
 
     typedef void (*cb_t)(const uint8_t *, size_t, void *);
 
+    // How the receive task waits for datagrams, the polling modes trade a core for wake-up latency
+    enum rx_mode_t {
+        RX_BLOCK, // blocking recvfrom
+        RX_SPIN, // polls without blocking for us, then blocks. posix only
+        RX_BUSY_POLL // SO_BUSY_POLL, the kernel polls the device queue for us inside recvfrom. linux only
+    };
+
     void init();
 
     void set_cb(ctx_func_t<cb_t> cb);
@@ -18,6 +31,15 @@ namespace receiver {
 
     void bind(uint16_t port);
 
+    // Of the pcm handed to the callback, reduced media is spread back over them. 1 by default
+    void set_channels(int channels);
+
+    // Playout buffer level just before a datagram is written, the lowest since the last report goes back to the sender
+    void report_buffer(int ms);
+
+    // Returns -1 when the mode is not available here, the current one is kept then
+    int set_rx_mode(rx_mode_t mode, int us);
+
     void start();
 
     void stop();
@@ -15,12 +15,31 @@ namespace sender {
 
     void set_endpoint(const endpoint_t *enp);
 
+    // Of the 16 bit pcm from send and the callback, 44100 mono by default. Frames of the negotiated duration are
+    // sized from it
+    void set_format(int sample_rate, int channels);
+
+    // Steps the media down to fewer channels, mu-law and half the rate when the receiver reports loss or a starved
+    // playout buffer, and back up once the link holds. Starts over at full quality, also on start
+    void set_rate_control(bool enabled);
+
+    // Frames from the callback are 16 bit mono pcm: silence goes out as comfort noise descriptors
+    void set_vad(bool enabled);
+
+    // Mic packets are held back and go out together every interval_ms, so the radio can sleep in between
+    // under wifi power save. 0 sends each one right away, applies from the next start
+    void set_burst(int interval_ms);
+
+    // Keepalive message after ms without any traffic, keeps the path and the remote endpoint fresh. 0 turns it off
+    void set_keepalive(int ms);
+
     void start();
 
     void stop();
 
     void send(uint8_t *data, size_t bytes);
 
+    // Control message with the current acks and any due command, right away from the calling thread
     void send_md();
 
 }
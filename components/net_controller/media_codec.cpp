@@ -0,0 +1,121 @@
+#include <media_codec.h>
+
+#include <cstring>
+#include <algorithm>
+
+namespace media_codec {
+
+    static uint8_t ulaw_encode(int32_t s) {
+        const int32_t bias = 0x84, clip = 32635;
+        uint8_t sign = s < 0 ? 0x80 : 0;
+        s = std::min(s < 0 ? -s : s, clip) + bias;
+
+        int exp = 7;
+        for (int32_t mask = 0x4000; exp > 0 && !(s & mask); mask >>= 1) exp--;
+        int mantissa = (s >> (exp + 3)) & 0x0F;
+        return static_cast<uint8_t>(~(sign | exp << 4 | mantissa));
+    }
+
+    static int32_t ulaw_decode(uint8_t u) {
+        u = ~u;
+        int exp = (u >> 4) & 0x07;
+        int32_t s = (((u & 0x0F) << 3) + 0x84) << exp;
+        s -= 0x84;
+        return u & 0x80 ? -s : s;
+    }
+
+    static int32_t mono(const int16_t *frame, int channels) {
+        int32_t acc = 0;
+        for (int c = 0; c < channels; ++c) acc += frame[c];
+        return acc / channels;
+    }
+
+    void encoder_reset(encoder_t *enc) {
+        memset(enc, 0, sizeof(encoder_t));
+    }
+
+    void decoder_reset(decoder_t *dec) {
+        memset(dec, 0, sizeof(decoder_t));
+    }
+
+    size_t encoded_size(level_t level, int frames, int channels) {
+        switch (level) {
+            case LEVEL_PCM:
+                return frames * channels * sizeof(int16_t);
+            case LEVEL_MONO:
+                return frames * sizeof(int16_t);
+            case LEVEL_ULAW:
+                return frames;
+            default:
+                return frames / 2;
+        }
+    }
+
+    size_t encode(encoder_t *enc, level_t level, const int16_t *pcm, int frames, int channels, uint8_t *out) {
+        switch (level) {
+            case LEVEL_PCM:
+                memcpy(out, pcm, frames * channels * sizeof(int16_t));
+                break;
+            case LEVEL_MONO:
+                for (int i = 0; i < frames; ++i) {
+                    auto s = static_cast<int16_t>(mono(pcm + i * channels, channels));
+                    memcpy(out + i * sizeof(int16_t), &s, sizeof(int16_t));
+                }
+                break;
+            case LEVEL_ULAW:
+                for (int i = 0; i < frames; ++i) out[i] = ulaw_encode(mono(pcm + i * channels, channels));
+                break;
+            default:
+                // [1 2 1] / 4 before dropping every other frame, takes the worst of the aliasing
+                for (int i = 0; i + 1 < frames; i += 2) {
+                    int32_t a = mono(pcm + i * channels, channels), b = mono(pcm + (i + 1) * channels, channels);
+                    out[i / 2] = ulaw_encode((enc->prev + 2 * a + b) / 4);
+                    enc->prev = b;
+                }
+                break;
+        }
+        return encoded_size(level, frames, channels);
+    }
+
+    static void put(int16_t *out, int32_t s, int channels) {
+        for (int c = 0; c < channels; ++c) out[c] = static_cast<int16_t>(s);
+    }
+
+    int decode(decoder_t *dec, level_t level, const uint8_t *in, size_t len, size_t *used,
+               int16_t *out, int max_frames, int channels) {
+        int frames = 0;
+        size_t pos = 0;
+
+        switch (level) {
+            case LEVEL_PCM:
+                frames = static_cast<int>(std::min<size_t>(len / (channels * sizeof(int16_t)), max_frames));
+                pos = frames * channels * sizeof(int16_t);
+                memcpy(out, in, pos);
+                break;
+            case LEVEL_MONO:
+                for (; frames < max_frames && pos + sizeof(int16_t) <= len; ++frames, pos += sizeof(int16_t)) {
+                    int16_t s;
+                    memcpy(&s, in + pos, sizeof(int16_t));
+                    put(out + frames * channels, s, channels);
+                }
+                break;
+            case LEVEL_ULAW:
+                for (; frames < max_frames && pos < len; ++frames, ++pos) {
+                    put(out + frames * channels, ulaw_decode(in[pos]), channels);
+                }
+                break;
+            default:
+                // linear interpolation, half a frame late
+                for (; frames + 1 < max_frames && pos < len; frames += 2, ++pos) {
+                    int32_t s = ulaw_decode(in[pos]);
+                    put(out + frames * channels, (dec->last + s) / 2, channels);
+                    put(out + (frames + 1) * channels, s, channels);
+                    dec->last = s;
+                }
+                break;
+        }
+        *used = pos;
+        return frames;
+    }
+
+}
@@ -1,11 +1,14 @@
 #include <net_controller.h>
 #include <net_controller_private.h>
+#include <packet_pool.h>
 
 #include <impl/concurrency.h>
 #include <impl/socket.h>
 #include <impl/helpers.h>
 #include <impl/log.h>
 
+#include <algorithm>
+
 namespace net_controller {
 
     static const char *TAG = "NET_CONTROLLER";
@@ -16,15 +19,45 @@ namespace net_controller {
     static ctx_func_t<cmd_cb_t> remote_ack_cb;
 
     static mutex_t mutex;
-    static semaphore_t ack_sem;
-    static bool ack_dowait;
 
-    static cmd_t cmd;
-    static int cid;
+    // commands in flight, resent on their own timers until the remote acks them or the deadline passes
+    typedef struct {
+        cmd_t cmd; // CMD_EMPTY when free
+        uint8_t cid;
+        int tries;
+        time_t due; // next (re)transmission
+        time_t deadline;
+        ctx_func_t<cmd_done_t> done;
+    } cmd_slot_t;
+
+    // completions are collected under the mutex and run after it is released
+    typedef struct {
+        ctx_func_t<cmd_done_t> done;
+        cmd_t cmd;
+        bool acked;
+    } completion_t;
+
+    static cmd_slot_t slots[CMD_WINDOW];
+    static uint8_t cid;
+
+    // commands taken from the remote, repeated back as a selective ack in every packet
+    static bool rx_valid;
+    static uint8_t rx_last;
+    static uint8_t rx_bits;
+    static bool ack_owed;
+
+    // frame duration preferences in 0.1 ms
+    static std::atomic<uint8_t> frame_local, frame_remote;
 
-    static int need_ack_cid;
-    static int last_ack_cid;
 
+    static void slot_done(cmd_slot_t *slot, bool acked, completion_t *out, int *num) {
+        out[(*num)++] = {slot->done, slot->cmd, acked};
+        slot->cmd = CMD_EMPTY;
+    }
+
+    static void complete(completion_t *c, int num) {
+        for (int i = 0; i < num; ++i) c[i].done(c[i].cmd, c[i].acked);
+    }
 
     void init() {
         socket_init();
@@ -33,6 +66,7 @@ namespace net_controller {
             loge(TAG, "Socket init error: %d", socket_errno());
             return;
         }
+        set_dscp(NET_DSCP);
 //        int opt = 1;
 //        if (setsockopt(g_socket, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char *>(&opt), sizeof(int)) == -1) {
 //            loge(TAG, "error setting SO_REUSEADDR: %d", socket_errno());
@@ -40,110 +74,279 @@ namespace net_controller {
 //        }
 
         mutex_init(&mutex);
-        bin_sem_init(&ack_sem);
-        ack_dowait = false;
-
-        cmd = CMD_EMPTY;
+        for (auto &slot: slots) slot.cmd = CMD_EMPTY;
         cid = CID_INIT;
-        need_ack_cid = CID_NONE;
-        last_ack_cid = CID_NONE;
+        rx_valid = false;
+        ack_owed = false;
+        frame_local = frame_remote = 0;
 
+        packet_pool::init();
         sender::init();
         receiver::init();
     }
 
+#ifdef SO_PRIORITY
+    // 802.1d user priority for a dscp as in rfc 8325, EF and VOICE-ADMIT go to AC_VO rather than AC_VI
+    static int dscp_to_up(int dscp) {
+        if (dscp == DSCP_EF || dscp == 44) return 6;
+        return dscp >> 3;
+    }
+#endif
+
+    int set_dscp(int dscp) {
+        if (dscp < 0 || dscp > 63) return -1;
+
+        int tos = dscp << 2;
+        if (setsockopt(g_socket, IPPROTO_IP, IP_TOS, reinterpret_cast<char *>(&tos), sizeof(int)) == -1) {
+            loge(TAG, "error setting IP_TOS: %d", socket_errno());
+            return -1;
+        }
+#ifdef SO_PRIORITY
+        // linux derives the priority from the tos, which puts EF in AC_VI
+        int prio = dscp_to_up(dscp);
+        if (setsockopt(g_socket, SOL_SOCKET, SO_PRIORITY, reinterpret_cast<char *>(&prio), sizeof(int)) == -1) {
+            loge(TAG, "error setting SO_PRIORITY: %d", socket_errno());
+            return -1;
+        }
+#endif
+        return 0;
+    }
+
+    static int set_buffer(int opt, const char *name, int bytes) {
+        if (!bytes) return 0;
+        if (setsockopt(g_socket, SOL_SOCKET, opt, reinterpret_cast<char *>(&bytes), sizeof(int)) == -1) {
+            loge(TAG, "error setting %s: %d", name, socket_errno());
+            return -1;
+        }
+        // linux doubles the request for its bookkeeping and caps it at rmem_max / wmem_max
+        int actual = 0;
+        socklen_t len = sizeof(int);
+        getsockopt(g_socket, SOL_SOCKET, opt, reinterpret_cast<char *>(&actual), &len);
+        logi(TAG, "%s %d, asked for %d", name, actual, bytes);
+        return 0;
+    }
+
+    int set_buffers(int rcv_bytes, int snd_bytes) {
+        if (rcv_bytes < 0 || snd_bytes < 0) return -1;
+        int res = set_buffer(SO_RCVBUF, "SO_RCVBUF", rcv_bytes);
+        if (set_buffer(SO_SNDBUF, "SO_SNDBUF", snd_bytes)) res = -1;
+        return res;
+    }
+
+    void set_frame_us(int us) {
+        frame_local = us ? std::clamp(us, FRAME_US_MIN, FRAME_US_MAX) / 100 : 0;
+    }
+
+    int frame_us() {
+        return std::max(frame_local.load(), frame_remote.load()) * 100;
+    }
+
+    size_t frame_bytes(int sample_rate, int channels) {
+        int us = frame_us();
+        if (!us) return DATA_WIDTH;
+        size_t frames = static_cast<size_t>(static_cast<int64_t>(sample_rate) * us / 1000000) & ~static_cast<size_t>(1);
+        return std::max<size_t>(frames, 2) * channels * sizeof(int16_t);
+    }
+
     void reset() {
         sender::stop();
         receiver::stop();
 
+        completion_t dropped[CMD_WINDOW];
+        int dropped_num = 0;
+
         mutex_lock(&mutex);
-        cmd = CMD_EMPTY;
-        cid = CID_INIT;
-        need_ack_cid = CID_NONE;
-        last_ack_cid = CID_NONE;
-        if (ack_dowait) {
-            bin_sem_give(&ack_sem);
-            ack_dowait = false;
+        for (auto &slot: slots) {
+            if (slot.cmd != CMD_EMPTY) slot_done(&slot, false, dropped, &dropped_num);
         }
+        cid = CID_INIT;
+        rx_valid = false;
+        ack_owed = false;
+        frame_remote = 0;
         mutex_unlock(&mutex);
+
+        complete(dropped, dropped_num);
     }
 
-    void set_cmd(cmd_t c, bool wait_ack) {
-        if (c == CMD_ACK || c == CMD_EMPTY) return;
+    bool send_command(cmd_t c, ctx_func_t<cmd_done_t> done, time_t timeout_ms) {
+        if (c == CMD_ACK || c == CMD_EMPTY) return false;
 
         mutex_lock(&mutex);
-        if (cmd != CMD_EMPTY) {
-            loge(TAG, "The previous command was not obtained: %d", cmd);
+        cmd_slot_t *slot = nullptr;
+        for (auto &s: slots) {
+            if (s.cmd == CMD_EMPTY) {
+                slot = &s;
+                break;
+            }
+        }
+        if (!slot) {
             mutex_unlock(&mutex);
-            return;
+            loge(TAG, "Command window is full, dropping: %d", c);
+            return false;
         }
-        cmd = c;
-        if (++cid > 255) cid = 0;
-        ack_dowait = wait_ack;
+
+        slot->cmd = c;
+        slot->cid = ++cid;
+        slot->tries = 0;
+        slot->due = thread_millis();
+        slot->deadline = slot->due + timeout_ms;
+        slot->done = done;
         mutex_unlock(&mutex);
 
-        sender::send_md();
-        if (!wait_ack) return;
+        send_control();
+        // retransmissions run on the send task, its wait has to be recomputed
+        sender::wake();
+        return true;
+    }
+
+    static void set_cmd_done(cmd_t c, bool acked, void *ctx) {
+        if (!acked) loge(TAG, "Command (%d) acknowledgement timed out", c);
+        if (ctx) bin_sem_give(static_cast<semaphore_t *>(ctx));
+    }
 
-        if (bin_sem_take(&ack_sem, ACK_TIMEOUT) == -1) {
-            loge(TAG, "Command (%d) acknowledgement timed out", cmd);
-            mutex_lock(&mutex);
-            ack_dowait = false;
-            cmd = CMD_EMPTY;
-            mutex_unlock(&mutex);
+    void set_cmd(cmd_t c, bool wait_ack) {
+        if (!wait_ack) {
+            send_command(c, ctx_func_t<cmd_done_t>(set_cmd_done, nullptr), CMD_TIMEOUT_MS);
+            return;
         }
+
+        // the completion always comes, by ACK_TIMEOUT at the latest
+        semaphore_t sem;
+        bin_sem_init(&sem);
+        if (send_command(c, ctx_func_t<cmd_done_t>(set_cmd_done, &sem), ACK_TIMEOUT)) bin_sem_take(&sem);
+        bin_sem_deinit(&sem);
     }
 
-    void remote_set_md(const uint8_t *d) {
-        auto *data = (packet_md_t *) d;
-        if (data->cmd == CMD_EMPTY) return;
+    static bool rx_seen(uint8_t c) {
+        if (!rx_valid) return false;
+        int d = static_cast<int8_t>(rx_last - c);
+        if (d == 0) return true;
+        if (d > 0 && d <= CMD_WINDOW) return rx_bits >> (d - 1) & 1;
+        return false; // newer, or so old that the remote must have started over
+    }
 
-        cmd_t cb_cmd = CMD_EMPTY, cb_ack_cmd = CMD_EMPTY;
+    static void rx_mark(uint8_t c) {
+        int d = static_cast<int8_t>(c - rx_last);
+        if (!rx_valid || d > CMD_WINDOW || d < -CMD_WINDOW) {
+            rx_valid = true;
+            rx_last = c;
+            rx_bits = 0;
+        } else if (d > 0) {
+            rx_bits = static_cast<uint8_t>((static_cast<uint32_t>(rx_bits) << 1 | 1) << (d - 1));
+            rx_last = c;
+        } else if (d < 0) {
+            rx_bits |= 1 << (-d - 1);
+        }
+    }
+
+    static bool control_acks(const control_t *c, uint8_t id) {
+        if (!(c->flags & CONTROL_ACK)) return false;
+        int d = static_cast<int8_t>(c->ack - id);
+        if (d == 0) return true;
+        return d > 0 && d <= CMD_WINDOW && (c->ack_bits >> (d - 1) & 1);
+    }
+
+    void control_parse(const control_t *data) {
+        completion_t acked[CMD_WINDOW];
+        int acked_num = 0;
+        bool fresh = false, owed;
+
+        // before the command callback, a session may start on it
+        frame_remote = data->frame ? std::clamp<int>(data->frame, FRAME_US_MIN / 100, FRAME_US_MAX / 100) : 0;
 
         mutex_lock(&mutex);
-        if (data->cmd == CMD_ACK) {
-            if (data->cid == cid) {
-                cb_ack_cmd = cmd;
-                cmd = CMD_EMPTY;
-                if (ack_dowait) {
-                    bin_sem_give(&ack_sem);
-                    ack_dowait = false;
-                }
-            }
-        } else {
-            if (last_ack_cid != data->cid) {
-                cb_cmd = static_cast<cmd_t>(data->cmd);
-                last_ack_cid = data->cid;
-            }
+        for (auto &slot: slots) {
+            if (slot.cmd == CMD_EMPTY || !control_acks(data, slot.cid)) continue;
+            slot_done(&slot, true, acked, &acked_num);
+        }
+        if (data->cmd != CMD_EMPTY) {
+            fresh = !rx_seen(data->cid);
+            // a resend means our ack got lost
+            if (!fresh) ack_owed = true;
         }
         mutex_unlock(&mutex);
 
-        if (cb_cmd != CMD_EMPTY) {
-            int res = remote_cmd_cb(cb_cmd);
-            if (res == 0) {
-                mutex_lock(&mutex);
-                need_ack_cid = data->cid;
-                mutex_unlock(&mutex);
-                sender::send_md();
-            }
+        for (int i = 0; i < acked_num; ++i) remote_ack_cb(acked[i].cmd);
+        complete(acked, acked_num);
+
+        bool taken = fresh && remote_cmd_cb(static_cast<cmd_t>(data->cmd)) == 0;
+        mutex_lock(&mutex);
+        if (taken) {
+            rx_mark(data->cid);
+            ack_owed = true;
         }
-        if (cb_ack_cmd != CMD_EMPTY) {
-            int res = remote_ack_cb(cb_ack_cmd);
+        owed = ack_owed;
+        mutex_unlock(&mutex);
+
+        if (owed) send_control();
+    }
+
+    static void expire(time_t now, completion_t *out, int *num) {
+        for (auto &slot: slots) {
+            if (slot.cmd != CMD_EMPTY && slot.deadline <= now) slot_done(&slot, false, out, num);
         }
     }
 
-    void remote_get_md(uint8_t *d) {
-        auto *data = (packet_md_t *) d;
+    static time_t rto(int tries) {
+        time_t ms = CMD_RTO_MS;
+        for (int i = 1; i < tries && ms < CMD_RTO_MAX_MS; ++i) ms *= 2;
+        return ms < CMD_RTO_MAX_MS ? ms : CMD_RTO_MAX_MS;
+    }
+
+    void send_control() {
+        alignas(msg_hdr_t) uint8_t msg[HDR_SIZE + sizeof(control_t)];
+        auto *data = reinterpret_cast<control_t *>(msg + HDR_SIZE);
+        completion_t expired[CMD_WINDOW];
+        int expired_num = 0;
+        time_t now = thread_millis();
+
         mutex_lock(&mutex);
-        if (need_ack_cid != -1) {
-            data->cmd = CMD_ACK;
-            data->cid = need_ack_cid;
-            need_ack_cid = -1;
+        expire(now, expired, &expired_num);
+        data->flags = rx_valid ? CONTROL_ACK : 0;
+        data->ack = rx_last;
+        data->ack_bits = rx_bits;
+        ack_owed = false;
+
+        // the command that has waited longest past its timer goes along
+        cmd_slot_t *next = nullptr;
+        for (auto &slot: slots) {
+            if (slot.cmd == CMD_EMPTY || slot.due > now) continue;
+            if (!next || slot.due < next->due) next = &slot;
+        }
+        if (next) {
+            data->cmd = next->cmd;
+            data->cid = next->cid;
+            next->due = now + rto(++next->tries);
         } else {
-            data->cmd = cmd;
-            data->cid = cid;
+            data->cmd = CMD_EMPTY;
+            data->cid = 0;
         }
+        data->frame = frame_local;
+        data->reserved[0] = data->reserved[1] = 0;
         mutex_unlock(&mutex);
+
+        sender::send_datagram(msg, msg_put(msg, MSG_CONTROL, sizeof(control_t)));
+        complete(expired, expired_num);
+    }
+
+    time_t control_wait() {
+        completion_t expired[CMD_WINDOW];
+        int expired_num = 0;
+        time_t now = thread_millis(), wait = -1;
+
+        mutex_lock(&mutex);
+        expire(now, expired, &expired_num);
+        for (auto &slot: slots) {
+            if (slot.cmd == CMD_EMPTY) continue;
+            time_t next = slot.due < slot.deadline ? slot.due : slot.deadline;
+            time_t left = next > now ? next - now : 0;
+            if (wait < 0 || left < wait) wait = left;
+        }
+        if (ack_owed) wait = 0;
+        mutex_unlock(&mutex);
+
+        complete(expired, expired_num);
+        return wait;
     }
 
     void set_remote_cmd_cb(ctx_func_t<cmd_cb_t> cb) {
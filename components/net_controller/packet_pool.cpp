@@ -0,0 +1,66 @@
+#include <packet_pool.h>
+
+#define POOL_NIL 0xFFFF
+
+static_assert(PACKET_POOL_SIZE < POOL_NIL, "packet indices are 16 bit");
+
+namespace packet_pool {
+
+    static packet_t g_packets[PACKET_POOL_SIZE];
+
+    // free list head, index in the low half and a tag bumped on every change in the high half against aba.
+    // 32 bit so the cas is native on the esp32 as well
+    static std::atomic<uint32_t> g_head;
+    static std::atomic<int> g_available, g_low_water;
+
+    static uint32_t head_next(uint32_t head, uint16_t index) {
+        return ((head >> 16) + 1) << 16 | index;
+    }
+
+    void init() {
+        for (int i = 0; i < PACKET_POOL_SIZE; ++i) {
+            g_packets[i].next.store(i + 1 < PACKET_POOL_SIZE ? i + 1 : POOL_NIL, std::memory_order_relaxed);
+            g_packets[i].len = 0;
+        }
+        g_available = g_low_water = PACKET_POOL_SIZE;
+        g_head.store(0, std::memory_order_release);
+    }
+
+    packet_t *alloc() {
+        uint32_t head = g_head.load(std::memory_order_acquire);
+        packet_t *p;
+        do {
+            uint16_t index = head & 0xFFFF;
+            if (index == POOL_NIL) return nullptr;
+            p = &g_packets[index];
+            // a stale next is harmless, the tag fails the cas then
+        } while (!g_head.compare_exchange_weak(head, head_next(head, p->next.load(std::memory_order_relaxed)),
+                                               std::memory_order_acquire, std::memory_order_acquire));
+
+        p->len = 0;
+        int left = --g_available;
+        int low = g_low_water;
+        while (left < low && !g_low_water.compare_exchange_weak(low, left));
+        return p;
+    }
+
+    void free(packet_t *p) {
+        // counted before it is back, so the count never drops below the packets really free
+        ++g_available;
+        auto index = static_cast<uint16_t>(p - g_packets);
+        uint32_t head = g_head.load(std::memory_order_relaxed);
+        do {
+            p->next.store(head & 0xFFFF, std::memory_order_relaxed);
+        } while (!g_head.compare_exchange_weak(head, head_next(head, index), std::memory_order_release,
+                                               std::memory_order_relaxed));
+    }
+
+    int available() {
+        return g_available;
+    }
+
+    int low_water() {
+        return g_low_water;
+    }
+
+}
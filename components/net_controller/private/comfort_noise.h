@@ -0,0 +1,69 @@
+#ifndef NET_CONTROLLER_COMFORT_NOISE_H
+#define NET_CONTROLLER_COMFORT_NOISE_H
+
+#include <cstdint>
+#include <cstddef>
+
+#define CN_ORDER 8 // spectral envelope, reflection coefficients
+#define CN_DESC_SIZE (4 + CN_ORDER) // frames (le16), level, order, k[order]; keeps the metadata after it aligned
+
+#define CN_VAD_MARGIN_DB 9.0f // frame energy over the noise floor that counts as speech
+#define CN_VAD_HANGOVER_MS 200 // kept as speech after the last active frame
+#define CN_VAD_FLOOR_RISE_DB 5.0f // per second, the floor follows louder noise slowly
+#define CN_VAD_FLOOR_MIN_DB (-72.0f) // digital silence must not drag the floor out of reach
+
+#define CN_LEVEL_MAX 127 // level is -dBov, 127 is silence
+
+// Voice activity detection and comfort noise descriptors (rfc 3389 style) for 16 bit mono pcm.
+// Silent frames are summed into one descriptor with the level and spectral envelope of the background,
+// the receiver turns it back into the same number of frames of matching noise
+namespace comfort_noise {
+
+    typedef struct {
+        // vad
+        int sample_rate;
+        float floor_db;
+        int hangover; // samples
+        bool primed;
+
+        // silence summed since the last descriptor
+        float acf[CN_ORDER + 1];
+        uint32_t frames;
+    } encoder_t;
+
+    typedef struct {
+        float k[CN_ORDER];
+        float b[CN_ORDER];
+        int order;
+        float gain;
+        uint32_t seed;
+        uint32_t frames; // still to be generated from the current descriptor
+    } decoder_t;
+
+    void encoder_reset(encoder_t *enc, int sample_rate);
+
+    // Classifies one frame, updates the noise floor while there is no speech
+    bool is_speech(encoder_t *enc, const int16_t *pcm, int n);
+
+    // Adds a frame the vad rejected to the pending descriptor
+    void add_silence(encoder_t *enc, const int16_t *pcm, int n);
+
+    // Frames covered by the pending descriptor
+    inline uint32_t pending(const encoder_t *enc) {
+        return enc->frames;
+    }
+
+    // Writes the pending descriptor (CN_DESC_SIZE bytes) and starts a new one. Returns bytes written
+    size_t flush(encoder_t *enc, uint8_t *out);
+
+    void decoder_reset(decoder_t *dec);
+
+    // Loads a descriptor, returns the frames it covers or -1 when malformed
+    int decoder_start(decoder_t *dec, const uint8_t *data, size_t len);
+
+    // Produces up to n frames of the current descriptor, returns frames written
+    int decoder_generate(decoder_t *dec, int16_t *out, int n);
+
+}
+
+#endif //NET_CONTROLLER_COMFORT_NOISE_H
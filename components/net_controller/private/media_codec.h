@@ -0,0 +1,45 @@
+#ifndef NET_CONTROLLER_MEDIA_CODEC_H
+#define NET_CONTROLLER_MEDIA_CODEC_H
+
+#include <cstdint>
+#include <cstddef>
+
+// Reductions of 16 bit pcm the rate controller steps through when the link degrades, each level about halves the
+// bitrate of the one before. Everything below LEVEL_PCM is mono, the decoder spreads it over the output channels.
+// Frames are expected in even counts, the half rate level keeps no odd sample between calls
+namespace media_codec {
+
+    enum level_t {
+        LEVEL_PCM = 0, // as is
+        LEVEL_MONO, // 16 bit mono, skipped for mono input
+        LEVEL_ULAW, // g.711 mu-law mono
+        LEVEL_ULAW_HALF, // mu-law mono at half the rate
+        LEVEL_NUM
+    };
+
+    typedef struct {
+        int32_t prev; // decimation filter history
+    } encoder_t;
+
+    typedef struct {
+        int32_t last; // interpolation history
+    } decoder_t;
+
+    void encoder_reset(encoder_t *enc);
+
+    void decoder_reset(decoder_t *dec);
+
+    // Bytes frames of pcm take at level
+    size_t encoded_size(level_t level, int frames, int channels);
+
+    // Returns bytes written to out, encoded_size of them
+    size_t encode(encoder_t *enc, level_t level, const int16_t *pcm, int frames, int channels, uint8_t *out);
+
+    // Decodes from in until it is used up or max_frames are written, *used tells how far it got.
+    // Returns frames written
+    int decode(decoder_t *dec, level_t level, const uint8_t *in, size_t len, size_t *used,
+               int16_t *out, int max_frames, int channels);
+
+}
+
+#endif //NET_CONTROLLER_MEDIA_CODEC_H
@@ -9,17 +9,47 @@
 #include <cstdint>
 #include <atomic>
 
-#define MD_SIZE net_controller::packet_md_size()
-#define PIPE_WIDTH DATA_WIDTH + MD_SIZE
+#define HDR_SIZE net_controller::msg_hdr_size()
+#define PIPE_WIDTH (DATA_WIDTH + HDR_SIZE)
 
 namespace net_controller {
 
-    void remote_set_md(const uint8_t *d);
+    // Writes the header in front of len bytes of value, returns the size of the whole message
+    inline size_t msg_put(uint8_t *msg, msg_type_t type, size_t len, uint8_t seq = 0) {
+        auto *hdr = reinterpret_cast<msg_hdr_t *>(msg);
+        hdr->type = type;
+        hdr->seq = seq;
+        hdr->len = static_cast<uint16_t>(len);
+        return HDR_SIZE + len;
+    }
 
-    void remote_get_md(uint8_t *d);
+    void control_parse(const control_t *c);
+
+    // Sends a control message now with the current acks and the command that is due, if any
+    void send_control();
+
+    // ms until control has something to send: an ack that is owed or a command due for (re)transmission.
+    // -1 when nothing is pending. Runs the completions of expired commands
+    time_t control_wait();
 
     extern socket_t g_socket;
 
 }
 
+namespace sender {
+
+    // The receiver got a packet, so the radio is awake: a good moment to send a pending burst
+    void on_downlink();
+
+    // The task rechecks net_controller::control_wait
+    void wake();
+
+    // One datagram to the endpoint as is, from any thread
+    void send_datagram(const uint8_t *data, size_t bytes);
+
+    // Feeds the rate controller, from the receive thread
+    void on_report(const net_controller::stats_t *stats);
+
+}
+
 #endif //NET_CONTROLLER_PRIVATE_H
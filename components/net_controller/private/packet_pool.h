@@ -0,0 +1,41 @@
+#ifndef NET_CONTROLLER_PACKET_POOL_H
+#define NET_CONTROLLER_PACKET_POOL_H
+
+#include <net_controller_private.h>
+
+#include <cstdint>
+#include <atomic>
+
+#ifndef PACKET_POOL_SIZE
+#ifdef ESP_PLATFORM
+#define PACKET_POOL_SIZE 16 // a full burst queue and the packet in reception, ~16 KB
+#else
+#define PACKET_POOL_SIZE 256
+#endif
+#endif
+
+// Fixed pool of datagram buffers, allocated once. A packet has one owner at a time, passed along with the pointer,
+// and whoever has it last frees it. Alloc and free never block and take no locks, so they are fine from any thread
+namespace packet_pool {
+
+    typedef struct packet_t {
+        std::atomic<uint16_t> next; // free list
+        uint16_t len; // bytes used in data
+        alignas(net_controller::msg_hdr_t) uint8_t data[PIPE_WIDTH];
+    } packet_t;
+
+    void init();
+
+    // nullptr when the pool is used up
+    packet_t *alloc();
+
+    void free(packet_t *p);
+
+    // Free packets, and the fewest there were since init
+    int available();
+
+    int low_water();
+
+}
+
+#endif //NET_CONTROLLER_PACKET_POOL_H
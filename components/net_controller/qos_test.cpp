@@ -0,0 +1,86 @@
+#include <net_controller.h>
+#include <net_controller_private.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+
+#define QOS_TEST_PORT 48097
+
+// Sends one datagram over loopback with the given class and checks the tos the receiver sees and the priority the
+// socket carries. Returns 0 when both match
+static int check(int rx, int dscp, int up) {
+    if (net_controller::set_dscp(dscp) != 0) {
+        printf("dscp %d: set_dscp failed\n", dscp);
+        return 1;
+    }
+    sender::send_datagram(reinterpret_cast<const uint8_t *>("qos"), 3);
+
+    uint8_t buf[64];
+    char ctl[CMSG_SPACE(sizeof(int))];
+    iovec io{buf, sizeof(buf)};
+    msghdr msg{};
+    msg.msg_iov = &io;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+    if (recvmsg(rx, &msg, 0) < 0) {
+        printf("dscp %d: nothing received\n", dscp);
+        return 1;
+    }
+
+    int tos = -1;
+    for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_TOS) tos = *CMSG_DATA(c);
+    }
+
+    int fail = tos >> 2 != dscp;
+    printf("dscp %d: received tos 0x%02x (dscp %d)", dscp, tos, tos >> 2);
+#ifdef SO_PRIORITY
+    int prio = -1;
+    socklen_t len = sizeof(prio);
+    getsockopt(net_controller::g_socket, SOL_SOCKET, SO_PRIORITY, &prio, &len);
+    fail |= prio != up;
+    printf(", priority %d, expected %d", prio, up);
+#else
+    (void) up;
+#endif
+    printf(" %s\n", fail ? "FAIL" : "ok");
+    return fail;
+}
+
+// qos_test, exits with 1 when a class is not marked as expected
+int main() {
+    net_controller::init();
+
+    int rx = socket(AF_INET, SOCK_DGRAM, 0);
+    int one = 1;
+    setsockopt(rx, IPPROTO_IP, IP_RECVTOS, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(QOS_TEST_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(rx, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+        printf("port %d taken\n", QOS_TEST_PORT);
+        return 1;
+    }
+    timeval timeout{1, 0};
+    setsockopt(rx, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    endpoint_t ep;
+    endpoint_set_port(&ep, QOS_TEST_PORT);
+    endpoint_set_addr_v4(&ep, "127.0.0.1");
+    sender::set_endpoint(&ep);
+
+    int fail = check(rx, NET_DSCP, 6);
+    fail |= check(rx, DSCP_AF41, 4);
+    fail |= check(rx, DSCP_BEST_EFFORT, 0);
+    close(rx);
+
+    fflush(stdout);
+    _exit(fail); // the network threads never return
+}
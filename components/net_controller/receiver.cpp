@@ -1,10 +1,18 @@
 #include <receiver.h>
 #include <net_controller.h>
 #include <net_controller_private.h>
+#include <comfort_noise.h>
+#include <media_codec.h>
+#include <packet_pool.h>
 
 #include <impl/concurrency.h>
 #include <impl/log.h>
 #include <unistd.h>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <algorithm>
 
 namespace receiver {
 
@@ -20,6 +28,23 @@ namespace receiver {
 
     static semaphore_t g_task_sem;
 
+    static comfort_noise::decoder_t g_cn;
+
+    static std::atomic<rx_mode_t> g_rx_mode;
+    static std::atomic<int> g_spin_us;
+
+    static std::atomic<int> g_channels;
+    static media_codec::decoder_t g_dec;
+    static uint8_t g_dec_type;
+
+    // the next report, media is only delivered from the task so it owns these
+    static bool g_seq_valid;
+    static uint8_t g_seq;
+    static uint32_t g_received, g_lost;
+    static time_t g_arrival_us, g_gap_us, g_jitter_us;
+    static time_t g_report_start;
+    static std::atomic<int> g_buffer_min;
+
     static void task_receive(void *ctx);
 
     void init() {
@@ -28,6 +53,17 @@ namespace receiver {
         mutex_init(&g_mutex);
         g_cur_state = false;
         bin_sem_init(&g_task_sem);
+        comfort_noise::decoder_reset(&g_cn);
+        g_rx_mode = RX_BLOCK;
+        g_spin_us = RX_SPIN_US;
+        g_channels = 1;
+        media_codec::decoder_reset(&g_dec);
+        g_dec_type = 0;
+        g_seq_valid = false;
+        g_received = g_lost = 0;
+        g_arrival_us = g_gap_us = g_jitter_us = 0;
+        g_report_start = thread_millis();
+        g_buffer_min = INT_MAX;
 
         thread_init(&g_thread, task_receive, "receive_task");
         thread_launch(&g_thread);
@@ -62,6 +98,34 @@ namespace receiver {
         }
     }
 
+    int set_rx_mode(rx_mode_t mode, int us) {
+        if (us < 0) return -1;
+#if defined(ESP_PLATFORM) || !defined(MSG_DONTWAIT)
+        if (mode == RX_SPIN) return -1;
+#endif
+#ifdef SO_BUSY_POLL
+        int busy_poll = mode == RX_BUSY_POLL ? us : 0;
+        if (setsockopt(g_socket, SOL_SOCKET, SO_BUSY_POLL, reinterpret_cast<char *>(&busy_poll), sizeof(int)) == -1) {
+            loge(TAG, "error setting SO_BUSY_POLL: %d", socket_errno());
+            if (mode == RX_BUSY_POLL) return -1;
+        }
+#else
+        if (mode == RX_BUSY_POLL) return -1;
+#endif
+        if (mode == RX_SPIN) g_spin_us = us;
+        g_rx_mode = mode;
+        return 0;
+    }
+
+    void set_channels(int channels) {
+        g_channels = channels;
+    }
+
+    void report_buffer(int ms) {
+        int cur = g_buffer_min;
+        while (ms < cur && !g_buffer_min.compare_exchange_weak(cur, ms));
+    }
+
     void start() {
         g_cur_state = true;
         bin_sem_give(&g_task_sem);
@@ -72,26 +136,164 @@ namespace receiver {
         bin_sem_give(&g_task_sem);
     }
 
+    // Hands the silence a descriptor stands for to the callback as pcm, at most DATA_WIDTH per call
+    static void expand_cn(const uint8_t *desc, size_t len) {
+        int16_t pcm[DATA_WIDTH / sizeof(int16_t)];
+        if (comfort_noise::decoder_start(&g_cn, desc, len) < 0) {
+            loge(TAG, "bad comfort noise descriptor, %d bytes", static_cast<int>(len));
+            return;
+        }
+        int n;
+        while ((n = comfort_noise::decoder_generate(&g_cn, pcm, DATA_WIDTH / sizeof(int16_t))) > 0) {
+            g_cb(reinterpret_cast<uint8_t *>(pcm), n * sizeof(int16_t));
+        }
+    }
+
+    // Hands reduced media to the callback as pcm of g_channels, at most DATA_WIDTH per call
+    static void expand_coded(uint8_t type, const uint8_t *in, size_t len) {
+        int16_t pcm[DATA_WIDTH / sizeof(int16_t)];
+        const int channels = g_channels;
+        auto level = static_cast<media_codec::level_t>(type - net_controller::MSG_MEDIA_MONO + media_codec::LEVEL_MONO);
+        if (type != g_dec_type) {
+            media_codec::decoder_reset(&g_dec);
+            g_dec_type = type;
+        }
+
+        size_t used;
+        int n;
+        while ((n = media_codec::decode(&g_dec, level, in, len, &used, pcm, DATA_WIDTH / (channels * sizeof(int16_t)),
+                                        channels)) > 0) {
+            g_cb(reinterpret_cast<uint8_t *>(pcm), n * channels * sizeof(int16_t));
+            in += used;
+            len -= used;
+        }
+    }
+
+    // Loss from the gaps in seq, jitter as in rfc 3550 but over the arrival gaps alone, there are no timestamps
+    static void count_media(uint8_t seq) {
+        int d = static_cast<int8_t>(seq - g_seq);
+        if (!g_seq_valid || d > RECEIVER_SEQ_JUMP || d < -RECEIVER_SEQ_JUMP) d = 1; // the sender started over
+        g_seq_valid = true;
+
+        g_received++;
+        if (d > 0) {
+            g_lost += d - 1;
+            g_seq = seq;
+        } else if (g_lost) {
+            g_lost--; // late, counted as lost before
+        }
+
+        time_t now = thread_micros();
+        if (g_arrival_us) {
+            time_t gap = now - g_arrival_us;
+            g_gap_us += (gap - g_gap_us) / 16;
+            g_jitter_us += (std::abs(gap - g_gap_us) - g_jitter_us) / 16;
+        }
+        g_arrival_us = now;
+    }
+
+    static void report_if_due() {
+        time_t now = thread_millis();
+        if (!g_received || now - g_report_start < RECEIVER_REPORT_MS) return;
+
+        int buffer_ms = g_buffer_min.exchange(INT_MAX);
+        net_controller::stats_t stats = {
+                static_cast<uint16_t>(std::min<uint32_t>(g_received, UINT16_MAX)),
+                static_cast<uint16_t>(std::min<uint32_t>(g_lost, UINT16_MAX)),
+                static_cast<uint16_t>(std::min<time_t>(g_jitter_us, UINT16_MAX)),
+                static_cast<int16_t>(buffer_ms == INT_MAX ? -1 : std::min(buffer_ms, INT16_MAX))
+        };
+        alignas(net_controller::msg_hdr_t) uint8_t msg[HDR_SIZE + sizeof(net_controller::stats_t)];
+        memcpy(msg + HDR_SIZE, &stats, sizeof(stats));
+        sender::send_datagram(msg, net_controller::msg_put(msg, net_controller::MSG_STATS, sizeof(stats)));
+
+        g_received = g_lost = 0;
+        g_report_start = now;
+    }
+
+    static void deliver(uint8_t type, uint8_t seq, const uint8_t *value, size_t len) {
+        count_media(seq);
+        mutex_lock(&g_mutex);
+        if (!g_cb) loge(TAG, "no callback specified");
+        else if (type == net_controller::MSG_MEDIA) g_cb(value, len);
+        else if (type == net_controller::MSG_MEDIA_CN) expand_cn(value, len);
+        else expand_coded(type, value, len);
+        mutex_unlock(&g_mutex);
+    }
+
+    // Walks the messages of a datagram, media is only handed on when asked for. Returns false when malformed
+    static bool dispatch(const uint8_t *data, size_t len, bool media) {
+        size_t pos = 0;
+        while (pos < len) {
+            net_controller::msg_hdr_t hdr;
+            if (pos + HDR_SIZE > len) return false;
+            memcpy(&hdr, data + pos, HDR_SIZE); // later messages can sit at odd offsets
+            const uint8_t *value = data + pos + HDR_SIZE;
+            pos += HDR_SIZE + hdr.len;
+            if (pos > len) return false;
+
+            switch (hdr.type) {
+                case net_controller::MSG_MEDIA:
+                case net_controller::MSG_MEDIA_CN:
+                case net_controller::MSG_MEDIA_MONO:
+                case net_controller::MSG_MEDIA_ULAW:
+                case net_controller::MSG_MEDIA_ULAW_HALF:
+                    if (media && hdr.len) deliver(hdr.type, hdr.seq, value, hdr.len);
+                    break;
+                case net_controller::MSG_STATS: {
+                    if (hdr.len < sizeof(net_controller::stats_t)) return false;
+                    net_controller::stats_t stats;
+                    memcpy(&stats, value, sizeof(stats));
+                    sender::on_report(&stats);
+                    break;
+                }
+                case net_controller::MSG_CONTROL:
+                    if (hdr.len < sizeof(net_controller::control_t)) return false;
+                    net_controller::control_parse(reinterpret_cast<const net_controller::control_t *>(value));
+                    break;
+                default: // keepalives, and whatever a newer remote sends
+                    break;
+            }
+        }
+        return true;
+    }
+
     size_t receive(uint8_t *data, size_t bytes) {
         endpoint_t sender_endpoint;
         socklen_t socklen = sizeof(sender_endpoint);
-        size_t received = recvfrom(g_socket, reinterpret_cast<char *>(data), bytes, 0,
-                                   reinterpret_cast<sockaddr *>(&sender_endpoint), &socklen);
+        ssize_t received = recvfrom(g_socket, reinterpret_cast<char *>(data), bytes, 0,
+                                    reinterpret_cast<sockaddr *>(&sender_endpoint), &socklen);
+        if (received <= 0) return 0;
+
         mutex_lock(&g_mutex);
         g_endpoint = sender_endpoint;
         mutex_unlock(&g_mutex);
 
-        net_controller::remote_set_md(data + received - MD_SIZE);
-
+        dispatch(data, received, false);
         return received;
     }
 
+    static ssize_t recv_datagram(uint8_t *data, endpoint_t *from) {
+        socklen_t socklen = sizeof(endpoint_t);
+#if !defined(ESP_PLATFORM) && defined(MSG_DONTWAIT)
+        if (g_rx_mode == RX_SPIN) {
+            time_t until = thread_micros() + g_spin_us;
+            do {
+                ssize_t received = recvfrom(g_socket, reinterpret_cast<char *>(data), PIPE_WIDTH, MSG_DONTWAIT,
+                                            reinterpret_cast<sockaddr *>(from), &socklen);
+                if (received != -1 || (errno != EWOULDBLOCK && errno != EAGAIN)) return received;
+            } while (thread_micros() < until && g_cur_state);
+        }
+#endif
+        return recvfrom(g_socket, reinterpret_cast<char *>(data), PIPE_WIDTH, 0,
+                        reinterpret_cast<sockaddr *>(from), &socklen);
+    }
+
     static void task_receive(void *ctx) {
         logi(TAG, "task_receive is started");
-        uint8_t data[PIPE_WIDTH];
+        packet_pool::packet_t *pkt = nullptr;
 
         endpoint_t sender_endpoint;
-        socklen_t socklen = sizeof(sender_endpoint);
         ssize_t received;
         while (true) {
             if (!g_cur_state) {
@@ -99,26 +301,36 @@ namespace receiver {
                 continue;
             }
 
-            received = recvfrom(g_socket, reinterpret_cast<char *>(data), PIPE_WIDTH, 0,
-                                reinterpret_cast<sockaddr *>(&sender_endpoint), &socklen);
+            // the callback copies what it keeps, so one packet does for every datagram
+            if (!pkt && !(pkt = packet_pool::alloc())) {
+                loge(TAG, "packet pool is used up");
+                thread_sleep(1);
+                continue;
+            }
+            uint8_t *data = pkt->data;
+            auto *hdr = reinterpret_cast<const net_controller::msg_hdr_t *>(data);
+
+            received = recv_datagram(data, &sender_endpoint);
 
             if (received == -1) {
                 if (errno != EWOULDBLOCK && errno != EAGAIN) loge(TAG, "recvfrom error: %d", errno);
                 continue;
             }
 
+            pkt->len = static_cast<uint16_t>(received);
+            sender::on_downlink();
             mutex_lock(&g_mutex);
-
             g_endpoint = sender_endpoint;
-            if (received - MD_SIZE > 0) {
-                if (g_cb) g_cb(data, received - MD_SIZE);
-                else
-                    loge(TAG, "no callback specified");
-            }
-
             mutex_unlock(&g_mutex);
 
-            net_controller::remote_set_md(data + received - MD_SIZE);
+            // fast path, one pcm message filling the datagram
+            if (received > static_cast<ssize_t>(HDR_SIZE) && hdr->type == net_controller::MSG_MEDIA &&
+                HDR_SIZE + hdr->len == static_cast<size_t>(received)) {
+                deliver(net_controller::MSG_MEDIA, hdr->seq, data + HDR_SIZE, hdr->len);
+            } else if (!dispatch(data, received, true)) {
+                loge(TAG, "malformed datagram, %d bytes", static_cast<int>(received));
+            }
+            report_if_due();
         }
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,85 @@
+#include <net_controller.h>
+#include <net_controller_private.h>
+#include <receiver.h>
+
+#include <impl/concurrency.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#define RX_BENCH_PORT 48096
+#define RX_BENCH_SETTLE_US 20000 // mode switch, and the tail of a run
+
+static std::vector<time_t> latency;
+static std::atomic<size_t> received{0};
+
+// receiver thread, the send timestamp is the payload
+static void receive_cb(const uint8_t *data, size_t, void *) {
+    time_t sent;
+    memcpy(&sent, data, sizeof(sent));
+    size_t i = received.load(std::memory_order_relaxed);
+    if (i < latency.size()) latency[i] = thread_micros() - sent;
+    received.store(i + 1, std::memory_order_release);
+}
+
+// rx_bench [datagrams per mode], wake up latency of each receive mode for bursts of two datagrams over loopback
+int main(int argc, char **argv) {
+    const int count = argc > 1 ? atoi(argv[1]) : 2000;
+    const char *names[] = {"block", "spin", "busy_poll"};
+    const int us[] = {0, RX_SPIN_US, RX_BUSY_POLL_US};
+
+    net_controller::init();
+    receiver::set_cb(receive_cb);
+    receiver::bind(RX_BENCH_PORT);
+    receiver::start();
+
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(RX_BENCH_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    printf("%-10s %6s %8s %8s %8s\n", "mode", "n", "p50 us", "p99 us", "max us");
+    for (int m = receiver::RX_BLOCK; m <= receiver::RX_BUSY_POLL; ++m) {
+        if (receiver::set_rx_mode(static_cast<receiver::rx_mode_t>(m), us[m]) != 0) {
+            printf("%-10s unavailable\n", names[m]);
+            continue;
+        }
+        usleep(RX_BENCH_SETTLE_US);
+        latency.assign(count, 0);
+        received = 0;
+
+        for (int i = 0; i < count; ++i) {
+            uint8_t buf[PIPE_WIDTH] = {};
+            time_t now = thread_micros();
+            memcpy(buf + HDR_SIZE, &now, sizeof(now));
+            size_t len = net_controller::msg_put(buf, net_controller::MSG_MEDIA, DATA_WIDTH);
+            sendto(s, buf, len, 0, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+            usleep(i % 2 ? 500 : 5000);
+        }
+        usleep(RX_BENCH_SETTLE_US);
+
+        size_t n = std::min<size_t>(received.load(std::memory_order_acquire), latency.size());
+        if (!n) {
+            printf("%-10s nothing received\n", names[m]);
+            continue;
+        }
+        std::vector<time_t> v(latency.begin(), latency.begin() + n);
+        std::sort(v.begin(), v.end());
+        printf("%-10s %6zu %8lld %8lld %8lld\n", names[m], n, static_cast<long long>(v[n / 2]),
+               static_cast<long long>(v[n * 99 / 100]), static_cast<long long>(v.back()));
+    }
+    close(s);
+
+    fflush(stdout);
+    _exit(0); // the network threads never return
+}
@@ -1,10 +1,31 @@
 #include <sender.h>
 #include <net_controller.h>
 #include <net_controller_private.h>
+#include <comfort_noise.h>
+#include <media_codec.h>
+#include <packet_pool.h>
 
 #include <impl/concurrency.h>
 #include <impl/log.h>
 #include <cassert>
+#include <cinttypes>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#define SENDER_CORE 1 // the send callback reads the mic and runs its voice processing, keep it off the wifi core
+#define SENDER_IDLE_MS 5 // wait for the callback to have a frame ready
+#define SENDER_CN_MS 40 // silence summed into one descriptor, whole frames
+#define SENDER_BURST_PACKETS 12 // held back between bursts at most, ~130 ms of mono mic
+#define SENDER_CODED_FRAMES 4 // reduced data frames packed into one message at most, fewer packets on a bad link
+
+#define SENDER_RC_LOSS_DOWN 5 // % lost in a report that steps the level down
+#define SENDER_RC_LOSS_UP 1 // % lost at most for a report to count towards stepping up
+#define SENDER_RC_UP_REPORTS 10 // clean reports before probing the next level up, doubles per failed probe
+#define SENDER_RC_BACKOFF_MAX 3
+#define SENDER_RC_HOLD_REPORTS 2 // after a step down, lets the reports catch up before the next one
+#define SENDER_RC_PROBE_MS 5000 // a step down this soon after a step up means the probe failed
+#define SENDER_RC_TIMEOUT_MS 1500 // no report for this long counts as a bad one
 
 namespace sender {
 
@@ -15,14 +36,15 @@ namespace sender {
     enum {
         FLG_NONE = 0,
         FLG_TASK = (1 << 0),
-        FLG_REQ = (1 << 1),
-        FLG_REQ_MD = (1 << 2)
+        FLG_REQ = (1 << 1)
     };
 
     static endpoint_t g_endpoint;
 
-    static uint8_t *g_buf = nullptr;
-    static int g_buf_ptr;
+    static uint8_t *g_buf = nullptr; // media message, header then a frame
+    static uint8_t *g_data = nullptr;
+    static size_t g_buf_ptr;
+    static size_t g_frame, g_frame_cap; // bytes, follows the negotiation between frames
     static ctx_func_t<cb_t> g_cb;
     static mutex_t g_mutex;
     static std::atomic<uint8_t> g_cur_flags;
@@ -30,22 +52,71 @@ namespace sender {
 
     static semaphore_t g_task_sem, g_req_sem;
 
-    static void send_raw(uint8_t *data, size_t bytes);
+    static std::atomic<bool> g_vad;
+    static comfort_noise::encoder_t g_cn;
+    static uint32_t g_frames_pcm, g_frames_cn;
+
+    // burst mode, the messages wait in g_burst until the interval is over or the radio is known to be awake
+    static std::atomic<int> g_burst_ms, g_keepalive_ms;
+    static std::atomic<bool> g_downlink;
+    static packet_pool::packet_t *g_burst[SENDER_BURST_PACKETS];
+    static int g_burst_ms_cur, g_burst_count;
+    static time_t g_burst_start;
+    static uint32_t g_bursts;
+
+    static std::atomic<time_t> g_last_tx;
+
+    static int g_sample_rate, g_channels;
+    static uint8_t g_seq;
+
+    // reduced frames collect in g_coded until the message is full
+    static media_codec::encoder_t g_enc;
+    static uint8_t *g_coded = nullptr; // header then max(frame, DATA_WIDTH)
+    static size_t g_coded_len;
+    static int g_coded_frames;
+    static media_codec::level_t g_coded_level;
+
+    // rate control on the receiver reports, the level is picked up per data frame
+    static std::atomic<bool> g_rc;
+    static std::atomic<media_codec::level_t> g_level;
+    static std::atomic<time_t> g_rc_report; // 0 until the first report
+    static mutex_t g_rc_mutex;
+    static int g_rc_clean, g_rc_hold, g_rc_backoff;
+    static time_t g_rc_up;
 
     [[noreturn]] static void task_send(void *ctx);
 
     void init() {
         memset(&g_endpoint, 0, sizeof g_endpoint);
         g_buf = static_cast<uint8_t *>(malloc(PIPE_WIDTH));
+        g_data = g_buf + HDR_SIZE;
         g_buf_ptr = 0;
+        g_frame = g_frame_cap = DATA_WIDTH;
         g_cb = ctx_func_t<cb_t>();
         mutex_init(&g_mutex);
         g_cur_flags = FLG_NONE;
+        g_vad = false;
+        g_sample_rate = 44100;
+        g_channels = 1;
+        comfort_noise::encoder_reset(&g_cn, g_sample_rate);
+        g_burst_ms = g_keepalive_ms = 0;
+        g_downlink = false;
+        g_burst_count = 0;
+        g_last_tx = thread_millis();
+        g_seq = 0;
+        g_coded = static_cast<uint8_t *>(malloc(PIPE_WIDTH));
+        g_coded_len = 0;
+        g_coded_frames = 0;
+        g_coded_level = media_codec::LEVEL_PCM;
+        g_rc = false;
+        g_level = media_codec::LEVEL_PCM;
+        g_rc_report = 0;
+        mutex_init(&g_rc_mutex);
 
         bin_sem_init(&g_task_sem);
         bin_sem_init(&g_req_sem);
 
-        thread_init(&g_thread, task_send, "send_task");
+        thread_init(&g_thread, task_send, "send_task", ESP_THREAD_PRIO, ESP_THREAD_STACK_DEPTH, SENDER_CORE);
         thread_launch(&g_thread);
     }
 
@@ -61,7 +132,51 @@ namespace sender {
         mutex_unlock(&g_mutex);
     }
 
+    void set_vad(bool enabled) {
+        g_vad = enabled;
+    }
+
+    void set_format(int sample_rate, int channels) {
+        mutex_lock(&g_mutex);
+        g_sample_rate = sample_rate;
+        g_channels = channels;
+        mutex_unlock(&g_mutex);
+    }
+
+    // Back to full quality, waiting for the first report
+    static void rc_reset() {
+        mutex_lock(&g_rc_mutex);
+        g_level = media_codec::LEVEL_PCM;
+        g_rc_report = 0;
+        g_rc_clean = g_rc_hold = g_rc_backoff = 0;
+        mutex_unlock(&g_rc_mutex);
+    }
+
+    void set_rate_control(bool enabled) {
+        g_rc = enabled;
+        rc_reset();
+    }
+
+    void set_burst(int interval_ms) {
+        g_burst_ms = interval_ms;
+    }
+
+    void set_keepalive(int ms) {
+        g_keepalive_ms = ms;
+        bin_sem_give(&g_task_sem);
+    }
+
+    void on_downlink() {
+        g_downlink = true;
+    }
+
+    void wake() {
+        bin_sem_give(&g_task_sem);
+    }
+
     void start() {
+        rc_reset();
+
         g_cur_flags |= FLG_TASK;
         bin_sem_give(&g_task_sem);
     }
@@ -71,80 +186,319 @@ namespace sender {
         bin_sem_give(&g_task_sem);
     }
 
+    // Between frames only. The buffers grow to the largest frame seen, the task is not using them then: it either
+    // owns the frame loop (callback) or waits for the next FLG_REQ (send)
+    static void frame_update() {
+        size_t bytes = net_controller::frame_bytes(g_sample_rate, g_channels);
+        if (bytes == g_frame) return;
+
+        if (bytes > g_frame_cap) {
+            auto *buf = static_cast<uint8_t *>(realloc(g_buf, HDR_SIZE + bytes));
+            if (buf) g_buf = buf;
+            auto *coded = buf ? static_cast<uint8_t *>(realloc(g_coded, HDR_SIZE + std::max<size_t>(bytes, DATA_WIDTH))) : nullptr;
+            if (coded) g_coded = coded;
+            g_data = g_buf + HDR_SIZE;
+            if (!coded) {
+                loge(TAG, "no memory for %u byte frames", static_cast<unsigned>(bytes));
+                return;
+            }
+            g_frame_cap = bytes;
+        }
+        logi(TAG, "frame %u -> %u bytes", static_cast<unsigned>(g_frame), static_cast<unsigned>(bytes));
+        g_frame = bytes;
+    }
+
     void send(uint8_t *data, size_t bytes) {
         mutex_lock(&g_mutex);
-        while (g_buf_ptr + bytes >= DATA_WIDTH) {
-            memcpy(g_buf + g_buf_ptr, data, DATA_WIDTH - g_buf_ptr);
-            data += DATA_WIDTH - g_buf_ptr;
-            bytes -= DATA_WIDTH - g_buf_ptr;
-            g_buf_ptr = DATA_WIDTH;
+        if (!g_buf_ptr) frame_update();
+        while (g_buf_ptr + bytes >= g_frame) {
+            size_t part = g_frame - g_buf_ptr;
+            memcpy(g_data + g_buf_ptr, data, part);
+            data += part;
+            bytes -= part;
+            g_buf_ptr = g_frame;
 
             g_cur_flags |= FLG_REQ;
             bin_sem_give(&g_task_sem);
             bin_sem_take(&g_req_sem);
 
             g_buf_ptr = 0;
+            frame_update();
         }
-        memcpy(g_buf + g_buf_ptr, data, bytes);
+        memcpy(g_data + g_buf_ptr, data, bytes);
         g_buf_ptr += bytes;
         mutex_unlock(&g_mutex);
     }
 
     void send_md() {
-        mutex_lock(&g_mutex);
-        g_cur_flags |= FLG_REQ_MD;
-        bin_sem_give(&g_task_sem);
-        bin_sem_take(&g_req_sem);
-        mutex_unlock(&g_mutex);
+        net_controller::send_control();
     }
 
-    void send_raw(uint8_t *data, size_t bytes) {
-        assert(bytes <= DATA_WIDTH);
-        net_controller::remote_get_md(data + bytes);
-        sendto(g_socket, reinterpret_cast<char *>(data), bytes + MD_SIZE, 0, reinterpret_cast<sockaddr *>(&g_endpoint),
+    void send_datagram(const uint8_t *data, size_t bytes) {
+        sendto(g_socket, reinterpret_cast<const char *>(data), bytes, 0, reinterpret_cast<sockaddr *>(&g_endpoint),
                sizeof(endpoint_t));
+        g_last_tx = thread_millis();
+    }
+
+    static void send_keepalive() {
+        alignas(net_controller::msg_hdr_t) uint8_t msg[HDR_SIZE];
+        send_datagram(msg, net_controller::msg_put(msg, net_controller::MSG_KEEPALIVE, 0));
+    }
+
+    static void burst_flush() {
+        for (int i = 0; i < g_burst_count; ++i) {
+            send_datagram(g_burst[i]->data, g_burst[i]->len);
+            packet_pool::free(g_burst[i]);
+        }
+        if (g_burst_count) g_bursts++;
+        g_burst_count = 0;
+        g_downlink = false;
+    }
+
+    // Due when the interval is over, or early when downlink traffic shows the radio is up anyway
+    static bool burst_due() {
+        if (!g_burst_count) return false;
+        time_t waited = thread_millis() - g_burst_start;
+        return g_burst_count == SENDER_BURST_PACKETS || waited >= g_burst_ms_cur ||
+               (g_downlink && waited >= g_burst_ms_cur / 2);
+    }
+
+    // Sends a message of the mic stream, the value already behind the header space. Queued in burst mode,
+    // returns false then
+    static bool emit(uint8_t *msg, size_t bytes, net_controller::msg_type_t type = net_controller::MSG_MEDIA) {
+        size_t len = net_controller::msg_put(msg, type, bytes, g_seq++);
+        if (!g_burst_ms_cur) {
+            send_datagram(msg, len);
+            return true;
+        }
+        packet_pool::packet_t *p = g_burst_count < SENDER_BURST_PACKETS ? packet_pool::alloc() : nullptr;
+        if (!p) {
+            // a split frame outgrew the queue, or the pool is short: out with what there is
+            burst_flush();
+            send_datagram(msg, len);
+            return true;
+        }
+        if (!g_burst_count) {
+            g_burst_start = thread_millis();
+            g_downlink = false;
+        }
+        memcpy(p->data, msg, len);
+        p->len = static_cast<uint16_t>(len);
+        g_burst[g_burst_count++] = p;
+        return false;
+    }
+
+    static media_codec::level_t level_step(media_codec::level_t level, int dir) {
+        int next = level + dir;
+        if (next == media_codec::LEVEL_MONO && g_channels == 1) next += dir; // nothing to downmix
+        return static_cast<media_codec::level_t>(std::clamp<int>(next, 0, media_codec::LEVEL_NUM - 1));
+    }
+
+    // Under g_rc_mutex
+    static void rc_step(int dir, int loss, int buffer_ms) {
+        media_codec::level_t from = g_level, to = level_step(from, dir);
+        time_t now = thread_millis();
+        g_rc_clean = 0;
+        if (dir > 0) {
+            g_rc_hold = SENDER_RC_HOLD_REPORTS;
+            if (now - g_rc_up < SENDER_RC_PROBE_MS) g_rc_backoff = std::min(g_rc_backoff + 1, SENDER_RC_BACKOFF_MAX);
+        } else {
+            g_rc_up = now;
+            if (to == media_codec::LEVEL_PCM) g_rc_backoff = 0;
+        }
+        if (to == from) return;
+        g_level = to;
+        logi(TAG, "media level %d -> %d, loss %d%%, buffer %d ms", from, to, loss, buffer_ms);
+    }
+
+    void on_report(const net_controller::stats_t *stats) {
+        if (!g_rc) return;
+        mutex_lock(&g_rc_mutex);
+        g_rc_report = thread_millis();
+
+        uint32_t expected = stats->received + stats->lost;
+        int loss = expected ? static_cast<int>(stats->lost * 100 / expected) : 0;
+        if (g_rc_hold) g_rc_hold--;
+
+        // jitter is left to the playout buffer, a starved one shows it was too much
+        if (loss >= SENDER_RC_LOSS_DOWN || stats->buffer_ms == 0) {
+            if (!g_rc_hold) rc_step(1, loss, stats->buffer_ms);
+        } else if (loss <= SENDER_RC_LOSS_UP) {
+            if (g_level != media_codec::LEVEL_PCM && ++g_rc_clean >= SENDER_RC_UP_REPORTS << g_rc_backoff) {
+                rc_step(-1, loss, stats->buffer_ms);
+            }
+        } else {
+            g_rc_clean = 0;
+        }
+        mutex_unlock(&g_rc_mutex);
+    }
+
+    // Reports stopped while the media flows, the link is likely worse than any of them said
+    static void rc_check() {
+        time_t last = g_rc_report;
+        if (!g_rc || !last || thread_millis() - last < SENDER_RC_TIMEOUT_MS) return;
+        mutex_lock(&g_rc_mutex);
+        g_rc_report = thread_millis();
+        g_rc_hold = 0;
+        rc_step(1, 100, -1);
+        mutex_unlock(&g_rc_mutex);
+    }
+
+    static net_controller::msg_type_t coded_type(media_codec::level_t level) {
+        return static_cast<net_controller::msg_type_t>(net_controller::MSG_MEDIA_MONO + level - media_codec::LEVEL_MONO);
+    }
+
+    // Media longer than a datagram goes out in equal parts of whole samples. The header of each part is written over
+    // the tail of the one before, which is sent or copied by then. msg has the header space in front of len bytes
+    static bool emit_split(uint8_t *msg, size_t len, net_controller::msg_type_t type, size_t unit) {
+        size_t parts = (len + DATA_WIDTH - 1) / DATA_WIDTH;
+        size_t part = ((len + parts - 1) / parts + unit - 1) / unit * unit;
+        bool sent = false;
+        for (size_t off = 0; off < len; off += part) sent = emit(msg + off, std::min(part, len - off), type) || sent;
+        return sent;
+    }
+
+    static bool coded_flush() {
+        if (!g_coded_len) return false;
+        size_t len = g_coded_len;
+        g_coded_len = 0;
+        g_coded_frames = 0;
+        size_t unit = g_coded_level == media_codec::LEVEL_MONO ? sizeof(int16_t) : 1;
+        return emit_split(g_coded, len, coded_type(g_coded_level), unit);
+    }
+
+    // The frame in g_buf at the current level. Reduced frames are packed up to SENDER_CODED_FRAMES a message,
+    // returns false when nothing went out
+    static bool send_pcm() {
+        rc_check();
+        media_codec::level_t level = g_level;
+        bool sent = false;
+        if (level != g_coded_level) {
+            sent = coded_flush();
+            g_coded_level = level;
+            media_codec::encoder_reset(&g_enc);
+        }
+        if (level == media_codec::LEVEL_PCM) {
+            return emit_split(g_buf, g_frame, net_controller::MSG_MEDIA, g_channels * sizeof(int16_t)) || sent;
+        }
+
+        const int frames = static_cast<int>(g_frame / (g_channels * sizeof(int16_t)));
+        const size_t size = media_codec::encoded_size(level, frames, g_channels);
+        if (g_coded_len + size > DATA_WIDTH) sent = coded_flush() || sent;
+
+        auto *pcm = reinterpret_cast<const int16_t *>(g_data);
+        g_coded_len += media_codec::encode(&g_enc, level, pcm, frames, g_channels, g_coded + HDR_SIZE + g_coded_len);
+        g_coded_frames++;
+
+        if (g_coded_frames < SENDER_CODED_FRAMES && g_coded_len + size <= DATA_WIDTH) return sent;
+        return coded_flush() || sent;
+    }
+
+    static bool keepalive_due() {
+        return g_keepalive_ms && thread_millis() - g_last_tx >= g_keepalive_ms;
+    }
+
+    // Until control or a keepalive is due, 0 is forever
+    static time_t idle_wait() {
+        time_t wait = net_controller::control_wait();
+        if (g_keepalive_ms) {
+            time_t left = g_keepalive_ms - (thread_millis() - g_last_tx);
+            if (wait < 0 || left < wait) wait = left;
+        }
+        if (wait < 0) return 0;
+        return wait > 0 ? wait : 1;
+    }
+
+    static bool send_cn() {
+        coded_flush(); // played out in order
+        alignas(net_controller::msg_hdr_t) uint8_t msg[HDR_SIZE + CN_DESC_SIZE];
+        return emit(msg, comfort_noise::flush(&g_cn, msg + HDR_SIZE), net_controller::MSG_MEDIA_CN);
+    }
+
+    // Sends the full frame in g_buf, silence is held back and summed into a descriptor. Returns false
+    // when nothing went out
+    static bool send_frame() {
+        if (!g_vad) return send_pcm();
+
+        auto *pcm = reinterpret_cast<const int16_t *>(g_data);
+        const int n = static_cast<int>(g_frame / sizeof(int16_t));
+        if (comfort_noise::is_speech(&g_cn, pcm, n)) {
+            // the silence before has to be played out first
+            bool sent = !comfort_noise::pending(&g_cn) || send_cn();
+            g_frames_pcm++;
+            return send_pcm() && sent;
+        }
+
+        comfort_noise::add_silence(&g_cn, pcm, n);
+        g_frames_cn++;
+        if (comfort_noise::pending(&g_cn) < static_cast<uint32_t>(SENDER_CN_MS * g_sample_rate / 1000)) return false;
+        return send_cn();
+    }
+
+    static void stream_begin() {
+        g_buf_ptr = 0;
+        comfort_noise::encoder_reset(&g_cn, g_sample_rate);
+        g_frames_pcm = g_frames_cn = 0;
+        g_bursts = 0;
+
+        g_burst_ms_cur = g_burst_ms;
+    }
+
+    static void stream_end() {
+        coded_flush();
+        burst_flush();
+        if (g_vad) logi(TAG, "mic frames: %" PRIu32 " sent, %" PRIu32 " as comfort noise", g_frames_pcm, g_frames_cn);
+        if (g_burst_ms_cur) logi(TAG, "%" PRIu32 " bursts, %d ms apart", g_bursts, g_burst_ms_cur);
     }
 
     [[noreturn]] void task_send(void *ctx) {
         logi(TAG, "task_send is started");
+        bool streaming = false;
 
         while (true) {
-            if (!(g_cur_flags & FLG_TASK)) bin_sem_take(&g_task_sem);
+            if (!(g_cur_flags & FLG_TASK)) {
+                if (streaming) stream_end();
+                streaming = false;
+                bin_sem_take(&g_task_sem, idle_wait());
+            }
 
             if (g_cur_flags & FLG_REQ) {
-                send_raw(g_buf, g_buf_ptr);
+                send_pcm();
 
                 g_cur_flags &= ~FLG_REQ;
-                goto MDSent;
+                bin_sem_give(&g_req_sem);
             }
 
+            // runs unlocked, the buffer and the vad state belong to this thread while streaming
             if (g_cur_flags & FLG_TASK) {
                 size_t bytes = 0;
 
-                mutex_lock(&g_mutex);
-                if (g_cb) bytes = g_cb(g_buf + g_buf_ptr, DATA_WIDTH - g_buf_ptr);
+                if (!streaming) {
+                    stream_begin();
+                    streaming = true;
+                }
+
+                if (!g_buf_ptr) frame_update();
+                if (g_cb) bytes = g_cb(g_data + g_buf_ptr, g_frame - g_buf_ptr);
                 else
                     loge(TAG, "no callback specified");
 
-                assert(bytes <= DATA_WIDTH - g_buf_ptr);
+                assert(bytes <= g_frame - g_buf_ptr);
                 g_buf_ptr += bytes;
 
-                send_raw(g_buf, g_buf_ptr);
-                if (g_buf_ptr == DATA_WIDTH) g_buf_ptr = 0;
-                mutex_unlock(&g_mutex);
-
-                goto MDSent;
-            }
+                // only whole frames go out, the vad classifies per frame
+                if (g_buf_ptr == g_frame) {
+                    send_frame();
+                    g_buf_ptr = 0;
+                }
+                if (burst_due()) burst_flush();
 
-            if (g_cur_flags & FLG_REQ_MD) {
-                uint8_t mdbuf[MD_SIZE];
-                send_raw(mdbuf, 0);
-
-                MDSent:
-                g_cur_flags &= ~FLG_REQ_MD;
-                bin_sem_give(&g_req_sem);
+                if (!bytes) bin_sem_take(&g_task_sem, SENDER_IDLE_MS);
             }
 
+            // control retransmissions, keepalives only when nothing else went out
+            if (net_controller::control_wait() == 0) net_controller::send_control();
+            else if (keepalive_due()) send_keepalive();
         }
     }
 }
\ No newline at end of file
@@ -0,0 +1,50 @@
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <cstdint>
+#include <cstddef>
+
+#define RESAMPLER_MAX_PHASES 512
+#define RESAMPLER_MAX_CHANNELS 2
+#define RESAMPLER_BLOCK_FRAMES 256
+
+// Taps per polyphase branch, cost per output sample grows linearly with it
+enum resampler_quality_t {
+    RS_QUALITY_LOW = 8,
+    RS_QUALITY_MEDIUM = 16,
+    RS_QUALITY_HIGH = 32
+};
+
+typedef struct resampler_t {
+    int rate_in = 0;
+    int rate_out = 0;
+    int channels = 0;
+    int taps = 0;
+
+    int up = 1; // L
+    int down = 1; // M
+    int phase = 0;
+    int pos = 0;
+
+    int16_t *coefs = nullptr; // [up][taps], Q15
+    int16_t *work = nullptr; // [taps - 1 + RESAMPLER_BLOCK_FRAMES][channels]
+} resampler_t;
+
+// Returns -1 if the rate ratio needs more than RESAMPLER_MAX_PHASES phases
+int resampler_init(resampler_t *rs, int rate_in, int rate_out, int channels,
+                   resampler_quality_t quality = RS_QUALITY_MEDIUM);
+
+void resampler_deinit(resampler_t *rs);
+
+void resampler_reset(resampler_t *rs);
+
+bool resampler_passthrough(const resampler_t *rs);
+
+// Upper bound of output frames for frames_in input frames
+size_t resampler_out_frames(const resampler_t *rs, size_t frames_in);
+
+// Converts interleaved 16 bit frames, consumes all input, returns frames written. Output past frames_out_max is
+// dropped and logged, size out with resampler_out_frames
+size_t resampler_process(resampler_t *rs, const int16_t *in, size_t frames_in, int16_t *out, size_t frames_out_max);
+
+#endif //RESAMPLER_H
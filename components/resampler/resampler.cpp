@@ -0,0 +1,140 @@
+#include <resampler.h>
+
+#include <impl/log.h>
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <algorithm>
+
+static const char *TAG = "RESAMPLER";
+
+// Windowed sinc prototype at up * rate_in, split into up branches of taps coefficients.
+// Each branch is normalized to unity DC gain, which also keeps the Q15 accumulator in range.
+static void design_filter(resampler_t *rs) {
+    const int n_total = rs->taps * rs->up;
+    const double fc = 0.5 / std::max(rs->up, rs->down) * 0.92; // cutoff in cycles per upsampled sample
+    const double center = (n_total - 1) / 2.0;
+
+    auto *proto = static_cast<float *>(malloc(n_total * sizeof(float)));
+    for (int i = 0; i < n_total; ++i) {
+        double t = i - center;
+        double sinc = t == 0 ? 1.0 : sin(2 * M_PI * fc * t) / (2 * M_PI * fc * t);
+        double w = 0.42 - 0.5 * cos(2 * M_PI * i / (n_total - 1)) + 0.08 * cos(4 * M_PI * i / (n_total - 1));
+        proto[i] = static_cast<float>(2 * fc * sinc * w);
+    }
+
+    // y[n] = sum c_p[m] * x[pos + m], c_p[m] = h[up * (taps - 1 - m) + p]
+    for (int p = 0; p < rs->up; ++p) {
+        float sum = 0;
+        for (int m = 0; m < rs->taps; ++m) sum += proto[rs->up * (rs->taps - 1 - m) + p];
+        int16_t *c = rs->coefs + p * rs->taps;
+        for (int m = 0; m < rs->taps; ++m) {
+            float v = proto[rs->up * (rs->taps - 1 - m) + p] / sum;
+            c[m] = static_cast<int16_t>(std::clamp(lroundf(v * 32768.0f), -32768L, 32767L));
+        }
+    }
+    free(proto);
+}
+
+int resampler_init(resampler_t *rs, int rate_in, int rate_out, int channels, resampler_quality_t quality) {
+    resampler_deinit(rs);
+    if (channels < 1 || channels > RESAMPLER_MAX_CHANNELS) {
+        loge(TAG, "unsupported channel count: %d", channels);
+        return -1;
+    }
+    int g = std::gcd(rate_in, rate_out);
+    rs->rate_in = rate_in;
+    rs->rate_out = rate_out;
+    rs->channels = channels;
+    rs->taps = quality;
+    rs->up = rate_out / g;
+    rs->down = rate_in / g;
+
+    if (resampler_passthrough(rs)) return 0;
+    if (rs->up > RESAMPLER_MAX_PHASES) {
+        loge(TAG, "%d -> %d needs %d phases, max %d", rate_in, rate_out, rs->up, RESAMPLER_MAX_PHASES);
+        rs->up = rs->down = 1;
+        return -1;
+    }
+
+    rs->coefs = static_cast<int16_t *>(malloc(rs->up * rs->taps * sizeof(int16_t)));
+    rs->work = static_cast<int16_t *>(malloc((rs->taps - 1 + RESAMPLER_BLOCK_FRAMES) * channels * sizeof(int16_t)));
+    if (!rs->coefs || !rs->work) {
+        loge(TAG, "out of memory");
+        resampler_deinit(rs);
+        return -1;
+    }
+    design_filter(rs);
+    resampler_reset(rs);
+    logi(TAG, "%d -> %d Hz, %d/%d, %d taps", rate_in, rate_out, rs->up, rs->down, rs->taps);
+    return 0;
+}
+
+void resampler_deinit(resampler_t *rs) {
+    free(rs->coefs);
+    free(rs->work);
+    rs->coefs = nullptr;
+    rs->work = nullptr;
+    rs->up = rs->down = 1;
+}
+
+void resampler_reset(resampler_t *rs) {
+    rs->phase = 0;
+    rs->pos = 0;
+    if (rs->work) memset(rs->work, 0, (rs->taps - 1) * rs->channels * sizeof(int16_t));
+}
+
+bool resampler_passthrough(const resampler_t *rs) {
+    return rs->up == rs->down;
+}
+
+size_t resampler_out_frames(const resampler_t *rs, size_t frames_in) {
+    return (frames_in * rs->up + rs->down - 1) / rs->down + 1;
+}
+
+size_t resampler_process(resampler_t *rs, const int16_t *in, size_t frames_in, int16_t *out, size_t frames_out_max) {
+    const int ch = rs->channels;
+    if (resampler_passthrough(rs)) {
+        size_t n = std::min(frames_in, frames_out_max);
+        if (n < frames_in) loge(TAG, "output full, %zu of %zu frames dropped", frames_in - n, frames_in);
+        memcpy(out, in, n * ch * sizeof(int16_t));
+        return n;
+    }
+
+    const int taps = rs->taps;
+    const int hist = taps - 1;
+    size_t produced = 0, dropped = 0;
+
+    while (frames_in) {
+        int n = static_cast<int>(std::min<size_t>(frames_in, RESAMPLER_BLOCK_FRAMES));
+        memcpy(rs->work + hist * ch, in, n * ch * sizeof(int16_t));
+        const int avail = hist + n;
+
+        while (rs->pos + taps <= avail) {
+            if (produced == frames_out_max) { // keep the timeline but drop the frame
+                dropped++;
+            } else {
+                const int16_t *c = rs->coefs + rs->phase * taps;
+                const int16_t *x = rs->work + rs->pos * ch;
+                for (int k = 0; k < ch; ++k) {
+                    int32_t acc = 1 << 14;
+                    for (int m = 0; m < taps; ++m) acc += c[m] * x[m * ch + k];
+                    out[produced * ch + k] = static_cast<int16_t>(std::clamp(acc >> 15, -32768, 32767));
+                }
+                produced++;
+            }
+            rs->phase += rs->down;
+            rs->pos += rs->phase / rs->up;
+            rs->phase %= rs->up;
+        }
+
+        memmove(rs->work, rs->work + n * ch, hist * ch * sizeof(int16_t));
+        rs->pos -= n;
+        in += n * ch;
+        frames_in -= n;
+    }
+    if (dropped) loge(TAG, "output full, %zu of %zu frames dropped", dropped, produced + dropped);
+    return produced;
+}
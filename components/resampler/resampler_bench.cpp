@@ -0,0 +1,45 @@
+#include <resampler.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// resampler_bench [seconds of audio per case]
+int main(int argc, char **argv) {
+    const double seconds = argc > 1 ? atof(argv[1]) : 10.0;
+    const int rates[][2] = {{44100, 48000}, {48000, 44100}, {16000, 48000}, {48000, 16000}, {8000, 44100}};
+    const resampler_quality_t qualities[] = {RS_QUALITY_LOW, RS_QUALITY_MEDIUM, RS_QUALITY_HIGH};
+    const int channels = 2, chunk = 480; // a 10 ms write at 48 kHz
+
+    printf("%-15s %5s %12s %10s\n", "rates", "taps", "Mframes/s", "realtime");
+    for (auto &r : rates) {
+        auto frames = static_cast<size_t>(r[0] * seconds);
+        std::vector<int16_t> in(frames * channels);
+        for (size_t i = 0; i < frames; ++i) {
+            auto s = static_cast<int16_t>(16000 * sin(2 * M_PI * 1000.0 * i / r[0]));
+            for (int c = 0; c < channels; ++c) in[i * channels + c] = s;
+        }
+
+        for (auto q : qualities) {
+            resampler_t rs;
+            if (resampler_init(&rs, r[0], r[1], channels, q) != 0) continue;
+            std::vector<int16_t> out(resampler_out_frames(&rs, chunk) * channels);
+
+            size_t produced = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t pos = 0; pos < frames; pos += chunk) {
+                size_t n = std::min<size_t>(chunk, frames - pos);
+                produced += resampler_process(&rs, in.data() + pos * channels, n, out.data(), out.size() / channels);
+            }
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            resampler_deinit(&rs);
+
+            char name[32];
+            snprintf(name, sizeof(name), "%d->%d", r[0], r[1]);
+            printf("%-15s %5d %12.2f %9.0fx\n", name, q, produced / elapsed / 1e6, seconds / elapsed);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,133 @@
+#ifndef SCO_ENGINE_H
+#define SCO_ENGINE_H
+
+#include <impl/concurrency.h>
+
+#include <atomic>
+#include <cstdint>
+
+#define SCO_PACKET_BYTES_MAX 258 // 3 byte hci header + 255 byte payload
+#define SCO_FRAME_SAMPLES_MAX 240 // lc3-swb, 7.5 ms at 32 kHz
+#define SCO_RX_QUEUE_LEN 8 // power of two
+#define SCO_TX_QUEUE_BYTES 1024 // power of two
+#define SCO_PREBUFFER_MS 50 // mic audio collected before the first payload, starting point of the adaptation
+#define SCO_PREBUFFER_MIN_MS 10
+#define SCO_PREBUFFER_MAX_MS 80
+#define SCO_PREBUFFER_STEP_MS 10 // grown by this after an underrun, trimmed by at most this per window
+#define SCO_PREBUFFER_MARGIN_MS 5 // mic headroom kept when trimming
+#define SCO_ADAPT_WINDOW_MS 2000 // stable time before the latency is trimmed
+#define SCO_SOURCE_CHUNK_MS 10 // requested mic capture granularity
+
+typedef struct sco_engine_t sco_engine_t;
+
+// Codec hooks, all of them run on the engine task so codec state needs no locking
+typedef struct {
+    const char *name;
+    uint16_t sample_rate;
+    uint16_t samples_per_frame; // encoder input, read from the mic in one piece
+
+    void (*init)(sco_engine_t *engine);
+
+    // Payload of one hci sco packet, bad as flagged by the controller. Output goes through sco_engine_output_*
+    void (*decode)(sco_engine_t *engine, const uint8_t *payload, uint16_t size, bool bad);
+
+    // One frame of samples_per_frame mic samples, the encoded stream goes to sco_engine_queue
+    void (*encode)(sco_engine_t *engine, const int16_t *frame);
+
+    void (*close)(sco_engine_t *engine);
+} sco_codec_t;
+
+typedef struct {
+    uint32_t rx_packets;
+    uint32_t rx_bad;
+    uint32_t rx_dropped; // receive queue full
+    uint32_t tx_payloads;
+    uint32_t tx_zero_filled; // includes the initial prebuffer
+    uint32_t tx_underruns; // times the encoded stream ran dry mid call
+    uint32_t prebuffer_trims;
+    int prebuffer_ms;
+    int prebuffer_min_ms;
+    int prebuffer_max_ms;
+} sco_stats_t;
+
+typedef struct {
+    uint16_t len;
+    uint8_t data[SCO_PACKET_BYTES_MAX];
+} sco_packet_t;
+
+struct sco_engine_t {
+    const sco_codec_t *codec = nullptr;
+    void *codec_ctx = nullptr;
+
+    // receive queue, hci thread -> engine task
+    sco_packet_t rx_pool[SCO_RX_QUEUE_LEN];
+    std::atomic<uint32_t> rx_head{0};
+    std::atomic<uint32_t> rx_tail{0};
+
+    // encoded stream, engine task -> hci thread
+    uint8_t tx_ring[SCO_TX_QUEUE_BYTES];
+    std::atomic<uint32_t> tx_head{0};
+    std::atomic<uint32_t> tx_tail{0};
+    std::atomic<uint16_t> tx_payload_len{0}; // last payload size asked for, the encoder keeps two ahead
+
+    // frame pool, sized for the largest codec so nothing is allocated per packet
+    int16_t mic_frame[SCO_FRAME_SAMPLES_MAX];
+    int16_t dec_frame[SCO_FRAME_SAMPLES_MAX];
+    int16_t out_frame[SCO_FRAME_SAMPLES_MAX];
+    uint8_t enc_frame[SCO_FRAME_SAMPLES_MAX * sizeof(int16_t)]; // encoder output on its way to sco_engine_queue
+
+    std::atomic<bool> running{false};
+    std::atomic<bool> input_paused{true};
+
+    // adaptive prebuffer, engine task only
+    int prebuffer_ms = SCO_PREBUFFER_MS;
+    int prebuffer_bytes = 0;
+    int prebuffer_min_ms = SCO_PREBUFFER_MS;
+    int prebuffer_max_ms = SCO_PREBUFFER_MS;
+    uint32_t underruns_seen = 0;
+    uint32_t window_start = 0;
+    int window_min_bytes = 0; // lowest mic backlog left after encoding, -1 while unmeasured
+    std::atomic<uint32_t> prebuffer_trims{0};
+
+    std::atomic<uint32_t> rx_packets{0}, rx_bad{0}, rx_dropped{0}, tx_payloads{0}, tx_zero_filled{0}, tx_underruns{0};
+
+    mutex_t lock; // held by the engine task while it runs codec hooks
+    semaphore_t sem;
+    thread_t thread;
+};
+
+// Built-in transparent 16-bit linear codec, what the controller hands over for cvsd air coding.
+// Used as is on hosts, the device wraps it with btstack plc
+extern const sco_codec_t sco_codec_pcm16;
+
+void sco_engine_init(sco_engine_t *engine, int core = ESP_THREAD_NO_AFFINITY);
+
+// Configures stream_bridge for the codec and starts with the mic prebuffering. The prebuffer then follows the link:
+// it grows after an underrun and is trimmed while the mic backlog stays above the margin for a whole window
+void sco_engine_start(sco_engine_t *engine, const sco_codec_t *codec, void *codec_ctx = nullptr);
+
+void sco_engine_stop(sco_engine_t *engine);
+
+// Transport side, whole hci sco packets in, payloads out. Never block
+void sco_engine_receive(sco_engine_t *engine, const uint8_t *packet, uint16_t size);
+
+void sco_engine_fill_payload(sco_engine_t *engine, uint8_t *payload, uint16_t size);
+
+// Codec side. The output frame to decode into, at most SCO_FRAME_SAMPLES_MAX samples, commit writes it to the sink
+int16_t *sco_engine_output_reserve(sco_engine_t *engine, int samples);
+
+void sco_engine_output_commit(sco_engine_t *engine, int samples);
+
+void sco_engine_output(sco_engine_t *engine, const int16_t *samples, int count);
+
+void sco_engine_queue(sco_engine_t *engine, const uint8_t *data, int len);
+
+sco_stats_t sco_engine_stats(sco_engine_t *engine);
+
+#ifndef ESP_PLATFORM
+// Feeds the received sco packets of a btsnoop capture (e.g. from btstack hci_dump) through the engine,
+// pulling one payload per packet. Returns the packet count or -1
+int sco_engine_replay(sco_engine_t *engine, const char *btsnoop_path, bool realtime = false);
+#endif
+
+#endif //SCO_ENGINE_H
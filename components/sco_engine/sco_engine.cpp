@@ -0,0 +1,284 @@
+#include <sco_engine.h>
+#include <stream_bridge.h>
+
+#include <impl/log.h>
+
+#include <cstring>
+#include <cinttypes>
+#include <algorithm>
+
+static const char *TAG = "SCO_ENGINE";
+
+#define SCO_ENGINE_TICK_MS 4 // below the shortest sco interval, keeps the encoder ahead without rx traffic
+#define SCO_NUM_CHANNELS 1
+#define SCO_BYTES_PER_SAMPLE 2
+#define SCO_SOURCE_LATENCY_MS (SCO_PREBUFFER_MAX_MS + 2 * SCO_SOURCE_CHUNK_MS) // largest prebuffer plus a chunk in flight
+
+// PCM16
+
+static void pcm16_decode(sco_engine_t *engine, const uint8_t *payload, uint16_t size, bool bad) {
+    int samples = std::min(size / SCO_BYTES_PER_SAMPLE, SCO_FRAME_SAMPLES_MAX);
+    int16_t *out = sco_engine_output_reserve(engine, samples);
+    for (int i = 0; i < samples; ++i)
+        out[i] = bad ? 0 : static_cast<int16_t>(payload[2 * i] | payload[2 * i + 1] << 8);
+    sco_engine_output_commit(engine, samples);
+}
+
+static void pcm16_encode(sco_engine_t *engine, const int16_t *frame) {
+    uint8_t *buf = engine->enc_frame;
+    int samples = engine->codec->samples_per_frame;
+    // explicit little endian, sample addresses in the payload are odd
+    for (int i = 0; i < samples; ++i) {
+        buf[2 * i] = frame[i] & 0xFF;
+        buf[2 * i + 1] = (frame[i] >> 8) & 0xFF;
+    }
+    sco_engine_queue(engine, buf, samples * SCO_BYTES_PER_SAMPLE);
+}
+
+const sco_codec_t sco_codec_pcm16 = {
+        .name = "PCM16",
+        .sample_rate = 8000,
+        .samples_per_frame = 60,
+        .init = nullptr,
+        .decode = pcm16_decode,
+        .encode = pcm16_encode,
+        .close = nullptr,
+};
+
+// Engine task
+
+static uint32_t tx_fill(sco_engine_t *engine) {
+    return engine->tx_head.load(std::memory_order_acquire) - engine->tx_tail.load(std::memory_order_acquire);
+}
+
+static void engine_decode(sco_engine_t *engine) {
+    uint32_t tail = engine->rx_tail.load(std::memory_order_relaxed);
+    while (tail != engine->rx_head.load(std::memory_order_acquire)) {
+        const sco_packet_t *packet = &engine->rx_pool[tail % SCO_RX_QUEUE_LEN];
+        // treat packet as bad frame if controller does not report 'all good'
+        bool bad = (packet->data[1] & 0x30) != 0;
+        if (bad) engine->rx_bad++;
+        engine->codec->decode(engine, packet->data + 3, packet->len - 3, bad);
+        engine->rx_tail.store(++tail, std::memory_order_release);
+    }
+}
+
+static int ms_to_bytes(const sco_engine_t *engine, int ms) {
+    return ms * (engine->codec->sample_rate / 1000) * SCO_BYTES_PER_SAMPLE;
+}
+
+static void set_prebuffer(sco_engine_t *engine, int ms) {
+    engine->prebuffer_ms = std::clamp(ms, SCO_PREBUFFER_MIN_MS, SCO_PREBUFFER_MAX_MS);
+    engine->prebuffer_bytes = ms_to_bytes(engine, engine->prebuffer_ms);
+    engine->prebuffer_min_ms = std::min(engine->prebuffer_min_ms, engine->prebuffer_ms);
+    engine->prebuffer_max_ms = std::max(engine->prebuffer_max_ms, engine->prebuffer_ms);
+}
+
+static void window_reset(sco_engine_t *engine) {
+    engine->window_start = thread_millis();
+    engine->window_min_bytes = -1;
+}
+
+// The mic backlog left after encoding shows how far capture runs ahead of the send cadence. Whatever stayed above
+// the margin for a whole window is latency the link does not need, an underrun means the margin was too thin
+static void engine_adapt(sco_engine_t *engine) {
+    uint32_t underruns = engine->tx_underruns;
+    if (underruns != engine->underruns_seen) {
+        engine->underruns_seen = underruns;
+        set_prebuffer(engine, engine->prebuffer_ms + SCO_PREBUFFER_STEP_MS);
+        logi(TAG, "underrun, prebuffer raised to %d ms", engine->prebuffer_ms);
+        window_reset(engine);
+        return;
+    }
+    if (engine->input_paused || thread_millis() - engine->window_start < SCO_ADAPT_WINDOW_MS) return;
+
+    int frame_bytes = engine->codec->samples_per_frame * SCO_BYTES_PER_SAMPLE;
+    int surplus = engine->window_min_bytes - ms_to_bytes(engine, SCO_PREBUFFER_MARGIN_MS);
+    int trim = std::min(surplus, ms_to_bytes(engine, SCO_PREBUFFER_STEP_MS)) / frame_bytes * frame_bytes;
+    if (trim > 0 && engine->prebuffer_ms > SCO_PREBUFFER_MIN_MS) {
+        // drop the oldest mic audio, everything captured after it reaches the air sooner
+        for (int left = trim; left > 0; left -= frame_bytes) stream_bridge::read(engine->mic_frame, frame_bytes);
+        set_prebuffer(engine, engine->prebuffer_ms - trim / ms_to_bytes(engine, 1));
+        engine->prebuffer_trims++;
+    }
+    window_reset(engine);
+}
+
+static void engine_encode(sco_engine_t *engine) {
+    int frame_bytes = engine->codec->samples_per_frame * SCO_BYTES_PER_SAMPLE;
+
+    // resume once the prebuffer is filled
+    if (engine->input_paused) {
+        if (stream_bridge::bytes_ready_to_read() < engine->prebuffer_bytes) return;
+        engine->input_paused = false;
+        window_reset(engine);
+    }
+
+    // stay two payloads ahead of the hci thread, more would only add latency
+    uint32_t target = 2 * std::max<uint32_t>(engine->tx_payload_len, 1);
+    while (!engine->input_paused && tx_fill(engine) < target && stream_bridge::bytes_ready_to_read() >= frame_bytes) {
+        stream_bridge::read(engine->mic_frame, frame_bytes);
+        engine->codec->encode(engine, engine->mic_frame);
+    }
+
+    int backlog = stream_bridge::bytes_ready_to_read();
+    if (engine->window_min_bytes < 0 || backlog < engine->window_min_bytes) engine->window_min_bytes = backlog;
+}
+
+static void engine_task(void *ctx) {
+    auto *engine = static_cast<sco_engine_t *>(ctx);
+    logi(TAG, "sco_engine_task is started");
+
+    while (true) {
+        bin_sem_take(&engine->sem, SCO_ENGINE_TICK_MS);
+        mutex_lock(&engine->lock);
+        if (engine->running) {
+            engine_decode(engine);
+            engine_adapt(engine);
+            engine_encode(engine);
+        }
+        mutex_unlock(&engine->lock);
+    }
+}
+
+// Defs
+
+void sco_engine_init(sco_engine_t *engine, int core) {
+    mutex_init(&engine->lock);
+    bin_sem_init(&engine->sem);
+    thread_init(&engine->thread, ctx_func_t<thread_func_t>(engine_task, engine), "sco_engine_task", 14, 8192, core);
+    thread_launch(&engine->thread);
+}
+
+void sco_engine_start(sco_engine_t *engine, const sco_codec_t *codec, void *codec_ctx) {
+    mutex_lock(&engine->lock);
+    engine->codec = codec;
+    engine->codec_ctx = codec_ctx;
+
+    // source must be able to hold the prebuffer plus the frames consumed while it fills
+    stream_bridge::configure_source(codec->sample_rate, SCO_NUM_CHANNELS, SCO_BYTES_PER_SAMPLE * 8,
+                                    SCO_SOURCE_LATENCY_MS, SCO_SOURCE_CHUNK_MS);
+    stream_bridge::configure_sink(codec->sample_rate, SCO_NUM_CHANNELS, SCO_BYTES_PER_SAMPLE * 8,
+                                  STREAM_LATENCY_VOICE_MS);
+    stream_bridge::set_voice_processing(VOICE_PROC_AEC | VOICE_PROC_NS);
+    if (codec->init) codec->init(engine);
+
+    engine->rx_tail = engine->rx_head.load();
+    engine->tx_tail = engine->tx_head.load();
+    engine->tx_payload_len = 0;
+    engine->rx_packets = engine->rx_bad = engine->rx_dropped = 0;
+    engine->tx_payloads = engine->tx_zero_filled = engine->tx_underruns = 0;
+    engine->input_paused = true;
+
+    // every call starts over, the link and the codec may differ from the last one
+    engine->prebuffer_min_ms = engine->prebuffer_max_ms = SCO_PREBUFFER_MS;
+    set_prebuffer(engine, SCO_PREBUFFER_MS);
+    engine->prebuffer_trims = 0;
+    engine->underruns_seen = 0;
+    window_reset(engine);
+    engine->running = true;
+    mutex_unlock(&engine->lock);
+    logi(TAG, "%s started", codec->name);
+}
+
+void sco_engine_stop(sco_engine_t *engine) {
+    mutex_lock(&engine->lock);
+    if (!engine->running) {
+        mutex_unlock(&engine->lock);
+        return;
+    }
+    engine->running = false;
+    if (engine->codec->close) engine->codec->close(engine);
+    stream_bridge::set_voice_processing(0);
+
+    sco_stats_t st = sco_engine_stats(engine);
+    logi(TAG, "%s stopped, rx %" PRIu32 " (bad %" PRIu32 ", dropped %" PRIu32 "), tx %" PRIu32 " (zero-filled %"
+              PRIu32 ", %" PRIu32 ".%" PRIu32 "%%, in %" PRIu32 " underruns)",
+         engine->codec->name, st.rx_packets, st.rx_bad, st.rx_dropped, st.tx_payloads, st.tx_zero_filled,
+         st.tx_zero_filled * 100 / std::max<uint32_t>(st.tx_payloads, 1),
+         st.tx_zero_filled * 1000 / std::max<uint32_t>(st.tx_payloads, 1) % 10, st.tx_underruns);
+    logi(TAG, "prebuffer %d ms at the end (%d..%d ms), %" PRIu32 " trims", st.prebuffer_ms, st.prebuffer_min_ms,
+         st.prebuffer_max_ms, st.prebuffer_trims);
+    engine->codec = nullptr;
+    mutex_unlock(&engine->lock);
+}
+
+void sco_engine_receive(sco_engine_t *engine, const uint8_t *packet, uint16_t size) {
+    if (!engine->running || size < 3) return;
+    if (size > SCO_PACKET_BYTES_MAX) {
+        loge(TAG, "SCO packet larger than the queue slot - dropping data");
+        return;
+    }
+
+    uint32_t head = engine->rx_head.load(std::memory_order_relaxed);
+    if (head - engine->rx_tail.load(std::memory_order_acquire) == SCO_RX_QUEUE_LEN) {
+        engine->rx_dropped++;
+        return;
+    }
+    sco_packet_t *slot = &engine->rx_pool[head % SCO_RX_QUEUE_LEN];
+    memcpy(slot->data, packet, size);
+    slot->len = size;
+    engine->rx_head.store(head + 1, std::memory_order_release);
+    engine->rx_packets++;
+    bin_sem_give(&engine->sem);
+}
+
+void sco_engine_fill_payload(sco_engine_t *engine, uint8_t *payload, uint16_t size) {
+    engine->tx_payload_len = size;
+    engine->tx_payloads++;
+
+    uint32_t tail = engine->tx_tail.load(std::memory_order_relaxed);
+    uint32_t head = engine->tx_head.load(std::memory_order_acquire);
+    if (!engine->running || engine->input_paused || head - tail < size) {
+        // just send '0's, an underrun goes back to prebuffering
+        memset(payload, 0, size);
+        engine->tx_zero_filled++;
+        if (engine->running && !engine->input_paused) {
+            engine->input_paused = true;
+            engine->tx_underruns++;
+            engine->tx_tail.store(head, std::memory_order_release);
+        }
+    } else {
+        for (int i = 0; i < size; ++i) payload[i] = engine->tx_ring[(tail + i) % SCO_TX_QUEUE_BYTES];
+        engine->tx_tail.store(tail + size, std::memory_order_release);
+    }
+    bin_sem_give(&engine->sem);
+}
+
+int16_t *sco_engine_output_reserve(sco_engine_t *engine, int) {
+    return engine->out_frame;
+}
+
+void sco_engine_output_commit(sco_engine_t *engine, int samples) {
+    stream_bridge::write(engine->out_frame, samples * SCO_BYTES_PER_SAMPLE);
+}
+
+void sco_engine_output(sco_engine_t *engine, const int16_t *samples, int count) {
+    stream_bridge::write(samples, count * SCO_BYTES_PER_SAMPLE);
+}
+
+void sco_engine_queue(sco_engine_t *engine, const uint8_t *data, int len) {
+    uint32_t head = engine->tx_head.load(std::memory_order_relaxed);
+    uint32_t used = head - engine->tx_tail.load(std::memory_order_acquire);
+    if (len > SCO_TX_QUEUE_BYTES - static_cast<int>(used)) {
+        loge(TAG, "encoded stream overflow, %d bytes dropped", len);
+        return;
+    }
+    for (int i = 0; i < len; ++i) engine->tx_ring[(head + i) % SCO_TX_QUEUE_BYTES] = data[i];
+    engine->tx_head.store(head + len, std::memory_order_release);
+}
+
+sco_stats_t sco_engine_stats(sco_engine_t *engine) {
+    return {
+            .rx_packets = engine->rx_packets,
+            .rx_bad = engine->rx_bad,
+            .rx_dropped = engine->rx_dropped,
+            .tx_payloads = engine->tx_payloads,
+            .tx_zero_filled = engine->tx_zero_filled,
+            .tx_underruns = engine->tx_underruns,
+            .prebuffer_trims = engine->prebuffer_trims,
+            .prebuffer_ms = engine->prebuffer_ms,
+            .prebuffer_min_ms = engine->prebuffer_min_ms,
+            .prebuffer_max_ms = engine->prebuffer_max_ms,
+    };
+}
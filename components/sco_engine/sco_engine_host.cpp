@@ -0,0 +1,81 @@
+#include <sco_engine.h>
+
+#include <impl/log.h>
+
+#include <cstdio>
+#include <cstring>
+
+static const char *TAG = "SCO_ENGINE";
+
+#define BTSNOOP_HEADER_LEN 16
+#define BTSNOOP_RECORD_LEN 24
+#define BTSNOOP_DATALINK_H4 1002
+#define BTSNOOP_FLAG_RECEIVED 0x01
+#define H4_SCO_DATA_PACKET 0x03
+
+static uint32_t read_be32(const uint8_t *p) {
+    return static_cast<uint32_t>(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint64_t read_be64(const uint8_t *p) {
+    return static_cast<uint64_t>(read_be32(p)) << 32 | read_be32(p + 4);
+}
+
+static void wait_rx_room(sco_engine_t *engine, uint32_t room) {
+    while (engine->rx_head - engine->rx_tail > SCO_RX_QUEUE_LEN - room) thread_sleep(1);
+}
+
+int sco_engine_replay(sco_engine_t *engine, const char *btsnoop_path, bool realtime) {
+    FILE *file = fopen(btsnoop_path, "rb");
+    if (!file) {
+        loge(TAG, "can't open %s", btsnoop_path);
+        return -1;
+    }
+
+    uint8_t header[BTSNOOP_HEADER_LEN];
+    if (fread(header, 1, sizeof header, file) != sizeof header || memcmp(header, "btsnoop\0", 8) != 0 ||
+        read_be32(header + 12) != BTSNOOP_DATALINK_H4) {
+        loge(TAG, "%s is not an h4 btsnoop capture", btsnoop_path);
+        fclose(file);
+        return -1;
+    }
+
+    uint8_t record[BTSNOOP_RECORD_LEN];
+    uint8_t data[SCO_PACKET_BYTES_MAX + 1];
+    uint8_t payload[SCO_PACKET_BYTES_MAX];
+    uint64_t first_us = 0;
+    time_t start = thread_millis();
+    int count = 0;
+
+    while (fread(record, 1, sizeof record, file) == sizeof record) {
+        uint32_t len = read_be32(record + 4);
+        uint32_t flags = read_be32(record + 8);
+        uint64_t timestamp_us = read_be64(record + 16);
+        if (len > sizeof data) {
+            fseek(file, len, SEEK_CUR);
+            continue;
+        }
+        if (fread(data, 1, len, file) != len) break;
+        // h4 type, handle + flags, payload length
+        if (len < 4 || data[0] != H4_SCO_DATA_PACKET || !(flags & BTSNOOP_FLAG_RECEIVED)) continue;
+
+        if (realtime) {
+            if (!count) first_us = timestamp_us;
+            time_t due = start + static_cast<time_t>((timestamp_us - first_us) / 1000);
+            time_t now = thread_millis();
+            if (due > now) thread_sleep(due - now);
+        } else {
+            wait_rx_room(engine, 1);
+        }
+
+        // sco runs symmetric, every received packet has a sent one of the same size
+        sco_engine_receive(engine, data + 1, len - 1);
+        sco_engine_fill_payload(engine, payload, data[3]);
+        count++;
+    }
+    fclose(file);
+
+    wait_rx_room(engine, SCO_RX_QUEUE_LEN);
+    logi(TAG, "replayed %d sco packets from %s", count, btsnoop_path);
+    return count;
+}
@@ -0,0 +1,40 @@
+#include <sco_engine.h>
+#include <stream_bridge.h>
+
+#include <impl/concurrency.h>
+
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+
+// sco_replay <capture.btsnoop> [out.wav|-] [realtime]
+// Runs the received sco packets of a capture through the pcm16 engine, the decoded audio goes to out.wav. Without
+// realtime the capture goes through as fast as the engine takes it, which times decoding but overruns the sink
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <capture.btsnoop> [out.wav|-] [realtime]\n", argv[0]);
+        return 1;
+    }
+    const char *out_path = argc > 2 && strcmp(argv[2], "-") != 0 ? argv[2] : nullptr;
+    bool realtime = argc > 3 && strcmp(argv[3], "realtime") == 0;
+
+    stream_bridge::host_set_backend(out_path ? stream_bridge::HOST_WAV : stream_bridge::HOST_NULL, out_path);
+    stream_bridge::init();
+
+    static sco_engine_t engine;
+    sco_engine_init(&engine);
+    sco_engine_start(&engine, &sco_codec_pcm16);
+
+    time_t start = thread_micros();
+    int count = sco_engine_replay(&engine, argv[1], realtime);
+    time_t elapsed = thread_micros() - start;
+    sco_engine_stop(&engine);
+    if (count < 0) return 1;
+
+    sco_stats_t st = sco_engine_stats(&engine);
+    printf("%d packets in %ld ms, %.1f us/packet, rx bad %" PRIu32 " dropped %" PRIu32 ", tx zero-filled %" PRIu32
+           " of %" PRIu32 "\n", count,
+           static_cast<long>(elapsed / 1000), count ? static_cast<double>(elapsed) / count : 0.0, st.rx_bad,
+           st.rx_dropped, st.tx_zero_filled, st.tx_payloads);
+    return 0;
+}
@@ -0,0 +1,86 @@
+#ifndef STREAM_BRIDGE_H
+#define STREAM_BRIDGE_H
+
+#define DMA_BUF_COUNT 4
+#define DMA_BUF_SIZE 960
+
+#define DMA_BUF_COUNT_MIN 2
+#define DMA_BUF_COUNT_MAX 8
+#define DMA_BUF_BYTES_MAX 4092 // limit of a single i2s dma descriptor
+
+// Latency targets for configure_sink/configure_source, 0 keeps DMA_BUF_COUNT x DMA_BUF_SIZE
+#define STREAM_LATENCY_DEFAULT 0
+#define STREAM_LATENCY_VOICE_MS 15
+#define STREAM_LATENCY_LOW_MS 20
+#define STREAM_LATENCY_MUSIC_MS 100
+
+#include <cstddef>
+#include <cstdint>
+
+#include <resampler.h>
+#include <voice_proc.h>
+
+namespace stream_bridge {
+    typedef void (*data_handler_t)(void *, size_t, void *);
+
+    void init();
+
+    int write(const void *buffer, int len, uint32_t wait_time = 0);
+
+    int read(void *buffer, int len, uint32_t wait_time = 0);
+
+    // Bytes captured into the source dma descriptors and not read yet
+    int bytes_ready_to_read();
+
+    // Free space across all sink dma descriptors
+    int bytes_can_write();
+
+    // Bytes queued in the sink dma descriptors and not played yet
+    int bytes_queued();
+
+    // Microsecond clock used for the dma timestamps, wraps every ~71 min
+    uint32_t clock_us();
+
+    // clock_us() at the last completed sink/source dma descriptor
+    uint32_t sink_dma_time_us();
+
+    uint32_t source_dma_time_us();
+
+    // Channels are re-created when the latency target changes the dma layout
+    void configure_sink(int sample_rates, int channels, int bits, int latency_ms = STREAM_LATENCY_DEFAULT);
+
+    // chunk_ms caps the capture granularity (within DMA_BUF_COUNT_MAX), for voice paths that keep little buffered
+    void configure_source(int sample_rates, int channels, int bits, int latency_ms = STREAM_LATENCY_DEFAULT,
+                          int chunk_ms = 0);
+
+    // Writes at sample_rates are converted to the sink clock instead of reclocking i2s, 0 disables. configure_sink
+    // goes back to no conversion, so this follows it
+    void set_sink_input_rate(int sample_rates, resampler_quality_t quality = RS_QUALITY_MEDIUM);
+
+    // Echo cancellation and noise suppression (voice_proc_flags_t) between the source and read(), referenced to what is
+    // written to the sink. Runs on the reading task and follows source/sink reconfiguration, 0 disables. Safe against
+    // a running write() and read(), waits for their processing to finish before rebuilding
+    void set_voice_processing(int flags);
+
+    void set_source_volume(int vol);
+
+    void set_sink_volume(int vol);
+
+    int get_source_volume();
+
+    int get_sink_volume();
+
+#ifndef ESP_PLATFORM
+    enum host_backend_t {
+        HOST_NULL = 0, // sink discards, source yields silence
+        HOST_WAV, // sink records to sink_path, source loops source_path
+        HOST_PORTAUDIO // default devices, only if built against PortAudio
+    };
+
+    // Must be called before init, paths are only used by HOST_WAV
+    void host_set_backend(host_backend_t backend, const char *sink_path = nullptr, const char *source_path = nullptr);
+#endif
+}
+
+
+#endif //STREAM_BRIDGE_H
@@ -0,0 +1,58 @@
+#ifndef STREAM_BRIDGE_PRIVATE_H
+#define STREAM_BRIDGE_PRIVATE_H
+
+#include <stream_bridge.h>
+
+#include <atomic>
+
+namespace stream_bridge {
+
+    struct dma_layout_t {
+        int desc_num;
+        int frame_num;
+    };
+
+    int frame_bytes(int channels, int bits);
+
+    dma_layout_t dma_layout(int sample_rates, int channels, int bits, int latency_ms, int chunk_ms = 0);
+
+    // Called once by the platform init, before any configure
+    void bridge_init();
+
+    // Platform write without rate conversion
+    int write_raw(const void *buffer, int len, uint32_t wait_time);
+
+    // Platform read without voice processing
+    int read_raw(void *buffer, int len, uint32_t wait_time);
+
+    // Called by the platform configure_sink, drops the input rate back to the sink rate
+    void sink_configured(int sample_rates, int channels, int bits);
+
+    // Called by the platform configure_source to rebuild the voice processing
+    void source_configured(int sample_rates, int channels, int bits);
+
+    struct fill_level_t {
+        std::atomic<int32_t> bytes;
+        std::atomic<int32_t> capacity;
+        std::atomic<uint32_t> last_dma_us;
+    };
+
+    // Lock free and inlined so it can run in the dma isr, saturates to [0, capacity]
+    inline void fill_add(fill_level_t *f, int32_t delta) {
+        int32_t cap = f->capacity.load(std::memory_order_relaxed);
+        int32_t cur = f->bytes.load(std::memory_order_relaxed), next;
+        do {
+            next = cur + delta;
+            if (next < 0) next = 0;
+            if (next > cap) next = cap;
+        } while (!f->bytes.compare_exchange_weak(cur, next, std::memory_order_relaxed));
+    }
+
+    inline void fill_reset(fill_level_t *f, int32_t capacity) {
+        f->capacity = capacity;
+        f->bytes = 0;
+    }
+
+}
+
+#endif //STREAM_BRIDGE_PRIVATE_H
@@ -0,0 +1,178 @@
+#include <stream_bridge.h>
+#include <stream_bridge_private.h>
+
+#include <impl/log.h>
+#include <impl/concurrency.h>
+
+#include <atomic>
+#include <algorithm>
+
+static const char *TAG = "STREAM_BRIDGE";
+
+#define VOICE_DRAIN_WAIT_MS 10 // a tick at least, so audio tasks of any priority get to leave
+
+static mutex_t sink_lock; // sink_rs and conv_buf, held by write for a whole conversion
+static resampler_t sink_rs;
+static resampler_quality_t sink_rs_quality = RS_QUALITY_MEDIUM;
+static int sink_input_rate = 0;
+static int sink_rate = 44100, sink_channels = 2, sink_bits = 16;
+
+static int16_t conv_buf[DMA_BUF_BYTES_MAX / sizeof(int16_t)];
+
+static mutex_t voice_lock; // voice_update callers, from whichever task configures
+static voice_proc_t voice;
+static int voice_flags = 0;
+static std::atomic<bool> voice_active{false};
+static std::atomic<int> voice_users{0}; // sink_write and read inside voice_proc_*
+static int source_rate = 44100, source_channels = 1, source_bits = 16;
+
+static void sink_rs_update() {
+    if (!sink_input_rate || sink_input_rate == sink_rate) {
+        resampler_deinit(&sink_rs);
+        return;
+    }
+    if (sink_bits != 16) {
+        loge(TAG, "rate conversion supports 16 bit only, got %d", sink_bits);
+        resampler_deinit(&sink_rs);
+        return;
+    }
+    resampler_init(&sink_rs, sink_input_rate, sink_rate, sink_channels, sink_rs_quality);
+}
+
+// Counts the caller in unless processing is off, voice_update waits for it to leave before touching the state
+static bool voice_enter() {
+    voice_users.fetch_add(1);
+    if (voice_active.load()) return true;
+    voice_users.fetch_sub(1);
+    return false;
+}
+
+static void voice_leave() {
+    voice_users.fetch_sub(1, std::memory_order_release);
+}
+
+static void voice_update() {
+    mutex_lock(&voice_lock);
+    voice_active = false;
+    while (voice_users.load(std::memory_order_acquire)) thread_sleep(VOICE_DRAIN_WAIT_MS);
+    int flags = voice_flags;
+    if (flags && (source_channels != 1 || source_bits != 16)) {
+        loge(TAG, "voice processing needs a 16 bit mono source, got %d ch, %d bit", source_channels, source_bits);
+        flags = 0;
+    }
+    if ((flags & VOICE_PROC_AEC) && (sink_rate != source_rate || sink_bits != 16)) {
+        loge(TAG, "no echo cancellation, sink at %d Hz %d bit, source at %d Hz", sink_rate, sink_bits, source_rate);
+        flags &= ~VOICE_PROC_AEC;
+    }
+    if (!flags) voice_proc_deinit(&voice);
+    else voice_active = voice_proc_init(&voice, source_rate, flags) == 0;
+    mutex_unlock(&voice_lock);
+}
+
+// Everything for the speaker passes here at the sink rate, which makes it the echo reference
+static int sink_write(const void *buffer, int len, uint32_t wait_time) {
+    int written = stream_bridge::write_raw(buffer, len, wait_time);
+    if (voice_enter()) {
+        voice_proc_far(&voice, static_cast<const int16_t *>(buffer), written / (sink_channels * 2), sink_channels);
+        voice_leave();
+    }
+    return written;
+}
+
+int stream_bridge::frame_bytes(int channels, int bits) {
+    return channels * (bits <= 8 ? 1 : bits <= 16 ? 2 : 4);
+}
+
+stream_bridge::dma_layout_t stream_bridge::dma_layout(int sample_rates, int channels, int bits, int latency_ms,
+                                                     int chunk_ms) {
+    if (latency_ms == STREAM_LATENCY_DEFAULT) return {DMA_BUF_COUNT, DMA_BUF_SIZE};
+
+    int fb = frame_bytes(channels, bits);
+    int frames_max = DMA_BUF_BYTES_MAX / fb;
+    int frames_total = std::max(sample_rates / 1000 * latency_ms, 1);
+
+    // as few descriptors as the byte limit allows, so every dma event moves a useful chunk
+    int desc_num = (frames_total + frames_max - 1) / frames_max;
+    if (chunk_ms > 0) desc_num = std::max(desc_num, latency_ms / chunk_ms);
+    desc_num = std::clamp(desc_num, DMA_BUF_COUNT_MIN, DMA_BUF_COUNT_MAX);
+    int frame_num = std::clamp(frames_total / desc_num, 8, frames_max);
+    return {desc_num, frame_num};
+}
+
+void stream_bridge::bridge_init() {
+    mutex_init(&sink_lock);
+    mutex_init(&voice_lock);
+}
+
+void stream_bridge::sink_configured(int sample_rates, int channels, int bits) {
+    mutex_lock(&sink_lock);
+    sink_rate = sample_rates;
+    sink_channels = channels;
+    sink_bits = bits;
+    // a rate set for the previous user of the sink would convert the next one's writes
+    sink_input_rate = 0;
+    sink_rs_update();
+    mutex_unlock(&sink_lock);
+    if (voice_flags) voice_update();
+}
+
+void stream_bridge::source_configured(int sample_rates, int channels, int bits) {
+    source_rate = sample_rates;
+    source_channels = channels;
+    source_bits = bits;
+    if (voice_flags) voice_update();
+}
+
+void stream_bridge::set_voice_processing(int flags) {
+    voice_flags = flags;
+    voice_update();
+}
+
+void stream_bridge::set_sink_input_rate(int sample_rates, resampler_quality_t quality) {
+    mutex_lock(&sink_lock);
+    sink_input_rate = sample_rates;
+    sink_rs_quality = quality;
+    sink_rs_update();
+    mutex_unlock(&sink_lock);
+}
+
+int stream_bridge::write(const void *buffer, int len, uint32_t wait_time) {
+    mutex_lock(&sink_lock);
+    if (resampler_passthrough(&sink_rs)) {
+        int written = sink_write(buffer, len, wait_time);
+        mutex_unlock(&sink_lock);
+        return written;
+    }
+
+    const int frame = sink_channels * sizeof(int16_t);
+    const int conv_frames = sizeof(conv_buf) / frame;
+    // largest input chunk whose output still fits conv_buf
+    const size_t chunk_frames = (conv_frames - 1) * sink_rs.down / sink_rs.up;
+
+    auto *in = static_cast<const int16_t *>(buffer);
+    size_t frames = len / frame, consumed = 0;
+    while (consumed < frames) {
+        size_t n = std::min(frames - consumed, chunk_frames);
+        size_t out = resampler_process(&sink_rs, in + consumed * sink_channels, n, conv_buf, conv_frames);
+        size_t written = sink_write(conv_buf, static_cast<int>(out * frame), wait_time) / frame;
+        if (written < out) {
+            // the sink is full, report the input behind what it took
+            consumed += n * written / out;
+            break;
+        }
+        consumed += n;
+    }
+    mutex_unlock(&sink_lock);
+    return static_cast<int>(consumed * frame);
+}
+
+int stream_bridge::read(void *buffer, int len, uint32_t wait_time) {
+    int b = read_raw(buffer, len, wait_time);
+    if (voice_enter()) {
+        // reference the speaker has not played yet plus mic audio still waiting, both in frames
+        int far_delay = bytes_queued() / frame_bytes(sink_channels, sink_bits) + bytes_ready_to_read() / 2;
+        voice_proc_process(&voice, static_cast<int16_t *>(buffer), b / 2, far_delay);
+        voice_leave();
+    }
+    return b;
+}
@@ -0,0 +1,246 @@
+#include <stream_bridge.h>
+#include <stream_bridge_private.h>
+
+#include <driver/i2s_std.h>
+#include <esp_timer.h>
+#include <cstring>
+#include <atomic>
+#include <impl/log.h>
+#include <impl/concurrency.h>
+
+static const char *TAG = "STREAM_BRIDGE";
+
+static i2s_std_config_t sink_cfg = {
+        .clk_cfg = {
+                .sample_rate_hz = 44100,
+                .clk_src = I2S_CLK_SRC_APLL,
+                .mclk_multiple = I2S_MCLK_MULTIPLE_256,
+        },
+        .slot_cfg = I2S_STD_MSB_SLOT_DEFAULT_CONFIG(I2S_DATA_BIT_WIDTH_16BIT, I2S_SLOT_MODE_STEREO),
+        .gpio_cfg = {
+                .mclk = GPIO_NUM_NC,
+                .bclk = GPIO_NUM_13,
+                .ws = GPIO_NUM_14,
+                .dout = GPIO_NUM_12,
+                .din = GPIO_NUM_NC,
+                .invert_flags = {
+                        .mclk_inv = false,
+                        .bclk_inv = false,
+                        .ws_inv = false,
+                }
+        },
+};
+static i2s_std_config_t source_cfg = {
+        .clk_cfg = {
+                .sample_rate_hz = 44100,
+                .clk_src = I2S_CLK_SRC_DEFAULT,
+                .mclk_multiple = I2S_MCLK_MULTIPLE_256, // for 16bit data
+        },
+        .slot_cfg = I2S_STD_PHILIPS_SLOT_DEFAULT_CONFIG(I2S_DATA_BIT_WIDTH_16BIT, I2S_SLOT_MODE_MONO),
+        .gpio_cfg = {
+                .mclk = GPIO_NUM_NC,
+                .bclk = GPIO_NUM_16,
+                .ws = GPIO_NUM_15,
+                .dout = GPIO_NUM_NC,
+                .din = GPIO_NUM_4,
+                .invert_flags = {
+                        .mclk_inv = false,
+                        .bclk_inv = false,
+                        .ws_inv = false,
+                }
+        },
+};
+
+// Volume thresholds
+static int volume_convert_alc_sink(int vol) {
+    return vol ? vol * 40 / 127 - 40 : -64;
+}
+
+static int volume_convert_alc_source(int vol) {
+    return vol ? vol * 30 / 127 - 30 : -64;
+}
+
+static int source_vol = 127, sink_vol = 127;
+
+static i2s_chan_handle_t tx_handle, rx_handle;
+static mutex_t tx_io, rx_io; // the handles, held by write_raw/read_raw and while configure replaces them
+static stream_bridge::dma_layout_t tx_layout = {DMA_BUF_COUNT, DMA_BUF_SIZE};
+static stream_bridge::dma_layout_t rx_layout = {DMA_BUF_COUNT, DMA_BUF_SIZE};
+
+static stream_bridge::fill_level_t rx_fill;
+static stream_bridge::fill_level_t tx_fill;
+
+// on overflow the driver drops the oldest descriptor, saturating at capacity matches that
+static IRAM_ATTR bool i2s_rx_callback(i2s_chan_handle_t handle, i2s_event_data_t *event, void *user_ctx) {
+    stream_bridge::fill_add(&rx_fill, event->size);
+    rx_fill.last_dma_us = esp_timer_get_time();
+    return false;
+}
+
+// with auto_clear the dma keeps sending silence when starved, saturating at 0 ignores that
+static IRAM_ATTR bool i2s_tx_callback(i2s_chan_handle_t handle, i2s_event_data_t *event, void *user_ctx) {
+    stream_bridge::fill_add(&tx_fill, -static_cast<int32_t>(event->size));
+    tx_fill.last_dma_us = esp_timer_get_time();
+    return false;
+}
+
+static const i2s_event_callbacks_t i2s_cbs = {
+        .on_recv = i2s_rx_callback,
+        .on_recv_q_ovf = nullptr,
+        .on_sent = i2s_tx_callback,
+        .on_send_q_ovf = nullptr,
+};
+
+static void create_sink_channel(const stream_bridge::dma_layout_t &layout) {
+    i2s_chan_config_t chan_cfg = I2S_CHANNEL_DEFAULT_CONFIG(I2S_NUM_0, I2S_ROLE_MASTER);
+    chan_cfg.dma_desc_num = layout.desc_num;
+    chan_cfg.dma_frame_num = layout.frame_num;
+    chan_cfg.auto_clear = true;
+    ESP_ERROR_CHECK(i2s_new_channel(&chan_cfg, &tx_handle, nullptr));
+    ESP_ERROR_CHECK(i2s_channel_init_std_mode(tx_handle, &sink_cfg));
+    ESP_ERROR_CHECK(i2s_channel_register_event_callback(tx_handle, &i2s_cbs, nullptr));
+    tx_layout = layout;
+}
+
+static void create_source_channel(const stream_bridge::dma_layout_t &layout) {
+    i2s_chan_config_t chan_cfg = I2S_CHANNEL_DEFAULT_CONFIG(I2S_NUM_1, I2S_ROLE_MASTER);
+    chan_cfg.dma_desc_num = layout.desc_num;
+    chan_cfg.dma_frame_num = layout.frame_num;
+    chan_cfg.auto_clear = true;
+    ESP_ERROR_CHECK(i2s_new_channel(&chan_cfg, nullptr, &rx_handle));
+    ESP_ERROR_CHECK(i2s_channel_init_std_mode(rx_handle, &source_cfg));
+    ESP_ERROR_CHECK(i2s_channel_register_event_callback(rx_handle, &i2s_cbs, nullptr));
+    rx_layout = layout;
+}
+
+static int layout_bytes(const stream_bridge::dma_layout_t &layout, const i2s_std_slot_config_t &slot) {
+    return layout.desc_num * layout.frame_num * stream_bridge::frame_bytes(slot.slot_mode, slot.data_bit_width);
+}
+
+static bool layout_equal(const stream_bridge::dma_layout_t &a, const stream_bridge::dma_layout_t &b) {
+    return a.desc_num == b.desc_num && a.frame_num == b.frame_num;
+}
+
+void stream_bridge::init() {
+    if (tx_handle && rx_handle) return;
+
+    bridge_init();
+    mutex_init(&tx_io);
+    mutex_init(&rx_io);
+
+    create_sink_channel(tx_layout);
+    create_source_channel(rx_layout);
+    fill_reset(&tx_fill, layout_bytes(tx_layout, sink_cfg.slot_cfg));
+    fill_reset(&rx_fill, layout_bytes(rx_layout, source_cfg.slot_cfg));
+
+    ESP_ERROR_CHECK(i2s_channel_enable(tx_handle));
+    ESP_ERROR_CHECK(i2s_channel_enable(rx_handle));
+}
+
+int stream_bridge::write_raw(const void *buffer, int len, uint32_t wait_time) {
+    size_t b;
+    mutex_lock(&tx_io);
+    i2s_channel_write(tx_handle, buffer, len, &b, wait_time);
+    mutex_unlock(&tx_io);
+    if (b < len) loge(TAG, "i2s write underrun: %d/%d", b, len);
+    fill_add(&tx_fill, b);
+    return b;
+}
+
+int stream_bridge::read_raw(void *buffer, int len, uint32_t wait_time) {
+    size_t b;
+    mutex_lock(&rx_io);
+    i2s_channel_read(rx_handle, buffer, len, &b, wait_time);
+    mutex_unlock(&rx_io);
+    if (b < len) loge(TAG, "i2s read underrun: %d/%d", b, len);
+    fill_add(&rx_fill, -static_cast<int32_t>(b));
+    return b;
+}
+
+int stream_bridge::bytes_ready_to_read() {
+    return rx_fill.bytes;
+}
+
+int stream_bridge::bytes_can_write() {
+    return tx_fill.capacity - tx_fill.bytes;
+}
+
+int stream_bridge::bytes_queued() {
+    return tx_fill.bytes;
+}
+
+uint32_t stream_bridge::clock_us() {
+    return esp_timer_get_time();
+}
+
+uint32_t stream_bridge::sink_dma_time_us() {
+    return tx_fill.last_dma_us;
+}
+
+uint32_t stream_bridge::source_dma_time_us() {
+    return rx_fill.last_dma_us;
+}
+
+void stream_bridge::configure_sink(int sample_rates, int channels, int bits, int latency_ms) {
+    dma_layout_t layout = dma_layout(sample_rates, channels, bits, latency_ms);
+    // a write in progress finishes on the old channel first, the next one waits for the new
+    mutex_lock(&tx_io);
+    i2s_channel_disable(tx_handle);
+    sink_cfg.slot_cfg = I2S_STD_MSB_SLOT_DEFAULT_CONFIG(static_cast<i2s_data_bit_width_t>(bits),
+                                                        static_cast<i2s_slot_mode_t>(channels));
+    sink_cfg.slot_cfg.slot_mask = I2S_STD_SLOT_BOTH; // in i2s_slot_mode mono, pcm5102 plays only on left channel, fix
+    sink_cfg.clk_cfg.sample_rate_hz = sample_rates;
+    if (layout_equal(layout, tx_layout)) {
+        ESP_ERROR_CHECK(i2s_channel_reconfig_std_slot(tx_handle, &sink_cfg.slot_cfg));
+        ESP_ERROR_CHECK(i2s_channel_reconfig_std_clock(tx_handle, &sink_cfg.clk_cfg));
+    } else {
+        ESP_ERROR_CHECK(i2s_del_channel(tx_handle));
+        create_sink_channel(layout);
+    }
+    fill_reset(&tx_fill, layout_bytes(layout, sink_cfg.slot_cfg));
+    i2s_channel_enable(tx_handle);
+    mutex_unlock(&tx_io);
+    // takes the lock write holds around write_raw, so only once tx_io is free again
+    sink_configured(sample_rates, channels, bits);
+    logi(TAG, "sink reconfigured to sr: %d, ch: %d, bt: %d, dma: %dx%d", sample_rates, channels, bits,
+         layout.desc_num, layout.frame_num);
+}
+
+void stream_bridge::configure_source(int sample_rates, int channels, int bits, int latency_ms, int chunk_ms) {
+    dma_layout_t layout = dma_layout(sample_rates, channels, bits, latency_ms, chunk_ms);
+    mutex_lock(&rx_io);
+    i2s_channel_disable(rx_handle);
+    source_cfg.slot_cfg = I2S_STD_PHILIPS_SLOT_DEFAULT_CONFIG(static_cast<i2s_data_bit_width_t>(bits),
+                                                              static_cast<i2s_slot_mode_t>(channels));
+    source_cfg.clk_cfg.sample_rate_hz = sample_rates;
+    if (layout_equal(layout, rx_layout)) {
+        ESP_ERROR_CHECK(i2s_channel_reconfig_std_slot(rx_handle, &source_cfg.slot_cfg));
+        ESP_ERROR_CHECK(i2s_channel_reconfig_std_clock(rx_handle, &source_cfg.clk_cfg));
+    } else {
+        ESP_ERROR_CHECK(i2s_del_channel(rx_handle));
+        create_source_channel(layout);
+    }
+    fill_reset(&rx_fill, layout_bytes(layout, source_cfg.slot_cfg));
+    i2s_channel_enable(rx_handle);
+    mutex_unlock(&rx_io);
+    logi(TAG, "source reconfigured to sr: %d, ch: %d, bt: %d, dma: %dx%d", sample_rates, channels, bits,
+         layout.desc_num, layout.frame_num);
+    source_configured(sample_rates, channels, bits);
+}
+
+// TODO: make volume adjusting support (atomic op)
+void stream_bridge::set_source_volume(int vol) {
+
+}
+
+void stream_bridge::set_sink_volume(int vol) {
+
+}
+
+int stream_bridge::get_source_volume() {
+    return 127;
+}
+
+int stream_bridge::get_sink_volume() {
+    return 127;
+}
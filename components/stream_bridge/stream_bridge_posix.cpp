@@ -0,0 +1,449 @@
+#include <stream_bridge.h>
+#include <stream_bridge_private.h>
+
+#include <impl/concurrency.h>
+#include <impl/log.h>
+
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+
+#ifdef STREAM_BRIDGE_PORTAUDIO
+#include <portaudio.h>
+#endif
+
+static const char *TAG = "STREAM_BRIDGE";
+
+// Mirrors the i2s channels of the target: dma_layout_t descriptors are drained (sink)
+// or filled (source) by a clock task once per descriptor period.
+
+#define RING_SIZE (DMA_BUF_COUNT_MAX * DMA_BUF_BYTES_MAX)
+
+#define WAV_HEADER_SIZE 44
+
+struct channel_t {
+    const char *name;
+    bool is_sink;
+
+    int sample_rate = 44100;
+    int channels;
+    int bits = 16;
+    stream_bridge::dma_layout_t layout = {DMA_BUF_COUNT, DMA_BUF_SIZE};
+
+    uint8_t ring[RING_SIZE] = {};
+    size_t ring_head = 0;
+    std::atomic<size_t> ring_fill{0}; // written under lock, read lock free as the fill level
+    std::atomic<size_t> ring_capacity{0};
+    std::atomic<uint32_t> last_dma_us{0};
+
+    time_t clock_start = 0;
+    uint64_t clock_frames = 0;
+
+    mutex_t lock; // ring and counters
+    mutex_t io; // backend handles, held by the clock task for a whole descriptor
+    semaphore_t dma_sem; // given on every descriptor event
+    thread_t thread;
+
+    const char *wav_path = nullptr;
+    FILE *wav = nullptr;
+    long wav_data_offset = 0;
+    uint32_t wav_data_bytes = 0;
+#ifdef STREAM_BRIDGE_PORTAUDIO
+    PaStream *pa_stream = nullptr;
+#endif
+
+    channel_t(const char *name, bool is_sink, int channels) : name(name), is_sink(is_sink), channels(channels) {}
+};
+
+static stream_bridge::host_backend_t backend =
+#ifdef STREAM_BRIDGE_PORTAUDIO
+        stream_bridge::HOST_PORTAUDIO;
+#else
+        stream_bridge::HOST_NULL;
+#endif
+
+static channel_t sink("sink", true, 2);
+static channel_t source("source", false, 1);
+
+static bool initialized = false;
+
+static size_t frame_bytes(const channel_t *ch) {
+    return stream_bridge::frame_bytes(ch->channels, ch->bits);
+}
+
+static size_t desc_bytes(const channel_t *ch) {
+    return ch->layout.frame_num * frame_bytes(ch);
+}
+
+static size_t ring_capacity(const channel_t *ch) {
+    return ch->ring_capacity;
+}
+
+static size_t ring_push(channel_t *ch, const uint8_t *data, size_t bytes) {
+    size_t cap = ring_capacity(ch);
+    bytes = std::min(bytes, cap - ch->ring_fill);
+    size_t tail = (ch->ring_head + ch->ring_fill) % cap;
+    size_t first = std::min(bytes, cap - tail);
+    memcpy(ch->ring + tail, data, first);
+    memcpy(ch->ring, data + first, bytes - first);
+    ch->ring_fill += bytes;
+    return bytes;
+}
+
+static size_t ring_pop(channel_t *ch, uint8_t *data, size_t bytes) {
+    size_t cap = ring_capacity(ch);
+    bytes = std::min(bytes, ch->ring_fill.load());
+    size_t first = std::min(bytes, cap - ch->ring_head);
+    memcpy(data, ch->ring + ch->ring_head, first);
+    memcpy(data + first, ch->ring, bytes - first);
+    ch->ring_head = (ch->ring_head + bytes) % cap;
+    ch->ring_fill -= bytes;
+    return bytes;
+}
+
+// WAV
+
+static void wav_store_32(uint8_t *p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static void wav_store_16(uint8_t *p, uint16_t v) {
+    p[0] = v; p[1] = v >> 8;
+}
+
+static void wav_write_header(channel_t *ch) {
+    uint8_t h[WAV_HEADER_SIZE];
+    uint16_t block_align = frame_bytes(ch);
+    memcpy(h, "RIFF", 4);
+    wav_store_32(h + 4, 36 + ch->wav_data_bytes);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    wav_store_32(h + 16, 16);
+    wav_store_16(h + 20, 1); // PCM
+    wav_store_16(h + 22, ch->channels);
+    wav_store_32(h + 24, ch->sample_rate);
+    wav_store_32(h + 28, ch->sample_rate * block_align);
+    wav_store_16(h + 32, block_align);
+    wav_store_16(h + 34, block_align / ch->channels * 8);
+    memcpy(h + 36, "data", 4);
+    wav_store_32(h + 40, ch->wav_data_bytes);
+
+    fseek(ch->wav, 0, SEEK_SET);
+    fwrite(h, 1, WAV_HEADER_SIZE, ch->wav);
+    fseek(ch->wav, 0, SEEK_END);
+}
+
+static void wav_open_source(channel_t *ch) {
+    uint8_t h[12];
+    if (fread(h, 1, 12, ch->wav) != 12 || memcmp(h, "RIFF", 4) != 0 || memcmp(h + 8, "WAVE", 4) != 0) {
+        loge(TAG, "%s is not a wav file", ch->wav_path);
+        fclose(ch->wav);
+        ch->wav = nullptr;
+        return;
+    }
+    while (fread(h, 1, 8, ch->wav) == 8) {
+        uint32_t len = h[4] | h[5] << 8 | h[6] << 16 | h[7] << 24;
+        if (memcmp(h, "fmt ", 4) == 0) {
+            uint8_t fmt[16];
+            if (len < 16 || fread(fmt, 1, 16, ch->wav) != 16) break;
+            uint16_t channels = fmt[2] | fmt[3] << 8;
+            uint32_t rate = fmt[4] | fmt[5] << 8 | fmt[6] << 16 | fmt[7] << 24;
+            uint16_t bits = fmt[14] | fmt[15] << 8;
+            if (channels != ch->channels || static_cast<int>(rate) != ch->sample_rate || bits != ch->bits) {
+                loge(TAG, "%s format mismatch (sr: %u, ch: %u, bt: %u), playing raw", ch->wav_path, rate, channels, bits);
+            }
+            fseek(ch->wav, len - 16 + (len & 1), SEEK_CUR);
+        } else if (memcmp(h, "data", 4) == 0) {
+            ch->wav_data_offset = ftell(ch->wav);
+            ch->wav_data_bytes = len;
+            return;
+        } else {
+            fseek(ch->wav, len + (len & 1), SEEK_CUR);
+        }
+    }
+    loge(TAG, "%s has no data chunk", ch->wav_path);
+    fclose(ch->wav);
+    ch->wav = nullptr;
+}
+
+static void wav_read(channel_t *ch, uint8_t *data, size_t bytes) {
+    while (bytes) {
+        long pos = ftell(ch->wav) - ch->wav_data_offset;
+        size_t left = ch->wav_data_bytes - pos;
+        size_t n = fread(data, 1, std::min(bytes, left), ch->wav);
+        if (n == 0) { // loop the recording
+            fseek(ch->wav, ch->wav_data_offset, SEEK_SET);
+            if (left == ch->wav_data_bytes) break; // empty data chunk
+            continue;
+        }
+        data += n;
+        bytes -= n;
+    }
+    memset(data, 0, bytes);
+}
+
+// Backend
+
+static void backend_open(channel_t *ch) {
+    switch (backend) {
+        case stream_bridge::HOST_WAV:
+            if (!ch->wav_path) break;
+            ch->wav = fopen(ch->wav_path, ch->is_sink ? "wb" : "rb");
+            if (!ch->wav) {
+                loge(TAG, "cannot open %s", ch->wav_path);
+                break;
+            }
+            ch->wav_data_bytes = 0;
+            if (ch->is_sink) wav_write_header(ch);
+            else wav_open_source(ch);
+            break;
+        case stream_bridge::HOST_PORTAUDIO: {
+#ifdef STREAM_BRIDGE_PORTAUDIO
+            size_t sample_bytes = frame_bytes(ch) / ch->channels;
+            PaSampleFormat fmt = sample_bytes == 1 ? paInt8 : sample_bytes == 2 ? paInt16 : paInt32;
+            PaError err = Pa_OpenDefaultStream(&ch->pa_stream, ch->is_sink ? 0 : ch->channels,
+                                               ch->is_sink ? ch->channels : 0, fmt, ch->sample_rate,
+                                               ch->layout.frame_num, nullptr, nullptr);
+            if (err != paNoError) {
+                loge(TAG, "%s stream open error: %s", ch->name, Pa_GetErrorText(err));
+                ch->pa_stream = nullptr;
+                break;
+            }
+            Pa_StartStream(ch->pa_stream);
+#endif
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void backend_close(channel_t *ch) {
+    if (ch->wav) {
+        fclose(ch->wav);
+        ch->wav = nullptr;
+    }
+#ifdef STREAM_BRIDGE_PORTAUDIO
+    if (ch->pa_stream) {
+        Pa_StopStream(ch->pa_stream);
+        Pa_CloseStream(ch->pa_stream);
+        ch->pa_stream = nullptr;
+    }
+#endif
+}
+
+// Returns true when the backend itself blocked for the descriptor period
+static bool backend_transfer(channel_t *ch, uint8_t *desc, size_t bytes) {
+#ifdef STREAM_BRIDGE_PORTAUDIO
+    if (ch->pa_stream) {
+        if (ch->is_sink) Pa_WriteStream(ch->pa_stream, desc, ch->layout.frame_num);
+        else Pa_ReadStream(ch->pa_stream, desc, ch->layout.frame_num);
+        return true;
+    }
+#endif
+    if (ch->wav) {
+        if (ch->is_sink) {
+            fwrite(desc, 1, bytes, ch->wav);
+            ch->wav_data_bytes += bytes;
+            wav_write_header(ch);
+        } else {
+            wav_read(ch, desc, bytes);
+        }
+        return false;
+    }
+    if (!ch->is_sink) memset(desc, 0, bytes);
+    return false;
+}
+
+static void clock_task(void *ctx) {
+    auto *ch = static_cast<channel_t *>(ctx);
+    uint8_t desc[DMA_BUF_BYTES_MAX];
+
+    while (true) {
+        mutex_lock(&ch->io);
+        size_t bytes = desc_bytes(ch);
+
+        if (ch->is_sink) {
+            mutex_lock(&ch->lock);
+            size_t got = ring_pop(ch, desc, bytes);
+            mutex_unlock(&ch->lock);
+            memset(desc + got, 0, bytes - got); // auto_clear
+        }
+
+        bool paced = backend_transfer(ch, desc, bytes);
+
+        mutex_lock(&ch->lock);
+        if (!ch->is_sink) {
+            size_t cap = ring_capacity(ch);
+            if (ch->ring_fill + bytes > cap) { // rx queue overflow, oldest descriptor is lost
+                ch->ring_head = (ch->ring_head + bytes) % cap;
+                ch->ring_fill -= bytes;
+            }
+            ring_push(ch, desc, bytes);
+        }
+        ch->last_dma_us = stream_bridge::clock_us();
+        ch->clock_frames += ch->layout.frame_num;
+        time_t next = ch->clock_start + static_cast<time_t>(ch->clock_frames * 1000 / ch->sample_rate);
+        mutex_unlock(&ch->lock);
+        mutex_unlock(&ch->io);
+
+        bin_sem_give(&ch->dma_sem);
+
+        if (!paced) {
+            time_t now = thread_millis();
+            if (next > now) thread_sleep(next - now);
+        }
+    }
+}
+
+static void channel_init(channel_t *ch) {
+    ch->ring_head = 0;
+    ch->ring_fill = 0;
+    ch->ring_capacity = ch->layout.desc_num * desc_bytes(ch);
+    ch->last_dma_us = 0;
+    ch->clock_start = thread_millis();
+    ch->clock_frames = 0;
+    mutex_init(&ch->lock);
+    mutex_init(&ch->io);
+    bin_sem_init(&ch->dma_sem);
+
+    backend_open(ch);
+
+    thread_init(&ch->thread, ctx_func_t<thread_func_t>(clock_task, ch), ch->is_sink ? "i2s_sink" : "i2s_source");
+    thread_launch(&ch->thread);
+}
+
+static void channel_configure(channel_t *ch, int sample_rates, int channels, int bits, int latency_ms,
+                              int chunk_ms = 0) {
+    mutex_lock(&ch->io);
+    backend_close(ch);
+
+    mutex_lock(&ch->lock);
+    ch->sample_rate = sample_rates;
+    ch->channels = channels;
+    ch->bits = bits;
+    ch->layout = stream_bridge::dma_layout(sample_rates, channels, bits, latency_ms, chunk_ms);
+    ch->ring_head = 0;
+    ch->ring_fill = 0;
+    ch->ring_capacity = ch->layout.desc_num * desc_bytes(ch);
+    ch->clock_start = thread_millis();
+    ch->clock_frames = 0;
+    mutex_unlock(&ch->lock);
+
+    backend_open(ch);
+    mutex_unlock(&ch->io);
+    logi(TAG, "%s reconfigured to sr: %d, ch: %d, bt: %d, dma: %dx%d", ch->name, sample_rates, channels, bits,
+         ch->layout.desc_num, ch->layout.frame_num);
+}
+
+// Copies through the ring, waiting on descriptor events for up to wait_time ms like i2s_channel_write/read
+static size_t channel_transfer(channel_t *ch, uint8_t *data, size_t len, uint32_t wait_time) {
+    size_t done = 0;
+    time_t deadline = thread_millis() + wait_time;
+    while (true) {
+        mutex_lock(&ch->lock);
+        if (ch->is_sink) done += ring_push(ch, data + done, len - done);
+        else done += ring_pop(ch, data + done, len - done);
+        mutex_unlock(&ch->lock);
+        if (done == len) break;
+
+        time_t left = deadline - thread_millis();
+        if (left <= 0) break;
+        bin_sem_take(&ch->dma_sem, left);
+    }
+    return done;
+}
+
+void stream_bridge::host_set_backend(host_backend_t b, const char *sink_path, const char *source_path) {
+    if (initialized) {
+        loge(TAG, "backend must be set before init");
+        return;
+    }
+#ifndef STREAM_BRIDGE_PORTAUDIO
+    if (b == HOST_PORTAUDIO) {
+        loge(TAG, "built without PortAudio, using null backend");
+        b = HOST_NULL;
+    }
+#endif
+    backend = b;
+    sink.wav_path = sink_path;
+    source.wav_path = source_path;
+}
+
+void stream_bridge::init() {
+    if (initialized) return;
+    initialized = true;
+
+    bridge_init();
+
+#ifdef STREAM_BRIDGE_PORTAUDIO
+    if (backend == HOST_PORTAUDIO) Pa_Initialize();
+#endif
+
+    channel_init(&sink);
+    channel_init(&source);
+}
+
+int stream_bridge::write_raw(const void *buffer, int len, uint32_t wait_time) {
+    size_t b = channel_transfer(&sink, (uint8_t *) buffer, len, wait_time);
+    if (b < static_cast<size_t>(len)) loge(TAG, "i2s write underrun: %zu/%d", b, len);
+    return b;
+}
+
+int stream_bridge::read_raw(void *buffer, int len, uint32_t wait_time) {
+    size_t b = channel_transfer(&source, static_cast<uint8_t *>(buffer), len, wait_time);
+    if (b < static_cast<size_t>(len)) loge(TAG, "i2s read underrun: %zu/%d", b, len);
+    return b;
+}
+
+int stream_bridge::bytes_ready_to_read() {
+    return source.ring_fill;
+}
+
+int stream_bridge::bytes_can_write() {
+    return sink.ring_capacity - sink.ring_fill;
+}
+
+int stream_bridge::bytes_queued() {
+    return sink.ring_fill;
+}
+
+uint32_t stream_bridge::clock_us() {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return spec.tv_sec * 1000000ULL + spec.tv_nsec / 1000;
+}
+
+uint32_t stream_bridge::sink_dma_time_us() {
+    return sink.last_dma_us;
+}
+
+uint32_t stream_bridge::source_dma_time_us() {
+    return source.last_dma_us;
+}
+
+void stream_bridge::configure_sink(int sample_rates, int channels, int bits, int latency_ms) {
+    channel_configure(&sink, sample_rates, channels, bits, latency_ms);
+    sink_configured(sample_rates, channels, bits);
+}
+
+void stream_bridge::configure_source(int sample_rates, int channels, int bits, int latency_ms, int chunk_ms) {
+    channel_configure(&source, sample_rates, channels, bits, latency_ms, chunk_ms);
+    source_configured(sample_rates, channels, bits);
+}
+
+void stream_bridge::set_source_volume(int) {
+
+}
+
+void stream_bridge::set_sink_volume(int) {
+
+}
+
+int stream_bridge::get_source_volume() {
+    return 127;
+}
+
+int stream_bridge::get_sink_volume() {
+    return 127;
+}
@@ -0,0 +1,105 @@
+#ifndef VOICE_PROC_H
+#define VOICE_PROC_H
+
+#include <atomic>
+#include <cstdint>
+
+#define VOICE_PROC_BLOCK_MS 4 // processing block, rounded up to a power of two in frames
+#define VOICE_PROC_TAIL_MS 32 // echo path covered by the canceller
+#define VOICE_PROC_FAR_MS 160 // reference history, has to exceed the sink plus source buffering
+
+enum voice_proc_flags_t {
+    VOICE_PROC_AEC = 1 << 0,
+    VOICE_PROC_NS = 1 << 1
+};
+
+typedef struct {
+    float re;
+    float im;
+} voice_proc_cpx_t;
+
+typedef struct {
+    uint32_t blocks;
+    uint32_t realigns; // reference skipped or delayed to follow the buffering
+    uint32_t resets; // canceller diverged and started over
+    int erle_db; // echo return loss enhancement while the far end talks
+} voice_proc_stats_t;
+
+// Single precision only, the esp32 fpu has no doubles. Everything is allocated in init
+typedef struct voice_proc_t {
+    int sample_rate = 0;
+    int flags = 0;
+    int block = 0; // N frames, the fft runs over 2N
+    int bins = 0; // N + 1
+    int partitions = 0;
+
+    // fft
+    voice_proc_cpx_t *twiddle = nullptr; // [N]
+    uint16_t *bitrev = nullptr; // [2N]
+    voice_proc_cpx_t *fft_buf = nullptr; // [2N]
+    voice_proc_cpx_t *spec = nullptr; // [bins]
+    float *time_buf = nullptr; // [2N]
+
+    // far end reference, writer thread -> processing thread, mono
+    int16_t *far_ring = nullptr;
+    uint32_t far_size = 0; // power of two
+    std::atomic<uint32_t> far_head{0};
+    std::atomic<uint32_t> far_tail{0};
+    int far_excess = 0; // averaged surplus of the history over far_delay, jitter of the dma accounting averages out
+    bool far_synced = false;
+
+    // block io, adds one block of latency
+    int pos = 0;
+    float *near_block = nullptr; // [N]
+    float *far_in = nullptr; // [N]
+    int16_t *out_block = nullptr; // [N]
+
+    // canceller, partitioned block frequency domain nlms
+    float *far_block = nullptr; // [2N] previous and current block
+    voice_proc_cpx_t *far_spec = nullptr; // [partitions][bins], ring
+    voice_proc_cpx_t *weights = nullptr; // [partitions][bins]
+    float *far_power = nullptr; // [bins]
+    float *err = nullptr; // [N]
+    int far_idx = 0;
+    int constrain_idx = 0;
+    int warmup = 0; // far active blocks adapted at full step
+    int diverged = 0;
+    float near_energy = 0, err_energy = 0, echo_energy = 0;
+
+    // noise suppression, decision directed wiener gain over 50% overlapped windows
+    float *window = nullptr; // [2N] sqrt hann
+    float *ns_prev = nullptr; // [N]
+    float *ns_overlap = nullptr; // [N]
+    float *noise = nullptr; // [bins]
+    float *clean = nullptr; // [bins] last clean power estimate
+    bool ns_primed = false;
+
+    voice_proc_stats_t stats = {};
+} voice_proc_t;
+
+// Returns -1 on bad arguments or when out of memory
+int voice_proc_init(voice_proc_t *vp, int sample_rate, int flags, int tail_ms = VOICE_PROC_TAIL_MS);
+
+void voice_proc_deinit(voice_proc_t *vp);
+
+void voice_proc_reset(voice_proc_t *vp);
+
+// Frames the processed signal lags behind its input
+int voice_proc_latency(const voice_proc_t *vp);
+
+// Far end as sent to the speaker, interleaved, any length. Never blocks, drops when the history is full
+void voice_proc_far(voice_proc_t *vp, const int16_t *far, int frames, int channels);
+
+// Mono near end in place, any length. far_delay is how many frames the speaker output trails the reference
+// (sink buffering) plus how long the mic input waited to be read (source buffering)
+void voice_proc_process(voice_proc_t *vp, int16_t *near, int frames, int far_delay);
+
+voice_proc_stats_t voice_proc_stats(const voice_proc_t *vp);
+
+#ifndef ESP_PLATFORM
+// Offline evaluation: runs a mic recording against the speaker recording it was captured with and writes the result.
+// Both mono or stereo 16 bit wav at the same rate, delay as in voice_proc_process. Returns frames processed or -1
+int voice_proc_eval_wav(const char *near_path, const char *far_path, const char *out_path, int flags, int far_delay);
+#endif
+
+#endif //VOICE_PROC_H
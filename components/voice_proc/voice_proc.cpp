@@ -0,0 +1,421 @@
+#include <voice_proc.h>
+
+#include <impl/log.h>
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+static const char *TAG = "VOICE_PROC";
+
+#define VOICE_PROC_MU 0.5f // nlms step at full rate
+#define VOICE_PROC_WARMUP_BLOCKS 250 // far end blocks adapted at full step before the step follows the residual
+#define VOICE_PROC_RATE_MIN 0.05f // step left during double talk
+#define VOICE_PROC_DIVERGE_BLOCKS 50 // blocks the canceller may add energy before it is reset
+#define VOICE_PROC_FAR_ACTIVE 1e-6f // mean square of a far block that is worth adapting to, -60 dBFS
+#define VOICE_PROC_NS_FLOOR 0.1f // -20 dB, lower gains only make the residual noise musical
+#define VOICE_PROC_NS_RISE_DB_S 6.0f // how fast the noise estimate may climb
+#define VOICE_PROC_NS_SPEECH 4.0f // bin power over the noise estimate that is taken for speech
+#define VOICE_PROC_SNR_SMOOTH 0.98f // decision directed a priori snr
+
+template<typename T>
+static T *alloc(int count, bool *ok) {
+    auto *p = static_cast<T *>(calloc(count, sizeof(T)));
+    *ok &= p != nullptr;
+    return p;
+}
+
+// FFT
+
+// In place radix-2 over 2N points, inverse is not scaled
+static void fft(voice_proc_t *vp, voice_proc_cpx_t *buf, bool inverse) {
+    const int n = 2 * vp->block;
+    for (int i = 0; i < n; ++i) {
+        int j = vp->bitrev[i];
+        if (i < j) std::swap(buf[i], buf[j]);
+    }
+    for (int len = 2; len <= n; len <<= 1) {
+        const int half = len / 2;
+        const int step = n / len;
+        for (int i = 0; i < n; i += len) {
+            for (int k = 0; k < half; ++k) {
+                voice_proc_cpx_t w = vp->twiddle[k * step];
+                if (inverse) w.im = -w.im;
+                voice_proc_cpx_t a = buf[i + k], b = buf[i + k + half];
+                float tr = b.re * w.re - b.im * w.im;
+                float ti = b.re * w.im + b.im * w.re;
+                buf[i + k] = {a.re + tr, a.im + ti};
+                buf[i + k + half] = {a.re - tr, a.im - ti};
+            }
+        }
+    }
+}
+
+// 2N real samples to bins 0..N
+static void fft_real(voice_proc_t *vp, const float *in, voice_proc_cpx_t *out) {
+    const int n = 2 * vp->block;
+    for (int i = 0; i < n; ++i) vp->fft_buf[i] = {in[i], 0};
+    fft(vp, vp->fft_buf, false);
+    memcpy(out, vp->fft_buf, vp->bins * sizeof(voice_proc_cpx_t));
+}
+
+// Bins 0..N of a real signal back to its 2N samples
+static void ifft_real(voice_proc_t *vp, const voice_proc_cpx_t *in, float *out) {
+    const int n = 2 * vp->block;
+    memcpy(vp->fft_buf, in, vp->bins * sizeof(voice_proc_cpx_t));
+    for (int k = 1; k < vp->block; ++k) vp->fft_buf[n - k] = {in[k].re, -in[k].im};
+    fft(vp, vp->fft_buf, true);
+    const float scale = 1.0f / static_cast<float>(n);
+    for (int i = 0; i < n; ++i) out[i] = vp->fft_buf[i].re * scale;
+}
+
+// Far end
+
+// Pops one block of reference. What stays in the history should be far_delay frames, the reference the speaker has
+// not played yet when the block's last mic frame was captured; misalignment within two blocks is left to the taps
+static void far_take(voice_proc_t *vp, float *far, int far_delay) {
+    const int n = vp->block;
+    const uint32_t mask = vp->far_size - 1;
+    uint32_t tail = vp->far_tail.load(std::memory_order_relaxed);
+    int level = static_cast<int>(vp->far_head.load(std::memory_order_acquire) - tail);
+    int excess = level - n - std::min(far_delay, static_cast<int>(vp->far_size) - n);
+
+    int pad = 0;
+    if (level <= 0) {
+        vp->far_synced = false; // speaker idle, line up again once it plays
+    } else {
+        if (!vp->far_synced) vp->far_excess = excess;
+        else vp->far_excess += (excess - vp->far_excess) / 16;
+
+        if (vp->far_excess > 2 * n || (!vp->far_synced && vp->far_excess > 0)) { // the mic was not read for a while
+            int skip = std::min(vp->far_excess, level);
+            tail += skip;
+            level -= skip;
+            vp->far_excess -= skip;
+            vp->stats.realigns++;
+        } else if (vp->far_excess < -2 * n) { // reference runs ahead of the speaker
+            pad = std::min(-vp->far_excess, n);
+            vp->far_excess += pad;
+            vp->stats.realigns++;
+        }
+        vp->far_synced = true;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        if (i < pad || level <= 0) {
+            far[i] = 0;
+            continue;
+        }
+        far[i] = vp->far_ring[tail++ & mask] / 32768.0f;
+        level--;
+    }
+    vp->far_tail.store(tail, std::memory_order_release);
+}
+
+// Canceller
+
+static void constrain(voice_proc_t *vp, voice_proc_cpx_t *w) {
+    // taps live in the first half, the rest is circular convolution leaking in
+    ifft_real(vp, w, vp->time_buf);
+    memset(vp->time_buf + vp->block, 0, vp->block * sizeof(float));
+    fft_real(vp, vp->time_buf, w);
+}
+
+static void aec_block(voice_proc_t *vp, const float *far, const float *near, float *err) {
+    const int n = vp->block, bins = vp->bins, parts = vp->partitions;
+
+    // spectrum over the previous and the current far block, the newest partition moves to the front of the ring
+    memmove(vp->far_block, vp->far_block + n, n * sizeof(float));
+    memcpy(vp->far_block + n, far, n * sizeof(float));
+    vp->far_idx = (vp->far_idx + parts - 1) % parts;
+    voice_proc_cpx_t *x0 = vp->far_spec + vp->far_idx * bins;
+    fft_real(vp, vp->far_block, x0);
+
+    // echo estimate, the second half of the circular convolution is the linear one (overlap-save)
+    voice_proc_cpx_t *spec = vp->spec;
+    memset(spec, 0, bins * sizeof(voice_proc_cpx_t));
+    for (int p = 0; p < parts; ++p) {
+        const voice_proc_cpx_t *x = vp->far_spec + ((vp->far_idx + p) % parts) * bins;
+        const voice_proc_cpx_t *w = vp->weights + p * bins;
+        for (int b = 0; b < bins; ++b) {
+            spec[b].re += w[b].re * x[b].re - w[b].im * x[b].im;
+            spec[b].im += w[b].re * x[b].im + w[b].im * x[b].re;
+        }
+    }
+    ifft_real(vp, spec, vp->time_buf);
+
+    float ex = 0, ed = 0, ee = 0, ey = 0;
+    for (int i = 0; i < n; ++i) {
+        float y = vp->time_buf[n + i];
+        err[i] = near[i] - y;
+        ex += far[i] * far[i];
+        ed += near[i] * near[i];
+        ee += err[i] * err[i];
+        ey += y * y;
+    }
+    vp->near_energy += 0.1f * (ed - vp->near_energy);
+    vp->err_energy += 0.1f * (ee - vp->err_energy);
+    vp->echo_energy += 0.1f * (ey - vp->echo_energy);
+
+    // the canceller should only ever take energy out
+    if (ee > 2 * ed && ed > n * VOICE_PROC_FAR_ACTIVE) {
+        if (++vp->diverged > VOICE_PROC_DIVERGE_BLOCKS) {
+            memset(vp->weights, 0, parts * bins * sizeof(voice_proc_cpx_t));
+            vp->warmup = 0;
+            vp->diverged = 0;
+            vp->stats.resets++;
+        }
+    } else {
+        vp->diverged = 0;
+    }
+
+    if (ex < n * VOICE_PROC_FAR_ACTIVE) return;
+
+    if (vp->err_energy > 0) vp->stats.erle_db = static_cast<int>(10 * log10f(vp->near_energy / vp->err_energy + 1e-9f));
+
+    // full step until the filter caught the echo, then as much as the residual is still echo, near end talk and
+    // noise in the error would otherwise pull the taps away
+    float rate = 1;
+    if (vp->warmup < VOICE_PROC_WARMUP_BLOCKS) vp->warmup++;
+    else rate = std::clamp(vp->echo_energy / (vp->echo_energy + vp->err_energy + 1e-12f), VOICE_PROC_RATE_MIN, 1.0f);
+
+    // error spectrum, zero first half
+    memset(vp->time_buf, 0, n * sizeof(float));
+    memcpy(vp->time_buf + n, err, n * sizeof(float));
+    fft_real(vp, vp->time_buf, spec);
+
+    const float eps = 2.0f * n * VOICE_PROC_FAR_ACTIVE;
+    const float mu = VOICE_PROC_MU * rate;
+    for (int b = 0; b < bins; ++b) {
+        float px = x0[b].re * x0[b].re + x0[b].im * x0[b].im;
+        vp->far_power[b] += 0.1f * (px - vp->far_power[b]);
+        float g = mu / (parts * vp->far_power[b] + eps);
+        spec[b].re *= g;
+        spec[b].im *= g;
+    }
+    for (int p = 0; p < parts; ++p) {
+        const voice_proc_cpx_t *x = vp->far_spec + ((vp->far_idx + p) % parts) * bins;
+        voice_proc_cpx_t *w = vp->weights + p * bins;
+        for (int b = 0; b < bins; ++b) { // conj(x) * e
+            w[b].re += x[b].re * spec[b].re + x[b].im * spec[b].im;
+            w[b].im += x[b].re * spec[b].im - x[b].im * spec[b].re;
+        }
+    }
+
+    // one partition per block keeps the cost flat
+    constrain(vp, vp->weights + vp->constrain_idx * bins);
+    vp->constrain_idx = (vp->constrain_idx + 1) % parts;
+}
+
+// Noise suppression
+
+// in and out may alias, the output is one block late
+static void ns_block(voice_proc_t *vp, const float *in, float *out) {
+    const int n = vp->block, bins = vp->bins;
+    voice_proc_cpx_t *spec = vp->spec;
+
+    for (int i = 0; i < n; ++i) {
+        vp->time_buf[i] = vp->ns_prev[i] * vp->window[i];
+        vp->time_buf[n + i] = in[i] * vp->window[n + i];
+    }
+    memcpy(vp->ns_prev, in, n * sizeof(float));
+    fft_real(vp, vp->time_buf, spec);
+
+    const float rise = powf(10.0f, VOICE_PROC_NS_RISE_DB_S / 10.0f * n / vp->sample_rate);
+    for (int b = 0; b < bins; ++b) {
+        float p = spec[b].re * spec[b].re + spec[b].im * spec[b].im;
+
+        // averaged while the bin looks like noise, otherwise only allowed to creep up so speech does not count
+        float &noise = vp->noise[b];
+        if (!vp->ns_primed) noise = p;
+        else if (p < VOICE_PROC_NS_SPEECH * noise) noise += 0.05f * (p - noise);
+        else noise *= rise;
+
+        float nz = noise + 1e-12f;
+        float snr_post = p / nz;
+        float snr_prio = VOICE_PROC_SNR_SMOOTH * vp->clean[b] / nz +
+                         (1 - VOICE_PROC_SNR_SMOOTH) * std::max(snr_post - 1, 0.0f);
+        float g = std::max(snr_prio / (1 + snr_prio), VOICE_PROC_NS_FLOOR);
+        spec[b].re *= g;
+        spec[b].im *= g;
+        vp->clean[b] = g * g * p;
+    }
+    vp->ns_primed = true;
+
+    ifft_real(vp, spec, vp->time_buf);
+    for (int i = 0; i < n; ++i) {
+        out[i] = vp->ns_overlap[i] + vp->time_buf[i] * vp->window[i];
+        vp->ns_overlap[i] = vp->time_buf[n + i] * vp->window[n + i];
+    }
+}
+
+static void process_block(voice_proc_t *vp, int far_delay) {
+    const float *sig = vp->near_block;
+    if (vp->flags & VOICE_PROC_AEC) {
+        far_take(vp, vp->far_in, far_delay);
+        aec_block(vp, vp->far_in, vp->near_block, vp->err);
+        sig = vp->err;
+    }
+    if (vp->flags & VOICE_PROC_NS) {
+        ns_block(vp, sig, vp->near_block);
+        sig = vp->near_block;
+    }
+    for (int i = 0; i < vp->block; ++i)
+        vp->out_block[i] = static_cast<int16_t>(std::clamp(lroundf(sig[i] * 32768.0f), -32768L, 32767L));
+    vp->stats.blocks++;
+}
+
+// Defs
+
+int voice_proc_init(voice_proc_t *vp, int sample_rate, int flags, int tail_ms) {
+    voice_proc_deinit(vp);
+    if (sample_rate < 8000 || !(flags & (VOICE_PROC_AEC | VOICE_PROC_NS)) || tail_ms <= 0) {
+        loge(TAG, "unsupported configuration: %d Hz, flags %d, tail %d ms", sample_rate, flags, tail_ms);
+        return -1;
+    }
+    int n = 1;
+    while (n < sample_rate * VOICE_PROC_BLOCK_MS / 1000) n <<= 1;
+    vp->sample_rate = sample_rate;
+    vp->flags = flags;
+    vp->block = n;
+    vp->bins = n + 1;
+    vp->partitions = std::max((sample_rate * tail_ms / 1000 + n - 1) / n, 1);
+
+    bool ok = true;
+    vp->twiddle = alloc<voice_proc_cpx_t>(n, &ok);
+    vp->bitrev = alloc<uint16_t>(2 * n, &ok);
+    vp->fft_buf = alloc<voice_proc_cpx_t>(2 * n, &ok);
+    vp->spec = alloc<voice_proc_cpx_t>(vp->bins, &ok);
+    vp->time_buf = alloc<float>(2 * n, &ok);
+    vp->near_block = alloc<float>(n, &ok);
+    vp->out_block = alloc<int16_t>(n, &ok);
+    if (flags & VOICE_PROC_AEC) {
+        vp->far_size = 1;
+        while (vp->far_size < static_cast<uint32_t>(sample_rate * VOICE_PROC_FAR_MS / 1000)) vp->far_size <<= 1;
+        vp->far_ring = alloc<int16_t>(static_cast<int>(vp->far_size), &ok);
+        vp->far_in = alloc<float>(n, &ok);
+        vp->far_block = alloc<float>(2 * n, &ok);
+        vp->far_spec = alloc<voice_proc_cpx_t>(vp->partitions * vp->bins, &ok);
+        vp->weights = alloc<voice_proc_cpx_t>(vp->partitions * vp->bins, &ok);
+        vp->far_power = alloc<float>(vp->bins, &ok);
+        vp->err = alloc<float>(n, &ok);
+    }
+    if (flags & VOICE_PROC_NS) {
+        vp->window = alloc<float>(2 * n, &ok);
+        vp->ns_prev = alloc<float>(n, &ok);
+        vp->ns_overlap = alloc<float>(n, &ok);
+        vp->noise = alloc<float>(vp->bins, &ok);
+        vp->clean = alloc<float>(vp->bins, &ok);
+    }
+    if (!ok) {
+        loge(TAG, "out of memory");
+        voice_proc_deinit(vp);
+        return -1;
+    }
+
+    int bits = 0;
+    while ((1 << bits) < 2 * n) bits++;
+    for (int i = 0; i < 2 * n; ++i) {
+        int r = 0;
+        for (int b = 0; b < bits; ++b) r |= ((i >> b) & 1) << (bits - 1 - b);
+        vp->bitrev[i] = static_cast<uint16_t>(r);
+    }
+    for (int k = 0; k < n; ++k) {
+        double a = -M_PI * k / n;
+        vp->twiddle[k] = {static_cast<float>(cos(a)), static_cast<float>(sin(a))};
+    }
+    // sqrt hann, analysis times synthesis adds up to one at 50% overlap
+    if (vp->window) for (int i = 0; i < 2 * n; ++i) vp->window[i] = static_cast<float>(sin(M_PI * i / (2 * n)));
+
+    voice_proc_reset(vp);
+    logi(TAG, "%d Hz, block %d, %s%s, %d partitions (%d ms tail)", sample_rate, n,
+         flags & VOICE_PROC_AEC ? "aec " : "", flags & VOICE_PROC_NS ? "ns" : "", vp->partitions, tail_ms);
+    return 0;
+}
+
+void voice_proc_deinit(voice_proc_t *vp) {
+    free(vp->twiddle);
+    free(vp->bitrev);
+    free(vp->fft_buf);
+    free(vp->spec);
+    free(vp->time_buf);
+    free(vp->far_ring);
+    free(vp->near_block);
+    free(vp->far_in);
+    free(vp->out_block);
+    free(vp->far_block);
+    free(vp->far_spec);
+    free(vp->weights);
+    free(vp->far_power);
+    free(vp->err);
+    free(vp->window);
+    free(vp->ns_prev);
+    free(vp->ns_overlap);
+    free(vp->noise);
+    free(vp->clean);
+    vp->twiddle = vp->fft_buf = vp->spec = vp->far_spec = vp->weights = nullptr;
+    vp->time_buf = vp->near_block = vp->far_in = vp->far_block = vp->far_power = vp->err = nullptr;
+    vp->window = vp->ns_prev = vp->ns_overlap = vp->noise = vp->clean = nullptr;
+    vp->bitrev = nullptr;
+    vp->far_ring = nullptr;
+    vp->out_block = nullptr;
+    vp->far_size = 0;
+    vp->flags = 0;
+}
+
+void voice_proc_reset(voice_proc_t *vp) {
+    const int n = vp->block, bins = vp->bins;
+    vp->pos = 0;
+    if (vp->out_block) memset(vp->out_block, 0, n * sizeof(int16_t));
+    vp->far_tail = vp->far_head.load();
+    vp->far_excess = 0;
+    vp->far_synced = false;
+    if (vp->far_block) memset(vp->far_block, 0, 2 * n * sizeof(float));
+    if (vp->far_spec) memset(vp->far_spec, 0, vp->partitions * bins * sizeof(voice_proc_cpx_t));
+    if (vp->weights) memset(vp->weights, 0, vp->partitions * bins * sizeof(voice_proc_cpx_t));
+    if (vp->far_power) memset(vp->far_power, 0, bins * sizeof(float));
+    vp->far_idx = vp->constrain_idx = 0;
+    vp->warmup = vp->diverged = 0;
+    vp->near_energy = vp->err_energy = vp->echo_energy = 0;
+    if (vp->ns_prev) memset(vp->ns_prev, 0, n * sizeof(float));
+    if (vp->ns_overlap) memset(vp->ns_overlap, 0, n * sizeof(float));
+    if (vp->clean) memset(vp->clean, 0, bins * sizeof(float));
+    vp->ns_primed = false;
+    vp->stats = {};
+}
+
+int voice_proc_latency(const voice_proc_t *vp) {
+    return vp->flags & VOICE_PROC_NS ? 2 * vp->block : vp->block;
+}
+
+void voice_proc_far(voice_proc_t *vp, const int16_t *far, int frames, int channels) {
+    if (!vp->far_ring) return;
+    const uint32_t mask = vp->far_size - 1;
+    uint32_t head = vp->far_head.load(std::memory_order_relaxed);
+    uint32_t space = vp->far_size - (head - vp->far_tail.load(std::memory_order_acquire));
+    int n = static_cast<int>(std::min<uint32_t>(frames, space));
+    for (int i = 0; i < n; ++i) {
+        int32_t s = 0;
+        for (int c = 0; c < channels; ++c) s += far[i * channels + c];
+        vp->far_ring[(head + i) & mask] = static_cast<int16_t>(s / channels);
+    }
+    vp->far_head.store(head + n, std::memory_order_release);
+}
+
+void voice_proc_process(voice_proc_t *vp, int16_t *near, int frames, int far_delay) {
+    if (!vp->flags) return;
+    for (int i = 0; i < frames; ++i) {
+        vp->near_block[vp->pos] = near[i] / 32768.0f;
+        near[i] = vp->out_block[vp->pos];
+        if (++vp->pos == vp->block) {
+            // frames of this call still to come were captured after the block, the reference for them is queued too
+            process_block(vp, far_delay + frames - 1 - i);
+            vp->pos = 0;
+        }
+    }
+}
+
+voice_proc_stats_t voice_proc_stats(const voice_proc_t *vp) {
+    return vp->stats;
+}
@@ -0,0 +1,19 @@
+#include <voice_proc.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// voice_proc_eval <mic.wav> <speaker.wav|-> <out.wav> [aec|ns|both] [far delay frames]
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s <mic.wav> <speaker.wav|-> <out.wav> [aec|ns|both] [far delay frames]\n", argv[0]);
+        return 1;
+    }
+    int flags = VOICE_PROC_AEC | VOICE_PROC_NS;
+    if (argc > 4 && strcmp(argv[4], "aec") == 0) flags = VOICE_PROC_AEC;
+    if (argc > 4 && strcmp(argv[4], "ns") == 0) flags = VOICE_PROC_NS;
+    int far_delay = argc > 5 ? atoi(argv[5]) : 0;
+    const char *far_path = strcmp(argv[2], "-") == 0 ? nullptr : argv[2];
+    return voice_proc_eval_wav(argv[1], far_path, argv[3], flags, far_delay) < 0 ? 1 : 0;
+}
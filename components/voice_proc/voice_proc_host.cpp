@@ -0,0 +1,136 @@
+#include <voice_proc.h>
+
+#include <impl/log.h>
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+static const char *TAG = "VOICE_PROC";
+
+#define WAV_HEADER_SIZE 44
+#define EVAL_CHUNK_FRAMES 256 // roughly what one dma descriptor hands over
+
+typedef struct {
+    int sample_rate;
+    int channels;
+    std::vector<int16_t> samples;
+} wav_t;
+
+static uint32_t load_32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24;
+}
+
+static uint16_t load_16(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+static void store_32(uint8_t *p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static void store_16(uint8_t *p, uint16_t v) {
+    p[0] = v; p[1] = v >> 8;
+}
+
+static bool wav_load(const char *path, wav_t *wav) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        loge(TAG, "cannot open %s", path);
+        return false;
+    }
+    uint8_t h[16];
+    bool ok = fread(h, 1, 12, f) == 12 && memcmp(h, "RIFF", 4) == 0 && memcmp(h + 8, "WAVE", 4) == 0;
+    int bits = 0;
+    wav->channels = 0;
+    while (ok && fread(h, 1, 8, f) == 8) {
+        uint32_t len = load_32(h + 4);
+        if (memcmp(h, "fmt ", 4) == 0) {
+            if (len < 16 || fread(h, 1, 16, f) != 16) break;
+            wav->channels = load_16(h + 2);
+            wav->sample_rate = static_cast<int>(load_32(h + 4));
+            bits = load_16(h + 14);
+            fseek(f, len - 16 + (len & 1), SEEK_CUR);
+        } else if (memcmp(h, "data", 4) == 0) {
+            if (bits != 16 || wav->channels < 1 || wav->channels > 2) break;
+            wav->samples.resize(len / 2);
+            wav->samples.resize(fread(wav->samples.data(), 2, wav->samples.size(), f));
+            fclose(f);
+            return true;
+        } else {
+            fseek(f, len + (len & 1), SEEK_CUR);
+        }
+    }
+    loge(TAG, "%s is not a 16 bit mono or stereo wav file", path);
+    fclose(f);
+    return false;
+}
+
+static bool wav_store(const char *path, int sample_rate, const int16_t *samples, uint32_t count) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        loge(TAG, "cannot open %s", path);
+        return false;
+    }
+    uint8_t h[WAV_HEADER_SIZE];
+    memcpy(h, "RIFF", 4);
+    store_32(h + 4, 36 + count * 2);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    store_32(h + 16, 16);
+    store_16(h + 20, 1); // PCM
+    store_16(h + 22, 1);
+    store_32(h + 24, sample_rate);
+    store_32(h + 28, sample_rate * 2);
+    store_16(h + 32, 2);
+    store_16(h + 34, 16);
+    memcpy(h + 36, "data", 4);
+    store_32(h + 40, count * 2);
+    fwrite(h, 1, WAV_HEADER_SIZE, f);
+    fwrite(samples, 2, count, f);
+    fclose(f);
+    return true;
+}
+
+int voice_proc_eval_wav(const char *near_path, const char *far_path, const char *out_path, int flags, int far_delay) {
+    wav_t near, far;
+    if (!wav_load(near_path, &near)) return -1;
+    if (far_path && !wav_load(far_path, &far)) return -1;
+    if (!far_path) {
+        far.sample_rate = near.sample_rate;
+        far.channels = 1;
+        flags &= ~VOICE_PROC_AEC;
+    }
+    if (far.sample_rate != near.sample_rate) {
+        loge(TAG, "rate mismatch: near %d Hz, far %d Hz", near.sample_rate, far.sample_rate);
+        return -1;
+    }
+
+    // mono mic, as the source is configured on the device
+    const int frames = static_cast<int>(near.samples.size()) / near.channels;
+    std::vector<int16_t> out(frames);
+    for (int i = 0; i < frames; ++i) out[i] = near.samples[i * near.channels];
+    const int far_frames = static_cast<int>(far.samples.size()) / far.channels;
+
+    static voice_proc_t vp;
+    if (voice_proc_init(&vp, near.sample_rate, flags) < 0) return -1;
+
+    // same order as on the device: the speaker block goes out, then the mic block that heard it is read
+    for (int pos = 0; pos < frames; pos += EVAL_CHUNK_FRAMES) {
+        int n = std::min(EVAL_CHUNK_FRAMES, frames - pos);
+        if (pos < far_frames) voice_proc_far(&vp, far.samples.data() + pos * far.channels,
+                                             std::min(n, far_frames - pos), far.channels);
+        voice_proc_process(&vp, out.data() + pos, n, far_delay);
+    }
+
+    // line the result up with the input
+    int latency = std::min(voice_proc_latency(&vp), frames);
+    std::move(out.begin() + latency, out.end(), out.begin());
+    std::fill(out.end() - latency, out.end(), 0);
+
+    voice_proc_stats_t st = voice_proc_stats(&vp);
+    logi(TAG, "%d frames, %u blocks, erle %d dB, %u realigns, %u resets", frames, st.blocks, st.erle_db,
+         st.realigns, st.resets);
+    voice_proc_deinit(&vp);
+    return wav_store(out_path, near.sample_rate, out.data(), frames) ? frames : -1;
+}
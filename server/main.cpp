@@ -1,18 +1,27 @@
 #include <net_controller.h>
+#include <resampler.h>
 #include <impl/log.h>
 #include <impl/concurrency.h>
 
 #include <portaudio.h>
 
+#include <algorithm>
 #include <iostream>
 #include <cstring>
 #include <atomic>
+#include <vector>
 
 #define NUM_CHANNELS_SPK 2
 #define NUM_CHANNELS_MIC 1
 #define SAMPLE_RATE 44100
+#define RESAMPLE_QUALITY RS_QUALITY_HIGH
 
 #define PORT 48080
+#define RCVBUF_BYTES 0 // 0 keeps the system default
+#define SNDBUF_BYTES 0
+#define RX_MODE receiver::RX_BLOCK // RX_SPIN or RX_BUSY_POLL when a core can be given to the receive thread
+#define RX_MODE_US RX_SPIN_US
+#define FRAME_US 0 // frame duration the server asks for, the client's wins when longer. 0 takes the client's
 
 const char *TAG_GLOB = "Server";
 
@@ -20,10 +29,10 @@ class remote_sink_t {
     const char *TAG = "Remote sink";
 
     typedef short sample_t;
-    static constexpr uint32_t frames_per_buf = DATA_WIDTH / (NUM_CHANNELS_SPK * sizeof(sample_t));
     static constexpr PaSampleFormat pa_sample_type = paInt16;
 public:
     ~remote_sink_t() {
+        resampler_deinit(&rs);
         Pa_Terminate();
     }
 
@@ -70,15 +79,29 @@ public:
             pa_params.suggestedLatency = Pa_GetDeviceInfo(pa_params.device)->defaultLowInputLatency;
             break;
         }
+
+        // capture at the device rate and convert to the stream rate instead of letting the host api do it
+        device_rate = static_cast<int>(Pa_GetDeviceInfo(pa_params.device)->defaultSampleRate);
+        if (resampler_init(&rs, device_rate, SAMPLE_RATE, NUM_CHANNELS_SPK, RESAMPLE_QUALITY) == -1) {
+            device_rate = SAMPLE_RATE;
+        }
     }
 
+    // The device buffer follows the frame duration negotiated for the session
     void start() {
+        uint32_t frames = net_controller::frame_bytes(SAMPLE_RATE, NUM_CHANNELS_SPK) / (NUM_CHANNELS_SPK * sizeof(sample_t));
+        if (stream && frames != frames_per_buf) {
+            Pa_CloseStream(stream);
+            stream = nullptr;
+        }
         if (!stream) {
+            frames_per_buf = frames;
+            conv_buf.resize(resampler_out_frames(&rs, frames_per_buf) * NUM_CHANNELS_SPK);
             Pa_OpenStream(
                     &stream,
                     &pa_params,
                     nullptr,
-                    SAMPLE_RATE,
+                    device_rate,
                     frames_per_buf,
                     paClipOff,      /* we won't output out of range samples so don't bother clipping them */
                     send_to_remote,
@@ -99,22 +122,32 @@ private:
                               void *user_data) {
         auto *body = (remote_sink_t *) user_data;
 
+        if (!resampler_passthrough(&body->rs)) {
+            frame_count = resampler_process(&body->rs, (const sample_t *) input_buf, frame_count,
+                                            body->conv_buf.data(), body->conv_buf.size() / NUM_CHANNELS_SPK);
+            input_buf = body->conv_buf.data();
+        }
         sender::send((uint8_t *) input_buf, frame_count * body->pa_params.channelCount * sizeof(sample_t));
         return paContinue;
     }
 
     PaStreamParameters pa_params{};
     PaStream *stream = nullptr;
+
+    int device_rate = SAMPLE_RATE;
+    uint32_t frames_per_buf = 0;
+    resampler_t rs;
+    std::vector<sample_t> conv_buf;
 };
 
 class remote_source_t {
     const char *TAG = "Remote source";
 
     typedef short sample_t;
-    static constexpr uint32_t frames_per_buf = DATA_WIDTH / (NUM_CHANNELS_MIC * sizeof(sample_t));
     static constexpr PaSampleFormat pa_sample_type = paInt16;
 public:
     ~remote_source_t() {
+        resampler_deinit(&rs);
         Pa_Terminate();
     }
 
@@ -163,15 +196,29 @@ public:
             pa_params.suggestedLatency = Pa_GetDeviceInfo(pa_params.device)->defaultLowInputLatency;
             break;
         }
+
+        device_rate = static_cast<int>(Pa_GetDeviceInfo(pa_params.device)->defaultSampleRate);
+        if (resampler_init(&rs, SAMPLE_RATE, device_rate, NUM_CHANNELS_MIC, RESAMPLE_QUALITY) == -1) {
+            device_rate = SAMPLE_RATE;
+        }
     }
 
     void start() {
+        uint32_t frames = net_controller::frame_bytes(SAMPLE_RATE, NUM_CHANNELS_MIC) / (NUM_CHANNELS_MIC * sizeof(sample_t));
+        if (stream && frames != frames_per_buf) {
+            Pa_CloseStream(stream);
+            stream = nullptr;
+        }
         if (!stream) {
+            frames_per_buf = frames;
+            // comfort noise and decoded frames come in up to DATA_WIDTH at once, whatever the frame
+            uint32_t frames_in = std::max<uint32_t>(frames_per_buf, DATA_WIDTH / (NUM_CHANNELS_MIC * sizeof(sample_t)));
+            conv_buf.resize(resampler_out_frames(&rs, frames_in) * NUM_CHANNELS_MIC);
             Pa_OpenStream(
                     &stream,
                     nullptr,
                     &pa_params,
-                    SAMPLE_RATE,
+                    device_rate,
                     frames_per_buf,
                     0,
                     nullptr,
@@ -187,11 +234,22 @@ public:
 private:
     static void on_receive_data(const uint8_t *data, size_t bytes, void *client_data) {
         auto body = (remote_source_t *) client_data;
-        Pa_WriteStream(body->stream, data, bytes / (NUM_CHANNELS_MIC * sizeof(sample_t)));
+        size_t frames = bytes / (NUM_CHANNELS_MIC * sizeof(sample_t));
+        if (!resampler_passthrough(&body->rs)) {
+            frames = resampler_process(&body->rs, (const sample_t *) data, frames,
+                                       body->conv_buf.data(), body->conv_buf.size() / NUM_CHANNELS_MIC);
+            data = (const uint8_t *) body->conv_buf.data();
+        }
+        Pa_WriteStream(body->stream, data, frames);
     }
 
     PaStreamParameters pa_params{};
     PaStream *stream = nullptr;
+
+    int device_rate = SAMPLE_RATE;
+    uint32_t frames_per_buf = 0;
+    resampler_t rs;
+    std::vector<sample_t> conv_buf;
 };
 
 enum server_state_t {
@@ -227,6 +285,7 @@ static int remote_cmd_cb(net_controller::cmd_t cmd, void *par) {
         endpoint_get_addr_v4(&enp, addr);
         logi(TAG_GLOB, "Successfully connected to %s:%d", addr, endpoint_get_port(&enp));
         sender::set_endpoint(&enp);
+        sender::set_rate_control(true);
         conn_state = SV_CONNECTED;
         ctx->spk.start();
     }
@@ -262,6 +321,11 @@ int main() {
 
     conn_state = SV_ACCEPT;
 
+    net_controller::set_buffers(RCVBUF_BYTES, SNDBUF_BYTES);
+    net_controller::set_frame_us(FRAME_US);
+    sender::set_format(SAMPLE_RATE, NUM_CHANNELS_SPK);
+    receiver::set_channels(NUM_CHANNELS_MIC);
+    if (receiver::set_rx_mode(RX_MODE, RX_MODE_US)) loge(TAG_GLOB, "receive mode %d is not available", RX_MODE);
     receiver::bind(PORT);
     receiver::start();
 